@@ -0,0 +1,83 @@
+/*
+ * binlog.c
+ *
+ * Deferred binary trace log, see binlog.h
+ */
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+#include "uart.h"
+#include "binlog.h"
+
+// argument sizes for every message, packed as 2 bits per argument (0, 1, 2 or 4 bytes)
+#define BINLOG_SIZE(s) ((s)==4?3:(s))
+#define BINLOG_ID(name, size1, size2, size3, text) (BINLOG_SIZE(size1)|(BINLOG_SIZE(size2)<<2)|(BINLOG_SIZE(size3)<<4)),
+static const uint8_t binlogsizes[BINLOG_ID_COUNT] PROGMEM = {
+#include "binlogids.h"
+};
+#undef BINLOG_ID
+
+static uint8_t ring[BINLOG_BUFFER_SIZE];
+static volatile uint8_t head = 0;
+static volatile uint8_t tail = 0;
+static volatile uint8_t dropped = 0;
+
+// stores a single argument in the record, little endian, and returns the new record length
+static uint8_t packArgument(uint8_t* record, uint8_t length, uint8_t size, uint32_t arg){
+	if(size==3)size=4;
+	while(size--){
+		record[length++]=(uint8_t)arg;
+		arg>>=8;
+	}
+	return length;
+}
+
+void binlogRecord(uint8_t id, uint32_t arg1, uint32_t arg2, uint32_t arg3){
+	uint8_t record[BINLOG_MAX_ARGS+2];
+	uint8_t length = 2;
+	uint8_t sizes;
+	uint8_t count;
+
+	// build the record on the stack first, so the ring only has to be locked for the copy
+	sizes = pgm_read_byte(&binlogsizes[id]);
+	record[0]=BINLOG_SYNC;
+	record[1]=id;
+	length=packArgument(record,length,sizes&0x03,arg1);
+	length=packArgument(record,length,(sizes>>2)&0x03,arg2);
+	length=packArgument(record,length,(sizes>>4)&0x03,arg3);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		// free space in the ring, one byte is always kept free to tell a full ring from an empty one
+		if(((tail-head-1)&(BINLOG_BUFFER_SIZE-1))<length){
+			if(dropped<0xFF)dropped++;
+		} else {
+			for(count=0;count<length;count++){
+				ring[head]=record[count];
+				head=(head+1)&(BINLOG_BUFFER_SIZE-1);
+			}
+		}
+	}
+}
+
+void binlogFlush(void){
+	uint8_t lost;
+
+	// records are only ever added at the head, so everything up to the current head is complete
+	while(tail!=head){
+		uart_putc(ring[tail]);
+		tail=(tail+1)&(BINLOG_BUFFER_SIZE-1);
+	}
+
+	// report overflows directly, there's room on the UART now
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		lost = dropped;
+		dropped = 0;
+	}
+	if(lost){
+		uart_putc(BINLOG_SYNC);
+		uart_putc(LOG_DROPPED);
+		uart_putc(lost);
+	}
+}
@@ -0,0 +1,69 @@
+/**
+ *  @file
+ *  @defgroup Jelmers FLEX decoder binary trace log <binlog.h>
+ *  @code #include <binlog.h> @endcode
+ *
+ *  @brief Deferred binary trace log. Instead of formatting text from time-critical code, a trace point only stores a
+ *	record (BINLOG_SYNC, message ID and the raw argument bytes) in a small ring buffer. The ring is written to the UART
+ *	by the frame processor, between frames, and is expanded into text on the Linux side by flexlog, using the same
+ *	message table (binlogids.h).
+ *
+ *	The sync byte never occurs in the normal text output, so records can be mixed with the regular serial output.
+ *	Tracing is compiled in with BINLOG, and is implicitly enabled for SERDEBUG builds.
+ */
+
+#ifndef BINLOG_H_
+#define BINLOG_H_
+
+//#define BINLOG
+
+#if defined(SERDEBUG) && !defined(BINLOG)
+#define BINLOG
+#endif
+
+// size of the ring buffer holding pending records, must be a power of 2
+#ifndef BINLOG_BUFFER_SIZE
+#define BINLOG_BUFFER_SIZE 128
+#endif
+
+// first byte of every record (DLE)
+#define BINLOG_SYNC 0x10
+
+// maximum number of argument bytes in a single record
+#define BINLOG_MAX_ARGS 12
+
+// message IDs, in table order
+#define BINLOG_ID(name, size1, size2, size3, text) name,
+enum binlogid {
+#include "binlogids.h"
+	BINLOG_ID_COUNT
+};
+#undef BINLOG_ID
+
+/** @brief  Stores a record in the ring buffer. Arguments are truncated to the sizes given in the message table.
+ *	Safe to call from any context, including (nested) interrupts
+ *  @param  id Message ID (see binlogids.h)
+ *	@param	arg1 First argument
+ *	@param	arg2 Second argument
+ *	@param	arg3 Third argument
+ */
+void binlogRecord(uint8_t id, uint32_t arg1, uint32_t arg2, uint32_t arg3);
+
+/** @brief  Writes all pending records to the UART. Must only be called from the frame processor, as that is the only
+ *	place that writes to the UART
+ */
+void binlogFlush(void);
+
+#ifdef BINLOG
+#define LOG0(id) binlogRecord((id), 0, 0, 0)
+#define LOG1(id, a) binlogRecord((id), (a), 0, 0)
+#define LOG2(id, a, b) binlogRecord((id), (a), (b), 0)
+#define LOG3(id, a, b, c) binlogRecord((id), (a), (b), (c))
+#else
+#define LOG0(id)
+#define LOG1(id, a)
+#define LOG2(id, a, b)
+#define LOG3(id, a, b, c)
+#endif
+
+#endif /* BINLOG_H_ */
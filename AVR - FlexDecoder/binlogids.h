@@ -0,0 +1,66 @@
+/**
+ *  @file
+ *  @defgroup Jelmers FLEX decoder binary log message table <binlogids.h>
+ *  @code #include <binlogids.h> @endcode
+ *
+ *  @brief Table of all binary log records. Every entry is BINLOG_ID(name, size1, size2, size3, text), where the sizes are
+ *	the number of bytes (0, 1, 2 or 4) of each argument as it is stored in the record, and text is the printf-style
+ *	format the host tool uses to expand the record. Record IDs are assigned in table order, so only ever add entries at
+ *	the end, or the host tool will have to be rebuilt together with the firmware.
+ *
+ *	This file is included by both the firmware (binlog.h) and the Linux host tool (flexlog.c), and deliberately has no
+ *	include guard.
+ */
+
+// first stage (flex.c)
+BINLOG_ID(LOG_WORD_RECOVERED,		1, 0, 0, "ERROR IN WORD %lu RECOVERED!")
+BINLOG_ID(LOG_WORD_ERROR,			1, 0, 0, "ERROR IN WORD %lu")
+BINLOG_ID(LOG_PARTIAL_FRAME,		1, 0, 0, "-- Partial frame %lu, terribly sorry.")
+BINLOG_ID(LOG_FIW_ERROR,			0, 0, 0, "-- Error in FIW, aborting frame")
+BINLOG_ID(LOG_BLOCK_ALLOC_FAIL,		1, 0, 0, "CALLOC FOR BLOCK %lu FAILED :(")
+
+// second stage (flexprocess.c)
+BINLOG_ID(LOG_VECTOR,				1, 1, 0, "| MESSAGE location word: %lu length:%lu")
+BINLOG_ID(LOG_LOCAL_ID,				1, 0, 0, "| LOCAL ID SET, TZ=%lu")
+BINLOG_ID(LOG_DATE,					1, 1, 2, "| DATE SET: %lu/%lu/%lu")
+BINLOG_ID(LOG_TIME,					1, 1, 1, "| TIME SET: %lu:%lu:%lu")
+BINLOG_ID(LOG_SPARE,				0, 0, 0, "| SPARE/OFFSET SET")
+BINLOG_ID(LOG_MAPPING_NEW,			1, 1, 0, "| New mapping for temporary address 0x1f780%lx frame %lu")
+BINLOG_ID(LOG_MAPPING_JOIN,			4, 1, 1, "| Address word %06lX will join temporary address 0x1f780%lx for frame %lu")
+BINLOG_ID(LOG_MESSAGE_EXPIRED,		0, 0, 0, "| ==-- Message expired, deleted --==")
+BINLOG_ID(LOG_PROC_COLLISION,		0, 0, 0, "!!!! - Frame dropped, the processor fell more than a frame behind !!!!")
+BINLOG_ID(LOG_BIW_REPAIRED,			1, 0, 0, "-- Recovered BIW with %lu bit error")
+BINLOG_ID(LOG_BIW_FAIL,				1, 0, 0, "-- Unable to validate/repair BIW for frame %lu, frame discarded")
+BINLOG_ID(LOG_FRAME,				1, 1, 1, "+FRAME C:%lu F:%lu LENGTH:%lu")
+BINLOG_ID(LOG_FRAME_BIW,			1, 1, 1, "| BI-LEN:%lu VECT: %lu PRIORITY ADR: %lu")
+BINLOG_ID(LOG_FRAME_RSSI,			1, 1, 2, "| Signal: %lu Noise: %lu used: %lu bytes")
+BINLOG_ID(LOG_IDLE,					0, 0, 0, "| IDLE...")
+BINLOG_ID(LOG_VECTOR_REPAIRED,		0, 0, 0, "2-bit error in vector repaired! ")
+BINLOG_ID(LOG_VECTOR_DISCARDED,		0, 0, 0, "Irrepairable vector discarded :(")
+BINLOG_ID(LOG_FRAME_DONE,			2, 2, 2, "\\_______________________________________ Frame processed in %lu ms - Memory used/free: %lu/%lu bytes")
+
+// log housekeeping
+BINLOG_ID(LOG_DROPPED,				1, 0, 0, "-- Binary log overflow, %lu records dropped")
+
+// repair policy (flex.c)
+BINLOG_ID(LOG_BLOCK_QUALITY,		1, 1, 1, "BLOCK %lu: %lu words failed, repair policy %lu")
+
+// fragment store (flexprocess.c)
+BINLOG_ID(LOG_MESSAGE_EVICTED,		0, 0, 0, "-- Message store full, oldest message flushed")
+
+// subscription filter (flexprocess.c)
+BINLOG_ID(LOG_VECTOR_FILTERED,		0, 0, 0, "-- Message skipped, no subscribed address")
+
+// duplicate suppression (flexprocess.c)
+BINLOG_ID(LOG_DUPLICATE,			1, 0, 0, "-- Duplicate fragment dropped (repeat frame: %lu)")
+
+// fragment verification (flexprocess.c)
+BINLOG_ID(LOG_FRAGMENT_REJECTED,	2, 2, 0, "-- Fragment check mismatch, sent %03lX computed %03lX")
+BINLOG_ID(LOG_SIGNATURE_REJECTED,	1, 1, 0, "-- Signature mismatch, sent %02lX computed %02lX")
+
+// frame scheduling (flexprocess.c)
+BINLOG_ID(LOG_FRAME_SKIPPED,		1, 0, 0, "-- Frame not monitored by any subscribed pager, %lu addresses skipped")
+
+// mapping table (flexprocess.c)
+BINLOG_ID(LOG_MAPPING_REJECTED,		1, 1, 1, "-- Mapping to temporary address 0x1f780%lx for frame %lu dropped, row taken by frame %lu")
+BINLOG_ID(LOG_MAPPING_JOIN_LONG,		4, 0, 0, "|   long address, second word %06lX")
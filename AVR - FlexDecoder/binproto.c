@@ -0,0 +1,239 @@
+/*
+ * binproto.c
+ *
+ * Binary serial protocol, see binproto.h
+ */
+
+#include <avr/io.h>
+#include <util/crc16.h>
+
+#include "uart.h"
+#include "flex.h"
+#include "flexprocess.h"
+#include "binproto.h"
+
+// fields of a record, in the order in which they're sent. Frame records only have the cycle and frame number, message
+// records only the fields after those
+#define FIELD_TYPE 0
+#define FIELD_CYCLE 1
+#define FIELD_FRAME 2
+#define FIELD_COUNT 3
+#define FIELD_ADDRESS 4
+#define FIELD_TEXTLENGTH 5
+#define FIELD_TEXT 6
+#define FIELD_PAYLOADLENGTH 7
+#define FIELD_PAYLOAD 8
+#define FIELD_CRC 9
+#define FIELD_CRC2 10
+#define FIELD_DONE 11
+
+// longest run of bytes without a 0 in a COBS block
+#define COBS_RUN 254
+
+// produces the bytes of a record one at a time. The COBS encoder has to know how far the next 0 is before it can send a
+// block, so it runs a copy of this state ahead, and the record is never stored anywhere
+struct recordstate {
+	uint8_t type;
+	uint8_t field;
+	uint8_t varint;					// set while a varint is being sent
+	uint64_t value;					// bits of the varint that still have to be sent
+	uint8_t cycle;
+	uint8_t frame;
+	struct message* msg;
+	uint16_t index;					// address, or payload byte
+	struct messagesegment* segment;
+	uint16_t offset;
+	struct messagespan* span;
+	uint8_t word;					// next word of the span
+	uint8_t bits;					// bits in the payload stream
+	uint32_t stream;
+	uint16_t crc;
+};
+
+static void loadVarint(struct recordstate* st, uint64_t value){
+	st->value=value;
+	st->varint=1;
+}
+
+// moves on to the next field that has something to send, varint fields are loaded right away
+static void nextField(struct recordstate* st){
+	while(1){
+		st->field++;
+		switch(st->field){
+			case FIELD_CYCLE:
+				if(st->msg)continue;
+				loadVarint(st,st->cycle);
+				return;
+			case FIELD_FRAME:
+				if(st->msg)continue;
+				loadVarint(st,st->frame);
+				return;
+			case FIELD_COUNT:
+				if(!st->msg){
+					st->field=FIELD_CRC;
+					return;
+				}
+				st->index=0;
+				loadVarint(st,st->msg->addresslist.addresscount);
+				return;
+			case FIELD_ADDRESS:
+				if(st->index>=st->msg->addresslist.addresscount)continue;
+				loadVarint(st,getCapcode(st->msg->addresslist.addresspointer[st->index++]));
+				// back to this field for the next address
+				st->field=FIELD_COUNT;
+				return;
+			case FIELD_TEXTLENGTH:
+				st->segment=st->msg->text;
+				st->offset=0;
+				loadVarint(st,st->msg->messagelength);
+				return;
+			case FIELD_TEXT:
+				while(st->segment&&!st->segment->length)st->segment=st->segment->next;
+				if(!st->segment)continue;
+				return;
+			case FIELD_PAYLOADLENGTH:
+				st->index=0;
+				st->span=st->msg->spans;
+				st->word=0;
+				st->bits=0;
+				st->stream=0;
+				loadVarint(st,st->msg->payloadbits/8);
+				return;
+			case FIELD_PAYLOAD:
+				if(st->index>=st->msg->payloadbits/8)continue;
+				return;
+			default:
+				return;
+		}
+	}
+}
+
+// takes the next byte from the payload, the words are shifted through a 32 bit register as in outputPayload()
+static uint8_t payloadByte(struct recordstate* st){
+	uint32_t word;
+	uint8_t available;
+	uint8_t byte;
+	while(st->bits<8){
+		while(st->word>=st->span->count){
+			st->span=st->span->next;
+			st->word=0;
+		}
+		if(st->span->frame){
+			word=*getWord(st->span->frame,st->span->start+st->word);
+		} else {
+			word=st->span->words[st->word];
+		}
+		word&=0xFFFFF800;
+		available=21;
+		if(st->word==0){
+			word<<=st->span->skip;
+			available-=st->span->skip;
+		}
+		st->stream|=word>>st->bits;
+		st->bits+=available;
+		st->word++;
+	}
+	// bytes are packed lsb first
+	byte=bitswitch((uint8_t)(st->stream>>24));
+	st->stream<<=8;
+	st->bits-=8;
+	return byte;
+}
+
+static uint8_t recordByte(struct recordstate* st){
+	uint8_t byte;
+	if(st->varint){
+		byte=st->value&0x7F;
+		st->value>>=7;
+		if(st->value){
+			byte|=0x80;
+		} else {
+			st->varint=0;
+			nextField(st);
+		}
+	} else {
+		switch(st->field){
+			case FIELD_TYPE:
+				byte=st->type;
+				nextField(st);
+				break;
+			case FIELD_TEXT:
+				byte=st->segment->text[st->offset++];
+				if(st->offset>=st->segment->length){
+					st->offset=0;
+					do{
+						st->segment=st->segment->next;
+					}while(st->segment&&!st->segment->length);
+					if(!st->segment)nextField(st);
+				}
+				break;
+			case FIELD_PAYLOAD:
+				byte=payloadByte(st);
+				st->index++;
+				if(st->index>=st->msg->payloadbits/8)nextField(st);
+				break;
+			case FIELD_CRC:
+				st->field=FIELD_CRC2;
+				return (uint8_t)st->crc;
+			default:
+				st->field=FIELD_DONE;
+				return (uint8_t)(st->crc>>8);
+		}
+	}
+	st->crc=_crc_ccitt_update(st->crc,byte);
+	return byte;
+}
+
+// sends a record COBS encoded, between two 0 bytes
+static void outputRecord(struct recordstate* st){
+	struct recordstate scan;
+	uint8_t run;
+	uint8_t count;
+	uint8_t zero;
+
+	st->field=FIELD_TYPE;
+	st->varint=0;
+	st->crc=0xFFFF;
+	uart_putc(0);
+	while(1){
+		// find the length of the block, up to the next 0
+		scan=*st;
+		zero=0;
+		for(run=0;(run<COBS_RUN)&&(scan.field!=FIELD_DONE);run++){
+			if(recordByte(&scan)==0){
+				zero=1;
+				break;
+			}
+		}
+		uart_putc(run+1);
+		for(count=0;count<run;count++){
+			uart_putc(recordByte(st));
+		}
+		if(zero){
+			recordByte(st);
+		} else if(run<COBS_RUN){
+			break;
+		}
+	}
+	uart_putc(0);
+}
+
+void protoFrame(uint8_t type, uint8_t cycle, uint8_t frame){
+	struct recordstate st;
+	st.type=type;
+	st.msg=0;
+	st.cycle=cycle;
+	st.frame=frame;
+	outputRecord(&st);
+}
+
+void protoMessage(struct message* msg, uint8_t complete){
+	struct recordstate st;
+	if(!complete){
+		st.type=BINPROTO_TRUNCATED;
+	} else {
+		st.type=msg->priority?BINPROTO_PRIORITY:BINPROTO_MESSAGE;
+	}
+	st.msg=msg;
+	outputRecord(&st);
+}
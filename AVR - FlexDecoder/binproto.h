@@ -0,0 +1,51 @@
+/**
+ *  @file
+ *  @defgroup Jelmers FLEX decoder binary serial protocol <binproto.h>
+ *  @code #include <binproto.h> @endcode
+ *
+ *  @brief Protocol v2 for the parseable output (non-SERDEBUG builds). With BINPROTO defined, frames and messages are
+ *	sent as binary records instead of the [[frame]]/[[msg]] text. Every record is COBS encoded, and sent between two
+ *	0x00 bytes, so a receiver can always find the start of the next record, whatever the text output and trace records
+ *	in between look like (those fail the crc and are dropped).
+ *
+ *	Before encoding, a record is a type byte, the fields of that type, and a CRC-CCITT (0x8408, start 0xFFFF) over the
+ *	type and the fields, 2 bytes little endian. Numbers are varints: 7 bits per byte, least significant group first, bit
+ *	7 set on every byte but the last.
+ *		'F' frame start		cycle, frame
+ *		'M' message			address count, capcodes, text length, text, payload length, payload
+ *		'P' priority msg	as 'M', for a message sent to one of the priority addresses
+ *		'T' truncated msg	as 'M', for a message that expired before all its fragments were received
+ *		'E' frame end		cycle, frame
+ *	The payload of hex and secure messages is sent as bytes (packed lsb first), instead of hex digits.
+ *
+ *	Compared to the text, a message costs about 10 bytes on top of its text and capcodes instead of 55, and a capcode
+ *	takes 3 or 4 bytes instead of up to 11. The receiver decodes a record in place, and the text can be used where it
+ *	is. The text output is used when BINPROTO isn't defined.
+ */
+
+#ifndef BINPROTO_H_
+#define BINPROTO_H_
+
+//#define BINPROTO
+
+#define BINPROTO_FRAME 'F'
+#define BINPROTO_MESSAGE 'M'
+#define BINPROTO_PRIORITY 'P'
+#define BINPROTO_END 'E'
+#define BINPROTO_TRUNCATED 'T'
+
+/** @brief  Sends a frame start or frame end record
+ *  @param  type BINPROTO_FRAME or BINPROTO_END
+ *	@param	cycle Cycle number
+ *	@param	frame Frame number
+ */
+void protoFrame(uint8_t type, uint8_t cycle, uint8_t frame);
+
+/** @brief  Sends a message record, as a priority message if the message has the priority flag set. Must only be called
+ *	from the frame processor
+ *  @param  msg Pointer to the message
+ *	@param	complete 1 if all fragments were received, 0 for a message that expired
+ */
+void protoMessage(struct message* msg, uint8_t complete);
+
+#endif /* BINPROTO_H_ */
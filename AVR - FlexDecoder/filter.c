@@ -0,0 +1,133 @@
+/*
+ * filter.c
+ *
+ * Capcode subscription filter, see filter.h
+ */
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <util/atomic.h>
+
+#include "uart.h"
+#include "filter.h"
+
+static uint8_t filteron = 0;
+
+static char line[FILTER_LINE];
+static uint8_t linelength = 0;
+
+// folds the capcode to an index in the bitmap
+static uint32_t filterIndex(uint64_t capcode){
+	uint32_t index = 0;
+	while(capcode){
+		index^=(uint32_t)capcode;
+		capcode>>=FILTER_SHIFT;
+	}
+	return index&(FILTER_BITS-1);
+}
+
+static void writeByte(uint16_t address, uint8_t value){
+	// the frame processor reads the EEPROM from an interrupt, so the address may not change while a write is started.
+	// Interrupts are only blocked to start the write, not while waiting for the previous one to finish
+	eeprom_busy_wait();
+	ATOMIC_BLOCK(ATOMIC_FORCEON){
+		eeprom_update_byte((uint8_t*)address,value);
+	}
+}
+
+void initFilter(void){
+	filteron=(eeprom_read_byte((const uint8_t*)FILTER_FLAG_ADDRESS)==FILTER_ON);
+}
+
+uint8_t filterMatch(uint64_t capcode){
+	uint32_t index;
+	if(!filteron)return 1;
+	index=filterIndex(capcode);
+	return (eeprom_read_byte((const uint8_t*)(uint16_t)(index>>3))>>(index&0x07))&0x01;
+}
+
+void filterAdd(uint64_t capcode){
+	uint32_t index = filterIndex(capcode);
+	uint8_t home = (uint8_t)capcode&0x7F;
+	uint8_t bits;
+	bits=eeprom_read_byte((const uint8_t*)(uint16_t)(index>>3));
+	writeByte(index>>3,bits|(1<<(index&0x07)));
+	bits=eeprom_read_byte((const uint8_t*)(FILTER_FRAMES_ADDRESS+(home>>3)));
+	writeByte(FILTER_FRAMES_ADDRESS+(home>>3),bits|(1<<(home&0x07)));
+}
+
+uint8_t filterFrame(uint8_t frame, uint8_t collapse){
+	// a pager wakes up in every frame that matches its home frame modulo 2^collapse
+	uint8_t step;
+	uint8_t home;
+	if(!filteron)return 1;
+	if(collapse>PAGER_COLLAPSE)collapse=PAGER_COLLAPSE;
+	step=1<<collapse;
+	for(home=frame%step;home<128;home+=step){
+		if((eeprom_read_byte((const uint8_t*)(FILTER_FRAMES_ADDRESS+(home>>3)))>>(home&0x07))&0x01)return 1;
+	}
+	return 0;
+}
+
+void filterClear(void){
+	uint16_t count;
+	for(count=0;count<FILTER_BITS/8;count++){
+		writeByte(count,0x00);
+	}
+	for(count=0;count<16;count++){
+		writeByte(FILTER_FRAMES_ADDRESS+count,0x00);
+	}
+}
+
+void filterEnable(uint8_t on){
+	filteron=0;
+	writeByte(FILTER_FLAG_ADDRESS,on?FILTER_ON:0xFF);
+	filteron=on;
+}
+
+static void filterExecute(void){
+	uint64_t capcode = 0;
+	uint8_t count;
+	if((linelength<2)||(line[0]!='F'))return;
+	switch(line[1]){
+		case 'C':
+			// the filter stays enabled with an empty bitmap, so every capcode is rejected until the FA lines are in
+			filterEnable(1);
+			filterClear();
+			break;
+		case 'N':
+			filterEnable(1);
+			break;
+		case 'O':
+			filterEnable(0);
+			break;
+		case 'A':
+			if(linelength==2)return;
+			for(count=2;count<linelength;count++){
+				if((line[count]<'0')||(line[count]>'9'))return;
+				capcode=(capcode*10)+(line[count]-'0');
+			}
+			filterAdd(capcode);
+			break;
+	}
+}
+
+void filterPoll(void){
+	unsigned int data;
+	while(1){
+		data=uart_getc();
+		if(data&UART_NO_DATA)return;
+
+		// a line with a receive error (or one that's too long) is dropped entirely
+		if(data&0xFF00){
+			linelength=FILTER_LINE;
+		}
+		data&=0xFF;
+		if((data=='\r')||(data=='\n')){
+			if(linelength<FILTER_LINE)filterExecute();
+			linelength=0;
+		} else if(linelength<FILTER_LINE){
+			line[linelength++]=data;
+		}
+	}
+}
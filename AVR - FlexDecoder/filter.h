@@ -0,0 +1,83 @@
+/**
+ *  @file
+ *  @defgroup Jelmers FLEX decoder capcode subscription filter <filter.h>
+ *  @code #include <filter.h> @endcode
+ *
+ *  @brief Decides which messages are decoded at all. The filter is a bitmap in EEPROM, indexed by the capcode folded to
+ *	FILTER_SHIFT bits. The frame processor checks it right after the vectors are indexed, messages for capcodes that
+ *	aren't subscribed are never repaired, allocated, unpacked or output. On the ATmega328P the bitmap has 4096 bits,
+ *	so some unsubscribed capcodes will share a bit with a subscribed one and get through; with FILTER_SHIFT 21 (host
+ *	builds) every short address has a bit of its own.
+ *
+ *	The bitmap is kept in EEPROM so it survives a restart, and can be reloaded at any time over the serial port with
+ *	single line commands (terminated by CR or LF):
+ *		FC				clear the bitmap and enable the filter
+ *		FA<capcode>		subscribe a capcode
+ *		FN				enable the filter
+ *		FO				disable the filter, every message is decoded
+ *	Subscribing a capcode also marks its home frame (the 7 lsbs of the capcode). Pagers only wake up in the frames that
+ *	match their home frame in the lowest 'collapse' bits, so frames that match none of the home frames don't have to be
+ *	decoded at all.
+ *
+ *	Writing the EEPROM is slow (clearing it takes about 2 seconds), the sender has to pace the commands. A freshly erased
+ *	EEPROM has the filter disabled.
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+// number of bits the capcode is folded to, the bitmap takes 2^FILTER_SHIFT bits of EEPROM
+#ifndef FILTER_SHIFT
+#define FILTER_SHIFT 12
+#endif
+#define FILTER_BITS (1UL<<FILTER_SHIFT)
+
+// EEPROM layout: the bitmap, followed by the enable flag and a bitmap of the home frames of the subscribed capcodes
+#define FILTER_FLAG_ADDRESS (FILTER_BITS/8)
+#define FILTER_ON 0x01
+#define FILTER_FRAMES_ADDRESS (FILTER_FLAG_ADDRESS+1)
+
+// collapse value the pagers are programmed with. Pagers use the smaller of this and the collapse value of the system
+#ifndef PAGER_COLLAPSE
+#define PAGER_COLLAPSE 7
+#endif
+
+// longest command line
+#define FILTER_LINE 16
+
+/** @brief  Reads the enable flag from EEPROM, called once at startup
+ */
+void initFilter(void);
+
+/** @brief  Checks if a capcode is subscribed
+ *  @param  capcode Capcode to check
+ *  @return 1 if the capcode is subscribed or the filter is disabled, 0 if messages for it can be skipped
+ */
+uint8_t filterMatch(uint64_t capcode);
+
+/** @brief  Subscribes a capcode
+ *  @param  capcode Capcode to add
+ */
+void filterAdd(uint64_t capcode);
+
+/** @brief  Checks if a subscribed pager wakes up in a frame
+ *  @param  frame Frame number
+ *	@param	collapse Collapse value from the BIW of the frame
+ *  @return 1 if a subscribed pager monitors the frame or the filter is disabled, 0 if the frame can be skipped
+ */
+uint8_t filterFrame(uint8_t frame, uint8_t collapse);
+
+/** @brief  Clears the bitmap, no capcode is subscribed afterwards
+ */
+void filterClear(void);
+
+/** @brief  Enables or disables the filter
+ *  @param  on 1 to enable the filter, 0 to decode every message
+ */
+void filterEnable(uint8_t on);
+
+/** @brief  Reads and executes filter commands from the UART, must be called from the main loop
+ */
+void filterPoll(void);
+
+#endif /* FILTER_H_ */
@@ -24,19 +24,18 @@
 #include "uart.h"
 
 #include <util/atomic.h>
+#include <avr/pgmspace.h>
 #include <stdlib.h>
 
+//#define SERDEBUG
+
 #include "flex.h"
 #include "flexprocess.h"
-
-//#define SERDEBUG
+#include "binlog.h"
+#include "telemetry.h"
 
 struct rx current;
 
-#ifdef SERDEBUG
-	char buffer[10];
-#endif
-
 uint32_t currentword32 = 0;
 uint16_t currentword16 = 0;
 uint8_t currentbyte = 0;
@@ -44,20 +43,41 @@ uint8_t synced = 0;
 uint8_t badsyncs = 0;
 volatile uint8_t state = 0;
 
-char bitswitch(char b){
-	// a really cool way to reverse bit order. Not sure if it's the fastest, but it works!
-	b = (b * 0x0202020202ULL & 0x010884422010ULL) % 1023;
-	return (b);
+uint32_t getTicks(void){
+	uint32_t ticks;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		ticks=sys.uptime*TICKS_PER_SUBSECOND+TCNT0;
+	}
+	return ticks;
+}
+
+// nibbles with their bit order reversed
+static const uint8_t reversetable[16] PROGMEM = {
+	0x0,0x8,0x4,0xC,0x2,0xA,0x6,0xE,0x1,0x9,0x5,0xD,0x3,0xB,0x7,0xF,
+};
+
+uint8_t bitswitch(uint8_t b){
+	// a nibble at a time from a table, the AVR has no fast 64 bit multiply or modulo for the usual trick
+	return pgm_read_byte(&reversetable[b>>4])|(pgm_read_byte(&reversetable[b&0x0F])<<4);
 }
 
 /* this function will validate a single word in a frame, and/or repair single or double bit errors
 	task = VALIDATE_FLEC_CHECKSUM|REPAIR1|REPAIR2
 	returns: VALIDATE_FAIL, VALIDATE_PASS, REPAIRED_1 (1 bit repaired) , REPAIRED_2 (2 bits repaired)
+	The repair search is limited by the policy of the block the word is in (see repairPolicy)
 */
 uint8_t validateWord(struct frame* frame, uint8_t word, uint8_t task){
 	uint32_t wordvalue;
-	wordvalue = *getWord(frame, word);
-	if(validateBCH(wordvalue)){
+	uint8_t counter;
+	uint8_t counter2;
+	uint8_t result = VALIDATE_FAIL;
+	struct block* block = frame->block[word/8];
+	uint8_t mask = 1<<(word%8);
+	wordvalue = block->word[word%8];
+	
+	// words that passed (or were repaired by) validateBlock don't need another BCH check
+	if((block->check&mask)||validateBCH(wordvalue)){
+		block->check|=mask;
 		if(task&VALIDATE_FLEX_CHECKSUM){
 			if(validateChecksum(wordvalue)){
 				return VALIDATE_PASS;
@@ -67,51 +87,44 @@ uint8_t validateWord(struct frame* frame, uint8_t word, uint8_t task){
 		} else {
 			return VALIDATE_PASS;
 		}
-	} else {
-		uint8_t counter;
-		if(task&REPAIR1){
-			for(counter=0;counter<31;counter++){
-				if(validateBCH(wordvalue^(1<<counter))){
-					wordvalue = (word^(1<<counter));
-					*getWord(frame,word) = wordvalue;
-					if(task&VALIDATE_FLEX_CHECKSUM){
-						if(validateChecksum(wordvalue)){
-							return REPAIRED_1;
-						} else {
-							return VALIDATE_FAIL;
-						}
-					} else {
-						return REPAIRED_1;
-					}
-				}
+	}
+	
+	// garbage blocks don't get the 2-bit search, the odds of a miscorrection are too high. Except for the control words
+	// (BIW and vectors), their checksum catches most miscorrections and losing one loses the frame or the message
+	if((block->policy==POLICY_GARBAGE)&&!(task&VALIDATE_FLEX_CHECKSUM))task&=~(REPAIR2^REPAIR1);
+	
+	// validateBlock already tried all single bit errors, so there's no need to try them again
+	if((task&REPAIR1)&&(block->policy==POLICY_UNVALIDATED)){
+		for(counter=0;counter<32;counter++){
+			if(validateBCH(wordvalue^(1UL<<counter))){
+				wordvalue^=(1UL<<counter);
+				result=REPAIRED_1;
+				break;
 			}
-			if(!(task&REPAIR2)) return VALIDATE_FAIL;
 		}
-		
-		if(task&REPAIR2){
-			uint8_t counter2;
-			for(counter2=0;counter2<31;counter2++){
-				for(counter=counter2+1;counter<31;counter++){
-					if(validateBCH(  (wordvalue^(1<<counter))^(1<<counter2) ) ){
-						wordvalue = (wordvalue^(1<<counter))^(1<<counter2);
-						*getWord(frame,word) = wordvalue;
-						if(task&VALIDATE_FLEX_CHECKSUM){
-							if(validateChecksum(wordvalue)){
-								return REPAIRED_2;
-							} else {
-								return VALIDATE_FAIL;
-							}
-						} else {
-							return REPAIRED_2;
-						}
-					}
+	}
+	
+	if((result==VALIDATE_FAIL)&&((task&REPAIR2)==REPAIR2)){
+		for(counter2=0;(counter2<32)&&(result==VALIDATE_FAIL);counter2++){
+			for(counter=counter2+1;counter<32;counter++){
+				if(validateBCH((wordvalue^(1UL<<counter))^(1UL<<counter2))){
+					wordvalue = (wordvalue^(1UL<<counter))^(1UL<<counter2);
+					result=REPAIRED_2;
+					break;
 				}
 			}
-		} else {
-			return VALIDATE_FAIL;
 		}
 	}
-	return VALIDATE_FAIL;
+	
+	if(result==VALIDATE_FAIL)return VALIDATE_FAIL;
+	
+	// store the repaired word, and mark it as valid
+	block->word[word%8] = wordvalue;
+	block->check|=mask;
+	if((task&VALIDATE_FLEX_CHECKSUM)&&(!validateChecksum(wordvalue))){
+		return VALIDATE_FAIL;
+	}
+	return result;
 }
 
 // returns the pointer to a single 32-bit word from a frame
@@ -129,6 +142,7 @@ void cleanUpFrame(struct frame* frame){
 					free(frame->block[blockcount]);
 				}
 			}
+			if(frame->vectors)free(frame->vectors);
 			free(frame);
 		}
 	}
@@ -243,18 +257,19 @@ uint8_t validateChecksum(uint32_t word){
 // attempts to recover a single bit error in a word
 uint32_t recoverError(uint32_t word){
 	uint8_t counter;
-	for(counter=0;counter<31;counter++){
-		if(validateBCH(word^(1<<counter))){
-			return (word^(1<<counter));
+	for(counter=0;counter<32;counter++){
+		if(validateBCH(word^(1UL<<counter))){
+			return (word^(1UL<<counter));
 		}
 	}
 	return word;
 }
 
 
-// validates entire block, and marks invalid words in the block check byte
-void validateBlock(struct block* block){
+// validates entire block, and marks invalid words in the block check byte. Returns the number of words that failed the BCH check
+uint8_t validateBlock(struct block* block){
 	uint8_t counter;
+	uint8_t errors = 0;
 	for(counter=0;counter<8;counter++){
 		// check if the word in the block validates
 		if(validateBCH(block->word[counter])){
@@ -262,21 +277,38 @@ void validateBlock(struct block* block){
 			block->check|=(1<<counter);
 		} else {
 			// if invalid, attempt to recover
+			errors++;
 			block->word[counter]=recoverError(block->word[counter]);
 			if(validateBCH(block->word[counter])){
 				block->check|=(1<<counter);
-				#ifdef SERDEBUG
-					uart_puts_P("ERROR IN WORD ");itoa(counter, buffer, 10);uart_puts(buffer);
-					uart_puts_P(" RECOVERED!\n\r");
-				#endif
+				LOG1(LOG_WORD_RECOVERED,counter);
 			} else {
-				#ifdef SERDEBUG
-					uart_puts_P("ERROR IN WORD");itoa(counter, buffer, 10);uart_puts(buffer);
-					uart_puts_P("\n\r");
-				#endif
+				LOG1(LOG_WORD_ERROR,counter);
 			}
 		}
 	}
+	return errors;
+}
+
+// picks the repair policy for a block, from the number of words that failed the BCH check and the signal quality. A
+// block is only garbage if the words are still invalid after the 1-bit repair, a weak block full of single bit errors
+// isn't
+uint8_t repairPolicy(struct block* block, uint8_t errors){
+	int16_t snr = (int16_t)rssi.avgblock-rssi.avgnoise;
+	uint8_t invalid = 0;
+	uint8_t counter;
+	for(counter=0;counter<8;counter++){
+		if(!(block->check&(1<<counter)))invalid++;
+	}
+	if(invalid>=ERRORS_GARBAGE){
+		return POLICY_GARBAGE;
+	} else if((errors==0)&&(snr>=SNR_CLEAN)){
+		return POLICY_CLEAN;
+	} else if((errors>=ERRORS_MARGINAL)||(snr<SNR_MARGINAL)){
+		return POLICY_EXTENDED;
+	} else {
+		return POLICY_NORMAL;
+	}
 }
 
 // initializes the network layer
@@ -293,6 +325,9 @@ void startFlex(void){
 	
 	uart_init( UART_BAUD_SELECT(UART_BAUD_RATE,F_CPU) ); 
 	
+	// start counting before any of the interrupts can sample the stack
+	initTelemetry();
+	
 	// initial state is to wait for a sync
 	state = WAIT_SYNC;
 	
@@ -363,6 +398,8 @@ void Lights(){
 ISR(TIMER1_CAPT_vect){
 	// save the capture value;
 	uint16_t capture = ICR1;
+	PROFILE_BEGIN(PROBE_CAPT);
+	TELEMETRY_STACK();
 	
 	// switch interrupt edge
 	if(TCCR1B&(1<<ICES1)){
@@ -409,6 +446,7 @@ ISR(TIMER1_CAPT_vect){
 		if((state>WAIT_SYNC)&&(synced==0)){
 			// if further than synced, a frame has been allocated. We're gonna have to remove that frame
 			if(state>SYNCED){
+				LOG1(LOG_PARTIAL_FRAME,current.frame->fiw.frame);
 				switch(state){
 					case BLOCK:
 					case IDLE:
@@ -416,6 +454,8 @@ ISR(TIMER1_CAPT_vect){
 						synced=0;
 						current.lastframe=current.frame;
 						sei();
+						// no more blocks will come in, the frame has ended with the blocks it has
+						current.lastframe->ended=1;
 						processFrame(current.lastframe);
 						break;
 					case IDLE_PROC_STARTED:
@@ -432,9 +472,6 @@ ISR(TIMER1_CAPT_vect){
 						sei();
 						break;
 				}
-				#ifdef SERDEBUG
-					uart_puts_P("-- Partial frame ");itoa((int)current.frame->fiw.frame, buffer, 10);uart_puts(buffer);uart_puts_P(", terribly sorry.\r\n");
-				#endif
 			} else {
 				state=WAIT_SYNC;
 			}
@@ -446,12 +483,15 @@ ISR(TIMER1_CAPT_vect){
 	if((state==WAIT_SYNC)&&(synced>=MINSYNC)){
 		state=SYNCED;
 	}
+	PROFILE_END(PROBE_CAPT);
 }
 
 // this interrupt is triggered if there was no edge within the expected period. This happens when there's 2 or more consecutive 1's or 0's
 // reset the timer counter to the stddev, as this interrupt gets triggered after the normal period + stddev
 ISR(TIMER1_COMPA_vect){
+	PROFILE_BEGIN(PROBE_COMPA);
 	TCNT1=STDDEV;
+	PROFILE_END(PROBE_COMPA);
 }
 
 // this interrupt is called to read a bit, right in the middle of the regular bit period/field
@@ -459,6 +499,9 @@ ISR(TIMER1_COMPB_vect){
 
 	uint8_t counter;
 	uint8_t bit = !(PINB&1);
+	PROFILE_STATE(state);
+	PROFILE_BEGIN(PROBE_COMPB);
+	TELEMETRY_STACK();
 	
 	/*
 	*	The state machine as described here will switch through the different blocks, as described in US patent
@@ -483,6 +526,7 @@ ISR(TIMER1_COMPB_vect){
 				current.frame=calloc(1,sizeof(struct frame));
 				if(current.frame==NULL){
 					// calloc failed :(
+					telemetryAllocFail(ALLOC_FRAME);
 					state = WAIT_SYNC;
 					synced = 0;
 				} else {
@@ -534,9 +578,7 @@ ISR(TIMER1_COMPB_vect){
 					currentbyte = 0;
 					sei();
 					if(!validateChecksum(currentword32)){
-						#ifdef SERDEBUG
-							uart_puts_P("-- Error in FIW, aborting frame\n\r");
-						#endif
+						LOG0(LOG_FIW_ERROR);
 						state=WAIT_SYNC;
 						cleanUpFrame(current.frame);
 					} else {
@@ -604,15 +646,19 @@ ISR(TIMER1_COMPB_vect){
 			
 			//start of a new block
 			if(current.bitcounter==0){				
-				//NON-REENTRANT!
-				struct block *block = calloc(1,sizeof(struct block));
-				#ifdef SERDEBUG
-				if(block==NULL){
-					uart_puts_P("CALLOC FOR BLOCK FAILED :(\n\r");
+				// the blocks of a frame that isn't monitored aren't stored (or validated) at all
+				struct block *block = 0;
+				if(current.frame->stage!=PROC_SKIP){
+					//NON-REENTRANT!
+					block = calloc(1,sizeof(struct block));
+					if(block==NULL){
+						telemetryAllocFail(ALLOC_BLOCK);
+						LOG1(LOG_BLOCK_ALLOC_FAIL,current.block);
+					} else {
+						block->check=0;
+					}
 				}
-				#endif
 				current.frame->block[current.block] = block;
-				block->check=0;
 			}
 			
 			// check if the block was assigned properly
@@ -634,10 +680,10 @@ ISR(TIMER1_COMPB_vect){
 					current.lastframe = current.frame;
 					current.block++;
 					
-					// this removes any idle codeblocks after receiving, to save space, and start early processing if not busy with previous frame
+					// this removes any idle codeblocks after receiving, to save space, and hands every block to the processor as soon as it's validated
 					switch(state){
 						case BLOCK:
-							if(checkIdle(current.lastframe,current.lastblock)){ 
+							if(current.lastframe->block[current.lastblock]&&checkIdle(current.lastframe,current.lastblock)){ 
 								// last block was idle
 								state=IDLE;
 								// fallthrough to case IDLE
@@ -646,32 +692,36 @@ ISR(TIMER1_COMPB_vect){
 								if(current.lastblock==10){
 									// last block
 									state=SYNCED;
-									sei();
-									validateBlock(current.lastframe->block[current.lastblock]);
-									processFrame(current.lastframe);
-									break;
-								} else {
-									// not the last block
-									sei();
-									validateBlock(current.lastframe->block[current.lastblock]);
-									break;
 								}
+								sei();
+								if(current.lastframe->block[current.lastblock]){
+									PROFILE_BEGIN(PROBE_BLOCK);
+									counter = validateBlock(current.lastframe->block[current.lastblock]);
+									current.lastframe->block[current.lastblock]->policy = repairPolicy(current.lastframe->block[current.lastblock],counter);
+									LOG3(LOG_BLOCK_QUALITY,current.lastblock,counter,current.lastframe->block[current.lastblock]->policy);
+									PROFILE_END(PROBE_BLOCK);
+								}
+								if(current.lastframe->blocksready==0){
+									// the time of all the blocks in the frame follows from the first one
+									current.lastframe->blocktime=getTicks()-((uint32_t)current.lastblock*BLOCK_TICKS);
+								}
+								current.lastframe->blocksready=current.lastblock+1;
+								if(current.lastblock==10)current.lastframe->ended=1;
+								processFrame(current.lastframe);
+								break;
 							}
 							// fallthrough
 						case IDLE:
+							// the rest of the frame is idle, so the frame has ended
 							if(current.lastblock==10){
 								state=SYNCED;
-								sei();
-								processFrame(current.lastframe);
-								break;
-							}
-							
-							if(procmutex==0){
+							} else {
 								state=IDLE_PROC_STARTED;
-								sei();
-								processFrame(current.lastframe);
-								break;
 							}
+							sei();
+							current.lastframe->ended=1;
+							processFrame(current.lastframe);
+							break;
 
 						case IDLE_PROC_STARTED:
 							state=SYNCED;
@@ -682,10 +732,13 @@ ISR(TIMER1_COMPB_vect){
 			break;
 	}
 	Lights();
+	PROFILE_END(PROBE_COMPB);
 }
 
 // called whenever the ADC is done doing its conversion, for reading RSSI values.
 ISR(ADC_vect){
+	PROFILE_BEGIN(PROBE_ADC);
+	TELEMETRY_STACK();
 	rssi.adcdiv++;
 	if(rssi.adcdiv==0){
 		if(synced==0){
@@ -704,6 +757,7 @@ ISR(ADC_vect){
 			}
 			temp>>=3;
 			rssi.avgblock = temp;
+			temp=0;
 			for(count=0;count<ADCSAMPLES;count++){
 				temp+=rssi.noise[count];
 			}
@@ -712,4 +766,5 @@ ISR(ADC_vect){
 		}
 		
 	}
+	PROFILE_END(PROBE_ADC);
 }
\ No newline at end of file
@@ -43,18 +43,60 @@
 #define ERRORLED 4
 #define IDLELED 5
 
+// cycle profiling markers for the simavr ISR benchmark (Linux - FlexTools/isrbench.c). Every probe writes its ID to
+// GPIOR1 on entry and its ID|PROFILE_END_FLAG on exit, the COMPB vector also writes the state-machine state to GPIOR0.
+// Costs one or two cycles per marker, and nothing at all when ISRPROFILE isn't defined
+//#define ISRPROFILE
+#define PROBE_CAPT 1
+#define PROBE_COMPA 2
+#define PROBE_COMPB 3
+#define PROBE_ADC 4
+#define PROBE_TIMER0 5
+#define PROBE_BLOCK 6
+#define PROBE_FRAME 7
+#define PROFILE_END_FLAG 0x80
+
+#ifdef ISRPROFILE
+#define PROFILE_BEGIN(probe) GPIOR1=(probe)
+#define PROFILE_END(probe) GPIOR1=(probe)|PROFILE_END_FLAG
+#define PROFILE_STATE(s) GPIOR0=(s)
+#else
+#define PROFILE_BEGIN(probe)
+#define PROFILE_END(probe)
+#define PROFILE_STATE(s)
+#endif
+
 // validation tasks (if nothing is specified, only BCH will be verified)
 #define VALIDATE_FLEX_CHECKSUM 1
 #define REPAIR1 2
 #define REPAIR2 6
 
+// repair policy, picked for every block from the number of words that failed the BCH check and the signal-to-noise
+// ratio (average RSSI while receiving blocks minus average RSSI between transmissions, in ADC units)
+#define SNR_CLEAN 40			// a block without errors above this SNR is clean
+#define SNR_MARGINAL 10			// below this SNR, a block is marginal
+#define ERRORS_MARGINAL 2		// a block with this many failed words is marginal
+#define ERRORS_GARBAGE 5		// a block with this many words left invalid after 1-bit repair is most likely garbage
+
+#define POLICY_UNVALIDATED 0	// block hasn't been validated yet, every repair is tried
+#define POLICY_CLEAN 1			// no errors on a strong signal
+#define POLICY_NORMAL 2			// control words get 2-bit repair, message words only 1-bit
+#define POLICY_EXTENDED 3		// marginal block, message words get 2-bit repair as well
+#define POLICY_GARBAGE 4		// 2-bit repair only for the checksummed control words, elsewhere it would mostly miscorrect
+
 // validation return
 #define VALIDATE_FAIL 0
 #define VALIDATE_PASS 1
 #define REPAIRED_1	3
 #define REPAIRED_2	5
 
+// system clock ticks (64 us), timer 0 counts from 0 up to and including OCR0A (125) between two subseconds
+#define TICKS_PER_SUBSECOND 126
+// a block of 256 bits takes 160 ms at 1600 bps
+#define BLOCK_TICKS 2500
+
 struct system{
+	uint32_t uptime;			// subseconds since startup. Free running, the time in the BIW doesn't change it
 	uint8_t subsecond;
 	uint16_t year;
 	uint8_t month;
@@ -71,7 +113,8 @@ struct system{
 struct block{
 	uint32_t word[8];
 	uint8_t check;
-}; // 33
+	uint8_t policy;
+}; // 34
 
 struct frame{
 	struct block* block[11];
@@ -91,7 +134,14 @@ struct frame{
 		uint8_t carryon;
 		uint8_t collapse;
 	} biw;
-}; // 32
+	// incremental processing, the first stage counts the validated blocks and flags the end of the frame
+	volatile uint8_t blocksready;
+	volatile uint8_t ended;
+	uint32_t blocktime;			// clock ticks at which the first block was received, the others follow every BLOCK_TICKS
+	volatile uint8_t stage;
+	uint8_t avcount;
+	struct vector* vectors;		// decoded address/vector field, built by the second stage
+}; // 38
 
 struct rx{
 	uint8_t bitcounter;
@@ -115,7 +165,13 @@ struct level{
  *  @param  b the byte that will be switched
  *	@return Switched byte      
  */
-char bitswitch(char b);
+uint8_t bitswitch(uint8_t b);
+
+/** @brief  Reads the system clock
+ *	@return Clock ticks (see TICKS_PER_SUBSECOND) since startup, wrapping at 32 bits. Differences stay right across
+ *			the wrap, and aren't affected by the time set from the BIW
+ */
+uint32_t getTicks(void);
 
 /** @brief  Fetches a specific word from the frame
  *  @param	frame the frame that contains the word to be validated
@@ -177,8 +233,16 @@ uint32_t recoverError(uint32_t word);
 
 /** @brief  Recursively attempts to validate an entire block. Saves data in block->check
  *  @param	block Datablock to be verified
+ *	@return Number of words that failed the BCH check (before repair)
+ */
+uint8_t validateBlock(struct block* block);
+
+/** @brief  Picks the repair policy for a block, based on the current signal-to-noise ratio
+ *  @param	block Datablock after validateBlock, the words it couldn't repair are counted for the garbage policy
+ *  @param	errors Number of words in the block that failed the BCH check
+ *	@return Repair policy (see #defines)
  */
-void validateBlock(struct block* block);
+uint8_t repairPolicy(struct block* block, uint8_t errors);
 
 /** @brief Sets up registers, timers, ports  */
 void startFlex(void);
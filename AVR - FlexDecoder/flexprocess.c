@@ -6,6 +6,7 @@
  */ 
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <stdlib.h>
 #include <util/atomic.h>
 #include <string.h>
@@ -20,16 +21,67 @@
 #include "flex.h"
 #include "flexprocess.h"
 #include "memdebug.h"
+#include "binlog.h"
+#include "telemetry.h"
+#include "filter.h"
+#include "rawframe.h"
+#include "binproto.h"
 
-struct mapping* mapping[MAX_MAPPINGS];
+struct mappingrow mapping[MAP_FRAMES];
 
 struct message* messages[MAX_MESSAGES];
+uint16_t storedmessages = 0;
+
+// timing wheel, lists of stored messages by the frame number at which they expire
+struct message* wheel[MESSAGE_WHEEL];
+volatile uint8_t sweptframe = 0xFF;
+
+// alpha characters by their 7 bits as received (lsb first), control characters have bit 7 set
+static const char alphatable[128] PROGMEM = {
+	0x80,0x40,0x20,0x60,0x90,0x50,0x30,0x70,0x88,0x48,0x28,0x68,0x98,0x58,0x38,0x78,
+	0x84,0x44,0x24,0x64,0x94,0x54,0x34,0x74,0x8C,0x4C,0x2C,0x6C,0x9C,0x5C,0x3C,0x7C,
+	0x82,0x42,0x22,0x62,0x92,0x52,0x32,0x72,0x8A,0x4A,0x2A,0x6A,0x9A,0x5A,0x3A,0x7A,
+	0x86,0x46,0x26,0x66,0x96,0x56,0x36,0x76,0x8E,0x4E,0x2E,0x6E,0x9E,0x5E,0x3E,0x7E,
+	0x81,0x41,0x21,0x61,0x91,0x51,0x31,0x71,0x89,0x49,0x29,0x69,0x99,0x59,0x39,0x79,
+	0x85,0x45,0x25,0x65,0x95,0x55,0x35,0x75,0x8D,0x4D,0x2D,0x6D,0x9D,0x5D,0x3D,0x7D,
+	0x83,0x43,0x23,0x63,0x93,0x53,0x33,0x73,0x8B,0x4B,0x2B,0x6B,0x9B,0x5B,0x3B,0x7B,
+	0x87,0x47,0x27,0x67,0x97,0x57,0x37,0x77,0x8F,0x4F,0x2F,0x6F,0x9F,0x5F,0x3F,0x7F,
+};
+
+// numeric characters by their 4 bits as received (lsb first), the fill character is 0
+static const char numerictable[16] PROGMEM = {
+	'0','8','4',0,'2',' ','6',']','1','9','5','-','3','U','7','[',
+};
+
+// hex digits by their 4 bits as received (msb first), for bytes that are packed lsb first
+static const char hextable[16] PROGMEM = {
+	'0','8','4','C','2','A','6','E','1','9','5','D','3','B','7','F',
+};
+
+// first address word of every address type range, the type of each range is in addresstypes
+#define ADDRESS_RANGES 11
+static const uint32_t addressranges[ADDRESS_RANGES-1] PROGMEM = {
+	0x000001,0x008001,0x1E0001,0x1F0001,0x1F2800,0x1F6800,0x1F7800,0x1F7810,0x1F7FFF,0x1FFFFF,
+};
+static const uint8_t addresstypes[ADDRESS_RANGES] PROGMEM = {
+	ADDR_IDLE1,ADDR_LONG1,ADDR_SHORT,ADDR_LONG1,ADDR_RESERVED,ADDR_INFO_SVC,ADDR_NETWORKID,ADDR_TEMPORARY,ADDR_RESERVED,
+	ADDR_LONG2,ADDR_IDLE2,
+};
 
 char buffer[15];
 
 volatile uint8_t previousframe = 0xFF;
 
-struct vector decodeVector(uint32_t vword, uint32_t address){
+// recently handled fragments, and the time of the frame that is being processed
+struct dedupentry dedup[DEDUP_ENTRIES];
+uint8_t dedupnext = 0;
+uint16_t frametime = 0;
+
+// frame that is being processed, and the frame that is waiting to be processed after it
+struct frame* activeframe = 0;
+struct frame* pendingframe = 0;
+
+struct vector decodeVector(uint32_t vword, uint64_t address){
 	struct vector vect;
 	
 	vect.type = bitswitch((uint8_t)(vword>>20))&0x07;
@@ -38,7 +90,7 @@ struct vector decodeVector(uint32_t vword, uint32_t address){
 		return vect;
 	}
 	
-	vect.address = decodeAddress(address);
+	vect.address = address;
 	switch(vect.type){
 		case VECT_ALPHA:
 		case VECT_HEX:
@@ -47,11 +99,15 @@ struct vector decodeVector(uint32_t vword, uint32_t address){
 			vect.length = bitswitch((uint8_t)vword)&0x7F;
 			vword>>=7;
 			vect.start = bitswitch((uint8_t)vword)&0x7F;
-			#ifdef SERDEBUG
-				uart_puts_P("| MESSAGE location word: ");itoa(vect.start, buffer, 10);uart_puts(buffer);
-				uart_puts_P(" length:");itoa(vect.length, buffer, 10);uart_puts(buffer);
-				uart_puts_P("\n\r");
-			#endif
+			break;
+		case VECT_NUMERIC:
+		case VECT_NUMERIC_FORMAT:
+		case VECT_NUMERIC_NO:
+			// numeric messages have a 3 bit length field, for 1 to 8 words
+			vword>>=10;
+			vect.length = (bitswitch((uint8_t)vword)&0x07)+1;
+			vword>>=7;
+			vect.start = bitswitch((uint8_t)vword)&0x7F;
 			break;
 		case VECT_INSTRUCTION:
 			vword>>=7;
@@ -95,10 +151,7 @@ void processBIW2(uint32_t biwword){
 		case 0x00: //local id
 			biwword>>=17;
 			sys.timezone = bitswitch((uint8_t)biwword)&0x1F;
-			#ifdef SERDEBUG
-				uart_puts_P("| LOCAL ID SET, TZ=");itoa(sys.timezone, buffer, 10);uart_puts(buffer);
-				uart_puts_P("\n\r");
-			#endif
+			LOG1(LOG_LOCAL_ID,sys.timezone);
 			break;
 		case 0x01: // MDY
 			biwword>>=7;
@@ -107,12 +160,7 @@ void processBIW2(uint32_t biwword){
 			sys.day = bitswitch((uint8_t)biwword)&0x1F;
 			biwword>>=5;
 			sys.year = 1994+(bitswitch((uint8_t)biwword)&0x1F);
-			#ifdef SERDEBUG
-				uart_puts_P("| DATE SET: ");itoa(sys.day, buffer, 10);uart_puts(buffer);
-				uart_puts_P("/");itoa(sys.month, buffer, 10);uart_puts(buffer);
-				uart_puts_P("/");itoa(sys.year, buffer, 10);uart_puts(buffer);
-				uart_puts_P("\n\r");
-			#endif
+			LOG3(LOG_DATE,sys.day,sys.month,sys.year);
 			break;
 		case 0x02: // HMS
 			biwword>>=6;
@@ -122,18 +170,10 @@ void processBIW2(uint32_t biwword){
 			sys.minutes = bitswitch((uint8_t)biwword)&0x3F;
 			biwword>>=5;
 			sys.hour = bitswitch((uint8_t)biwword)&0x1F;
-			#ifdef SERDEBUG
-				uart_puts_P("| TIME SET: ");itoa(sys.hour, buffer, 10);uart_puts(buffer);
-				uart_puts_P(":");itoa(sys.minutes, buffer, 10);uart_puts(buffer);
-				uart_puts_P(":");itoa(sys.seconds, buffer, 10);uart_puts(buffer);
-				uart_puts_P("\n\r");
-			#endif
+			LOG3(LOG_TIME,sys.hour,sys.minutes,sys.seconds);
 			break;
 		case 0x03: // Spare / offset
-			#ifdef SERDEBUG
-				uart_puts_P("| SPARE/OFFSET SET");
-				uart_puts_P("\n\r");
-			#endif
+			LOG0(LOG_SPARE);
 			break;
 	}
 }
@@ -142,27 +182,47 @@ void initProcessor(void){
 	// initializes some stuff for the flex frame processor, such as the parking table for long messages, and addressfield mapping table
 	procmutex = 0;
 	uint8_t count;
-	for(count = 0;count<MAX_MAPPINGS;count++){
-		mapping[count]=0;
+	uint16_t slot;
+	for(count = 0;count<MAP_FRAMES;count++){
+		mapping[count].frame=MAP_NO_FRAME;
+		for(slot=0;slot<16;slot++){
+			mapping[count].list[slot]=0;
+		}
 	}
 	
-	for(count=0;count<MAX_MESSAGES;count++){
-		messages[count]=0;
+	for(slot=0;slot<MAX_MESSAGES;slot++){
+		messages[slot]=0;
+	}
+	storedmessages=0;
+	
+	for(count=0;count<MESSAGE_WHEEL;count++){
+		wheel[count]=0;
+	}
+	
+	for(count=0;count<DEDUP_ENTRIES;count++){
+		dedup[count].time=DEDUP_EMPTY;
 	}
 }
 
 void cleanUpMessage(struct message* msg){
 	// this recursively deletes everything that might be associated with a message
 		
-	// if the message was stored because it was fragmented, clear the reference in the table, 
-	if(msg->location!=NO_LOC_ASSIGNED){
-		messages[msg->location]=0;
-	}
+	// if the message was stored because it was fragmented, clear the reference in the table and the timing wheel
+	unstoreMessage(msg);
 	
 	// remove addresslist, message data and finally the message struct itself
 	ATOMIC_BLOCK(ATOMIC_FORCEON){
 		if(msg->addresslist.addresspointer)free(msg->addresslist.addresspointer);
-		if(msg->messagep)free(msg->messagep);
+		while(msg->text){
+			msg->lasttext=msg->text->next;
+			free(msg->text);
+			msg->text=msg->lasttext;
+		}
+		while(msg->spans){
+			msg->lastspan=msg->spans->next;
+			free(msg->spans);
+			msg->spans=msg->lastspan;
+		}
 		if(msg)free(msg);
 	}
 }
@@ -174,131 +234,124 @@ struct message* addMessage(){
 		msg = calloc(1,sizeof(struct message));
 	}
 	if(!msg){
+		telemetryAllocFail(ALLOC_MESSAGE);
 		return NULL;
 	}
-	msg->messagep = 0;
+	msg->text = 0;
+	msg->lasttext = 0;
 	msg->addresslist.addresspointer = 0;
 	msg->addresslist.addresscount = 0;
 	msg->messagelength = 0;	
+	msg->spans = 0;
+	msg->lastspan = 0;
+	msg->payloadbits = 0;
 	msg->iscomplete = 0;
-	msg->timeout = LONG_MSG_TTL;
+	msg->priority = 0;
+	msg->expiry = NO_EXPIRY;
+	msg->wheelnext = 0;
+	msg->wheelprev = 0;
 	msg->sigtemp = 0;
-	msg->signature = 0;
+	msg->signature = SIGNATURE_UNKNOWN;
 	msg->location = NO_LOC_ASSIGNED;
 	return msg;
 }
 
 void clearMappings(uint8_t curframe){
-	// removes mappings for the current frame
+	// removes mappings for the current frame. The row for the frame is found directly, only its member lists are freed
+	struct mappingrow* row = &mapping[curframe%MAP_FRAMES];
+	struct mappingchunk* chunk;
 	uint8_t count;
-	for(count=0;count<MAX_MAPPINGS;count++){
-		if(mapping[count]){
-			if(mapping[count]->frame==curframe){
-				ATOMIC_BLOCK(ATOMIC_FORCEON){
-					if(mapping[count]->addressp)free(mapping[count]->addressp);
-					free(mapping[count]);
-				}
-				mapping[count]=0;
+	if(row->frame!=curframe)return;
+	for(count=0;count<16;count++){
+		while(row->list[count]){
+			chunk=row->list[count];
+			row->list[count]=chunk->next;
+			ATOMIC_BLOCK(ATOMIC_FORCEON){
+				free(chunk);
 			}
 		}
 	}
+	row->frame=MAP_NO_FRAME;
 }
 
-uint8_t addMapping(uint8_t frame, uint8_t tempaddress, uint32_t address){
-	uint8_t count;
-	uint32_t* tempp;
-	for(count=0;count<MAX_MAPPINGS;count++){
-		if(mapping[count]){
-			if((mapping[count]->frame==frame)&&(mapping[count]->tempaddress==tempaddress)){
-				mapping[count]->addresscount++;
-				
-				// okay so this is a little convoluted, but here goes:
-				tempp = mapping[count]->addressp; // save the pointer (temporarily
-				ATOMIC_BLOCK(ATOMIC_FORCEON){
-					// attempt to reallocated the block
-					mapping[count]->addressp = realloc(mapping[count]->addressp, sizeof(uint32_t)*mapping[count]->addresscount);
-				}
-				// check if the reallocation succeeded
-				if(mapping[count]->addressp==NULL){
-						// if it didnt, restore the old count, pointer and return immediately
-						mapping[count]->addresscount--;
-						mapping[count]->addressp = tempp;
-						return 0;
-				} else {
-					// it succeeded, add the mapping
-					mapping[count]->addressp[(mapping[count]->addresscount)-1]=address;
-				}
-				
-				#ifdef SERDEBUG
-					uart_puts_P("| RIC: ");ultoa(address-32768, buffer, 10);uart_puts(buffer);
-					uart_puts_P(" will join temporary address 0x");ultoa(tempaddress+0x01F7800, buffer, 16);uart_puts(buffer);
-					uart_puts_P(" for frame ");itoa(frame, buffer, 10);uart_puts(buffer);
-					uart_puts_P("\n\r");
-				#endif
-				return 1;
-			}
+uint8_t addMapping(uint8_t frame, uint8_t tempaddress, uint64_t address){
+	struct mappingrow* row = &mapping[frame%MAP_FRAMES];
+	struct mappingchunk* first;
+	struct mappingchunk* chunk;
+	
+	// past frames are cleared when they end or are skipped, so a row that holds another frame holds mappings for a
+	// frame that is still to come. Those can't be dropped, the new mapping is rejected instead
+	if(row->frame!=frame){
+		if(row->frame!=MAP_NO_FRAME){
+			telemetryCount(&telemetry.rejectedmappings);
+			LOG3(LOG_MAPPING_REJECTED,tempaddress&0x0F,frame,row->frame);
+			return 0;
 		}
+		row->frame=frame;
 	}
-	for(count=0;count<MAX_MAPPINGS;count++){
-		if(!mapping[count]){
-			ATOMIC_BLOCK(ATOMIC_FORCEON){
-				mapping[count]=calloc(1,sizeof(struct mapping));
-			}
-			if(mapping[count]==NULL){
-				return 0;
-			}
-			mapping[count]->tempaddress=tempaddress;
-			mapping[count]->frame=frame;
-			mapping[count]->addresscount=1;
-			ATOMIC_BLOCK(ATOMIC_FORCEON){
-				mapping[count]->addressp = calloc(1, sizeof(uint32_t));
-			}
-			if(mapping[count]->addressp==NULL){
-				return 0;
-			}			
-			#ifdef SERDEBUG
-				uart_puts_P("| New mapping for temporary address 0x");ultoa(tempaddress+0x01F7800, buffer, 16);uart_puts(buffer);
-				uart_puts_P(" frame ");itoa(frame, buffer, 10);uart_puts(buffer);
-				uart_puts_P("\n\r");
-				uart_puts_P("| RIC: ");ultoa(address-32768, buffer, 10);uart_puts(buffer);
-				uart_puts_P(" will join temporary address 0x");ultoa(tempaddress+0x01F7800, buffer, 16);uart_puts(buffer);
-				uart_puts_P(" for frame ");itoa(frame, buffer, 10);uart_puts(buffer);
-				uart_puts_P("\n\r");
-			#endif
-			mapping[count]->addressp[0]=address;
-			return 1;
+	tempaddress&=0x0F;
+	first=row->list[tempaddress];
+	
+	// add a chunk if the list is empty or the last chunk is full
+	if((!first)||(first->last->count==MAP_CHUNK)){
+		ATOMIC_BLOCK(ATOMIC_FORCEON){
+			chunk=malloc(sizeof(struct mappingchunk));
+		}
+		if(chunk==NULL){
+			telemetryAllocFail(first?ALLOC_MAPPINGADDR:ALLOC_MAPPING);
+			return 0;
 		}
+		chunk->next=0;
+		chunk->count=0;
+		if(first){
+			first->last->next=chunk;
+		} else {
+			first=chunk;
+			first->total=0;
+			row->list[tempaddress]=first;
+			LOG2(LOG_MAPPING_NEW,tempaddress,frame);
+		}
+		first->last=chunk;
 	}
-	return 0;
+	
+	chunk=first->last;
+	chunk->address[chunk->count++]=address;
+	first->total++;
+	// the capcode of a long address doesn't fit a trace argument, the raw address words are logged instead
+	LOG3(LOG_MAPPING_JOIN,address&ADDRESS_WORD_MASK,tempaddress,frame);
+	if(address>>LONG_ADDRESS_SHIFT)LOG1(LOG_MAPPING_JOIN_LONG,address>>LONG_ADDRESS_SHIFT);
+	return 1;
 }
 
-void addMappingsToMessage(uint32_t address,uint8_t frame, struct message* msg){
+void addMappingsToMessage(uint64_t address,uint8_t frame, struct message* msg){
 	// this function takes a temporary address as argument, and finds all associated normal addresses. These addresses are then added to the message
-	uint8_t count;
-	uint32_t* tempp;
-	for(count=0;count<MAX_MAPPINGS;count++){
-		if(mapping[count]){
-			if(mapping[count]->frame==frame){
-				if(mapping[count]->tempaddress==(uint8_t)address){
-					tempp = msg->addresslist.addresspointer;
-					ATOMIC_BLOCK(ATOMIC_FORCEON){
-						// protected
-						msg->addresslist.addresspointer = realloc(msg->addresslist.addresspointer, (msg->addresslist.addresscount+mapping[count]->addresscount)*sizeof(uint32_t));
-					}
-					if(msg->addresslist.addresspointer==NULL){
-						msg->addresslist.addresspointer = tempp;
-					} else {
-						memcpy(msg->addresslist.addresspointer+(msg->addresslist.addresscount*sizeof(uint32_t)), mapping[count]->addressp, mapping[count]->addresscount*sizeof(uint32_t));
-						msg->addresslist.addresscount+=mapping[count]->addresscount;
-					}
-				}
-			}
-		}
+	struct mappingrow* row = &mapping[frame%MAP_FRAMES];
+	struct mappingchunk* chunk;
+	uint64_t* tempp;
+	if(row->frame!=frame)return;
+	chunk=row->list[address&0x0F];
+	if(!chunk)return;
+	
+	// grow the address list once for all members
+	tempp = msg->addresslist.addresspointer;
+	ATOMIC_BLOCK(ATOMIC_FORCEON){
+		// protected
+		msg->addresslist.addresspointer = realloc(msg->addresslist.addresspointer, (msg->addresslist.addresscount+chunk->total)*sizeof(uint64_t));
+	}
+	if(msg->addresslist.addresspointer==NULL){
+		telemetryAllocFail(ALLOC_ADDRESSLIST);
+		msg->addresslist.addresspointer = tempp;
+		return;
+	}
+	while(chunk){
+		memcpy(msg->addresslist.addresspointer+msg->addresslist.addresscount, chunk->address, chunk->count*sizeof(uint64_t));
+		msg->addresslist.addresscount+=chunk->count;
+		chunk=chunk->next;
 	}
 }
 
-void addAddressToMessage(uint32_t address, uint8_t frame, struct message* msg){
-	uint32_t* tempp;
+void addAddressToMessage(uint64_t address, uint8_t frame, struct message* msg){
+	uint64_t* tempp;
 	// adds an address to a message, or adds all addresses that were assigned to a temporary address. You will now all refer to me by the name... Betty
 	if((address>>4)==0x1F780){
 		addMappingsToMessage(address,frame,msg);
@@ -307,9 +360,11 @@ void addAddressToMessage(uint32_t address, uint8_t frame, struct message* msg){
 		tempp = msg->addresslist.addresspointer;
 		ATOMIC_BLOCK(ATOMIC_FORCEON){
 			// protected
-			msg->addresslist.addresspointer = realloc(msg->addresslist.addresspointer,(msg->addresslist.addresscount)*sizeof(uint32_t));
+			msg->addresslist.addresspointer = realloc(msg->addresslist.addresspointer,(msg->addresslist.addresscount)*sizeof(uint64_t));
 		}
 		if(!msg->addresslist.addresspointer){
+			telemetryAllocFail(ALLOC_ADDRESSLIST);
+			msg->addresslist.addresscount-=1;
 			msg->addresslist.addresspointer = tempp;
 			return;
 		} else {
@@ -345,131 +400,321 @@ uint32_t decodeAddress(uint32_t addressword){
 	return test2;
 }
 
-uint8_t getAddressType(uint32_t addressword){
-	addressword = decodeAddress(addressword);
-	if(addressword==0x1FFFFF){
-		return ADDR_IDLE2;
-	} else if(addressword>=0x1F7FFF){
-		return ADDR_LONG2;
-	} else if(addressword>=0x1F7810){
-		return ADDR_RESERVED;
-	} else if(addressword>=0x1F7800){
-		return ADDR_TEMPORARY;
-	} else if(addressword>=0x1F6800){
-		return ADDR_NETWORKID;
-	} else if(addressword>=0x1F2800){
-		return ADDR_INFO_SVC;
-	} else if(addressword>=0x8001){
-		return ADDR_SHORT;
-	} else if(addressword>=1){
-		return ADDR_LONG1;
+uint8_t getAddressType(uint32_t address){
+	// the type is the number of range boundaries the address is past, looked up in the type table. No branches, so every
+	// address takes the same time
+	uint8_t range = 0;
+	uint8_t count;
+	for(count=0;count<ADDRESS_RANGES-1;count++){
+		range+=(address>=pgm_read_dword(&addressranges[count]));
+	}
+	return pgm_read_byte(&addresstypes[range]);
+}
+
+uint64_t getCapcode(uint64_t address){
+	// the capcode is what's programmed into the pager. For long addresses the second word is inverted
+	if(getAddressType((uint32_t)address&ADDRESS_WORD_MASK)==ADDR_LONG1){
+		return ((((address>>LONG_ADDRESS_SHIFT)&ADDRESS_WORD_MASK)^ADDRESS_WORD_MASK)<<15)+2068480UL+(address&ADDRESS_WORD_MASK);
+	}
+	return address-32768;
+}
+
+void outputAddress(uint64_t address){
+	uint64_t capcode = getCapcode(address);
+	uint8_t count = sizeof(buffer)-1;
+	
+	// short addresses fit in 32 bits, only long addresses need the (slow) 64 bit division
+	if((capcode>>32)==0){
+		ultoa((uint32_t)capcode, buffer, 10);
+		uart_puts(buffer);
+		return;
+	}
+	buffer[count]=0;
+	do{
+		buffer[--count]='0'+(capcode%10);
+		capcode/=10;
+	}while(capcode);
+	uart_puts(buffer+count);
+}
+
+char* addMessageSegment(struct message* msg, uint16_t size){
+	// appends a new text segment to a message, the text of earlier fragments isn't touched
+	struct messagesegment* segment;
+	ATOMIC_BLOCK(ATOMIC_FORCEON){
+		segment=malloc(sizeof(struct messagesegment)+size);
+	}
+	if(segment==NULL){
+		telemetryAllocFail(ALLOC_MESSAGETEXT);
+		return NULL;
+	}
+	segment->next=0;
+	segment->length=size;
+	if(msg->lasttext){
+		msg->lasttext->next=segment;
 	} else {
-		return ADDR_IDLE1;
+		msg->text=segment;
 	}
+	msg->lasttext=segment;
+	msg->messagelength+=size;
+	return segment->text;
+}
+
+uint16_t wordSum(uint32_t word){
+	// the info bits are added up in groups of 8, 8 and 5 bits, each group with the first received bit as lsb
+	return bitswitch((uint8_t)(word>>24))+bitswitch((uint8_t)(word>>16))+(bitswitch((uint8_t)(word>>8))&0x1F);
 }
 
-void addAlphaMessageContent(struct frame* frame, uint8_t start, uint8_t length, struct message* message){
-	// this function adds data to a message. It allocates needed space, or reallocates in case of a continued message
+uint16_t unpackAlpha(struct frame* frame, uint8_t start, uint8_t end, uint8_t firstbyte, char* text, struct fragmentsums* sums){
+	// each word holds 3 characters of 7 bits. They're cut from the word with fixed shifts and looked up in a table that
+	// already has them in the right bit order, with control characters flagged. The counting pass also adds up the
+	// words and characters for the fragment check and signature, so verifying the fragment costs no extra pass
 	uint8_t wordcount;
 	uint8_t bytecount;
-	uint16_t messagebyte;
+	uint8_t valid;
+	uint16_t size = 0;
 	uint32_t temp32;
-	uint8_t temp8;
-	char* tempp = 0;
+	char chars[3];
+	
+	bytecount=firstbyte;
+	for(wordcount=start;wordcount<end;wordcount++){
+		temp32=*getWord(frame,wordcount);
+		chars[0]=pgm_read_byte(&alphatable[(uint8_t)(temp32>>25)]);
+		chars[1]=pgm_read_byte(&alphatable[(uint8_t)(temp32>>18)&0x7F]);
+		chars[2]=pgm_read_byte(&alphatable[(uint8_t)(temp32>>11)&0x7F]);
+		valid=getValidity(frame,wordcount);
+		if(text==NULL){
+			// counting only. Invalid words get all their characters and 8 bytes of markers
+			sums->check+=wordSum(temp32);
+			for(;bytecount<3;bytecount++){
+				sums->signature+=chars[bytecount]&0x7F;
+				if(!valid||!(chars[bytecount]&0x80))size++;
+			}
+			if(!valid)size+=8;
+		} else if(valid){
+			for(;bytecount<3;bytecount++){
+				if(!(chars[bytecount]&0x80)){
+					text[size++]=chars[bytecount];
+				}
+			}
+		} else {
+			// mark the characters of the invalid word as inverted
+			text[size++]=0x1B;
+			text[size++]=0x5B;
+			text[size++]=0x37;
+			text[size++]=0x6D;
+			for(;bytecount<3;bytecount++){
+				text[size++]=(chars[bytecount]&0x80)?0xDB:chars[bytecount];
+			}
+			text[size++]=0x1B;
+			text[size++]=0x5B;
+			text[size++]=0x30;
+			text[size++]=0x6D;
+		}
+		bytecount=0;
+	}
+	return size;
+}
 
+uint16_t unpackNumeric(struct frame* frame, uint8_t firstword, uint8_t start, uint8_t end, uint8_t skip, char* text){
+	// numeric characters are 4 bits each, and run on from one word into the next. The words are shifted through a 32 bit
+	// register, and the characters are taken from the top and looked up in a table that already has them in the right
+	// bit order, with the fill character filtered out
+	uint8_t wordcount;
+	uint8_t bits;
+	uint8_t carried = 0;
+	uint8_t valid;
+	uint16_t size = 0;
+	uint32_t stream;
+	uint32_t carry = 0;
+	char digit;
 	
-	// decode the header first
+	for(wordcount=firstword;;wordcount=start++){
+		// the header bits are only in the first word
+		stream=(*getWord(frame,wordcount)&0xFFFFF800)<<skip;
+		bits=21-skip;
+		skip=0;
+		// put the bits left over from the previous word in front
+		stream=(stream>>carried)|carry;
+		bits+=carried;
+		valid=getValidity(frame,wordcount);
+		if(!valid){
+			// mark the characters of the invalid word as inverted
+			if(text){
+				text[size]=0x1B;
+				text[size+1]=0x5B;
+				text[size+2]=0x37;
+				text[size+3]=0x6D;
+			}
+			size+=4;
+		}
+		for(;bits>=4;bits-=4){
+			digit=pgm_read_byte(&numerictable[(uint8_t)(stream>>28)]);
+			stream<<=4;
+			if(!valid&&!digit)digit=0xDB;
+			if(digit){
+				if(text)text[size]=digit;
+				size++;
+			}
+		}
+		if(!valid){
+			if(text){
+				text[size]=0x1B;
+				text[size+1]=0x5B;
+				text[size+2]=0x30;
+				text[size+3]=0x6D;
+			}
+			size+=4;
+		}
+		carry=stream;
+		carried=bits;
+		if(start>=end)break;
+	}
+	return size;
+}
+
+void repairMessageWords(struct frame* frame, uint8_t start, uint8_t end){
+	// the size of the text depends on which words are valid, so try to repair the words in marginal blocks first
+	uint8_t wordcount;
+	for(wordcount=start;wordcount<end;wordcount++){
+		if((!getValidity(frame,wordcount))&&(frame->block[wordcount/8]->policy==POLICY_EXTENDED)){
+			validateWord(frame,wordcount,REPAIR2);
+		}
+	}
+}
+
+void addBinaryMessageContent(struct frame* frame, uint8_t start, uint8_t length, struct message* message){
+	// the payload isn't converted or copied, the message only keeps a reference to the words in the frame
+	struct messagespan* span;
 	struct alphamessageheader header = decodeAlphaHeader(*getWord(frame,start),*getWord(frame,start+1));
 	
-	// check if this is the first fragment (or maybe not the first, but we've missed the other fragments...
-	if((header.fragmentnumber==3)||(message->messagelength==0)){
+	if((header.fragmentnumber==3)||(message->spans==NULL)){
 		message->messageno = header.messagenumber;
-		message->messagelength=((length-1)*3)-header.continued;
-		messagebyte=0;
-		message->signature=header.signature;
+	}
+	
+	if(length>1){
 		ATOMIC_BLOCK(ATOMIC_FORCEON){
-			// protected calloc
-			message->messagep=calloc(message->messagelength,1);
+			span=malloc(sizeof(struct messagespan));
 		}
-		
-	// not the first, there was an earlier fragment. Grow the allocated room for the message. Add one byte if this is the last fragment
-	} else {
-		messagebyte=message->messagelength;
-		message->messagelength+=((length-1)*3)+1-header.continued;
-		tempp = message->messagep;
-		ATOMIC_BLOCK(ATOMIC_FORCEON){
-			// protected realloc
-			message->messagep=realloc(message->messagep,message->messagelength);
+		if(span==NULL){
+			telemetryAllocFail(ALLOC_MESSAGETEXT);
+			return;
 		}
+		span->next=0;
+		span->frame=frame;
+		span->start=start+1;
+		span->count=length-1;
+		// the first fragment starts with the 7 bit signature
+		span->skip=(header.fragmentnumber==3)?7:0;
+		if(message->lastspan){
+			message->lastspan->next=span;
+		} else {
+			message->spans=span;
+		}
+		message->lastspan=span;
+		message->payloadbits+=(21*span->count)-span->skip;
 	}
 	
-	if(message->messagep==NULL){
-		message->messagep = tempp;
-		return;
+	if(header.continued==0){
+		message->iscomplete=1;
+	}
+}
+
+void detachSpans(struct message* msg){
+	// only the spans added in the current frame still reference it, earlier spans have been detached already
+	struct messagespan* span;
+	struct messagespan* previous = 0;
+	struct messagespan* copy;
+	uint8_t count;
+	for(span=msg->spans;span;span=span->next){
+		if(span->frame){
+			ATOMIC_BLOCK(ATOMIC_FORCEON){
+				copy=realloc(span,sizeof(struct messagespan)+(span->count*sizeof(uint32_t)));
+			}
+			if(copy==NULL){
+				// keep the span, but without its words. The payload is cut short here
+				telemetryAllocFail(ALLOC_MESSAGETEXT);
+				msg->payloadbits-=(21*span->count)-span->skip;
+				span->count=0;
+				span->frame=0;
+			} else {
+				span=copy;
+				for(count=0;count<span->count;count++){
+					span->words[count]=*getWord(span->frame,span->start+count);
+				}
+				span->frame=0;
+				if(previous){
+					previous->next=span;
+				} else {
+					msg->spans=span;
+				}
+				if(span->next==NULL)msg->lastspan=span;
+			}
+		}
+		previous=span;
+	}
+}
+
+void addAlphaMessageContent(struct frame* frame, uint8_t start, uint8_t length, uint16_t size, uint8_t sigsum, struct message* message){
+	// this function adds data to a message. The exact size of the text in this fragment has been determined by the
+	// counting pass, the text is written into a single new segment that is appended to the message
+	uint8_t firstbyte;
+	char* text;
+	
+	// decode the header first
+	struct alphamessageheader header = decodeAlphaHeader(*getWord(frame,start),*getWord(frame,start+1));
+	
+	// check if this is the first fragment (or maybe not the first, but we've missed the other fragments...
+	if((header.fragmentnumber==3)||(message->text==NULL)){
+		message->messageno = header.messagenumber;
 	}
 	
 	// check if this is the first fragment, as there are 7 extra fragments
 	if(header.fragmentnumber==3){
-		bytecount=1; // offset by one byte for signature
+		firstbyte=1; // offset by one byte for signature
+		message->signature=header.signature;
 	} else {
-		bytecount=0;
+		firstbyte=0;
 	}
+	message->sigtemp+=sigsum;
 	
-	// read message words, each consisting of 3 bytes (except the first one)
-	for(wordcount=start+1;wordcount<(start+length);wordcount++){
-		temp32=*getWord(frame,wordcount);
-		temp8=getValidity(frame,wordcount);
-		if(!temp8){
-			tempp = message->messagep;
-			ATOMIC_BLOCK(ATOMIC_FORCEON){
-				message->messagelength +=8;
-				// protected
-				message->messagep= realloc(message->messagep, message->messagelength); 
-			}
-			if(message->messagep==NULL){
-				message->messagep = tempp;
-				return;
-			}
-			message->messagep[messagebyte]=0x1B;
-			messagebyte++;
-			message->messagep[messagebyte]=0x5B;
-			messagebyte++;
-			message->messagep[messagebyte]=0x37;
-			messagebyte++;
-			message->messagep[messagebyte]=0x6D;
-			messagebyte++;		
-		}
-		for(;bytecount<3;bytecount++){
-			if(((char)bitswitch((uint8_t)(temp32>>(24-(7*bytecount))))&0x7F)>0x1F){
-				(message->messagep)[messagebyte]= (char)bitswitch((uint8_t)(temp32>>(24-(7*bytecount))))&0x7F;
-				messagebyte++;
-			} else if(!temp8){
-				(message->messagep)[messagebyte]= 0xDB;
-				messagebyte++;
-			}
-		}
-		bytecount=0;
-		if(!temp8){
-			message->messagep[messagebyte]=0x1B;
-			messagebyte++;
-			message->messagep[messagebyte]=0x5B;
-			messagebyte++;
-			message->messagep[messagebyte]=0x30;
-			messagebyte++;
-			message->messagep[messagebyte]=0x6D;
-			messagebyte++;
-		}
+	if(size){
+		text=addMessageSegment(message,size);
+		if(text==NULL)return;
+		unpackAlpha(frame,start+1,start+length,firstbyte,text,NULL);
 	}
 	
-	// if this is the final message, add a null character
+	// if this is the final message, the message is complete
 	if(header.continued==0){
-		(message->messagep)[messagebyte]=0; // null character termination
 		message->iscomplete=1;
-		message->timeout=0;
 	}
 	
 }
 
+uint8_t fragmentValid(struct alphamessageheader* head, uint16_t sum){
+	// the header word is part of the sum, except for the fragment check itself
+	#if FRAGMENT_CHECK
+	sum+=wordSum(head->word&0x003FFFFF);
+	if(((~sum)&0x3FF)!=head->fragmentcheck){
+		LOG2(LOG_FRAGMENT_REJECTED,head->fragmentcheck,(~sum)&0x3FF);
+		telemetryCount(&telemetry.badfragments);
+		return (FRAGMENT_CHECK!=CHECK_DROP);
+	}
+	#endif
+	return 1;
+}
+
+uint8_t signatureValid(struct message* msg){
+	// only messages of which the first fragment was received have a signature
+	#if FRAGMENT_CHECK
+	if((msg->signature!=SIGNATURE_UNKNOWN)&&(((~msg->sigtemp)&0x7F)!=msg->signature)){
+		LOG2(LOG_SIGNATURE_REJECTED,msg->signature,(~msg->sigtemp)&0x7F);
+		telemetryCount(&telemetry.badsignatures);
+		return (FRAGMENT_CHECK!=CHECK_DROP);
+	}
+	#endif
+	return 1;
+}
+
 struct alphamessageheader decodeAlphaHeader(uint32_t firstword,uint32_t secondword){
 	// decodes the entire alphamessage header
 	struct alphamessageheader header;
@@ -496,54 +741,149 @@ struct alphamessageheader decodeAlphaHeader(uint32_t firstword,uint32_t secondwo
 	return header;
 }
 
-struct message* findMessage(uint32_t address, uint8_t messageno){
-	// this function attempts to find a parked message that was fragmented. If the message is found, it's pointer is returned
-	uint8_t count;
+uint16_t messageHash(uint64_t address, uint8_t messageno){
+	// mixes both address words and the 6 bit message number into a slot number. The second word of a short address is 0
+	uint32_t first = (uint32_t)address&ADDRESS_WORD_MASK;
+	uint32_t second = (uint32_t)(address>>LONG_ADDRESS_SHIFT);
+	uint16_t hash = (uint16_t)first^(uint16_t)(first>>7)^(uint16_t)(first>>14)^(uint16_t)second^(uint16_t)(second>>11);
+	hash^=(uint16_t)messageno<<9;
+	hash^=hash>>5;
+	return hash&(MAX_MESSAGES-1);
+}
+
+struct message* findMessage(uint64_t address, uint8_t messageno){
+	// this function attempts to find a parked message that was fragmented. If the message is found, it's pointer is returned.
+	// Messages are stored with linear probing, so the search ends at the first empty slot
+	uint16_t slot = messageHash(address,messageno);
+	uint16_t count;
 	for(count=0;count<MAX_MESSAGES;count++){
-		if(messages[count]->primaryaddresss==address){
-			if(messages[count]->messageno==messageno){
-				// message found, return pointer
-				return messages[count];
-			}
+		if(!messages[slot])break;
+		if((messages[slot]->primaryaddresss==address)&&(messages[slot]->messageno==messageno)){
+			// message found, return pointer
+			return messages[slot];
 		}
+		slot=(slot+1)&(MAX_MESSAGES-1);
 	}
 	// no message found
 	return 0;
 }
 
-void deleteStaleMessages(){
-	char* tempp;
-	// in order to delete parked messages that aren't ever finished due to errors, messages time-out. This function
-	// decreases a timeout counter, and deletes the message if it reaches zero
+void unstoreMessage(struct message* msg){
+	uint16_t slot;
+	uint16_t next;
+	uint16_t home;
+	if(msg->location==NO_LOC_ASSIGNED)return;
+	
+	// unlink from the timing wheel
+	if(msg->wheelprev){
+		msg->wheelprev->wheelnext=msg->wheelnext;
+	} else {
+		wheel[msg->expiry%MESSAGE_WHEEL]=msg->wheelnext;
+	}
+	if(msg->wheelnext)msg->wheelnext->wheelprev=msg->wheelprev;
+	msg->wheelnext=0;
+	msg->wheelprev=0;
+	
+	// remove from the hash table. Entries further down the probe sequence are shifted back into the hole, so lookups
+	// can keep stopping at the first empty slot
+	slot=msg->location;
+	messages[slot]=0;
+	msg->location=NO_LOC_ASSIGNED;
+	storedmessages--;
+	next=slot;
+	while(1){
+		next=(next+1)&(MAX_MESSAGES-1);
+		if(!messages[next])break;
+		home=messageHash(messages[next]->primaryaddresss,messages[next]->messageno);
+		if(((next-home)&(MAX_MESSAGES-1))>=((next-slot)&(MAX_MESSAGES-1))){
+			messages[slot]=messages[next];
+			messages[slot]->location=slot;
+			messages[next]=0;
+			slot=next;
+		}
+	}
+}
+
+void expireMessage(struct message* msg){
+	unstoreMessage(msg);
+	// hex and secure messages only have a payload, no text
+	if(msg->text||msg->spans){
+		#if !defined(SERDEBUG) && defined(BINPROTO)
+			protoMessage(msg,0);
+		#else
+			#ifndef SERDEBUG
+				outputMessageParse(msg);
+			#endif
+			#ifdef SERDEBUG
+				outputMessage(msg);
+			#endif
+			uart_puts_P("[MSG TRUNCATED]\n\r");
+		#endif
+	}
+	cleanUpMessage(msg);
+}
+
+void deleteStaleMessages(uint8_t frame){
+	// in order to delete parked messages that aren't ever finished due to errors, messages time-out. Every message is
+	// listed in the wheel slot for the frame in which it expires, so only the slots for the frames that passed since
+	// the last call have to be checked
+	uint8_t current;
 	uint8_t count;
-	for(count=0;count<MAX_MESSAGES;count++){
-		if(messages[count]){
-			if(messages[count]->timeout==0){
-				tempp = messages[count]->messagep;
-				ATOMIC_BLOCK(ATOMIC_FORCEON){
-					// protected
-					messages[count]->messagep = realloc(messages[count]->messagep,messages[count]->messagelength+1);
-				}
-				if(messages[count]->messagep==NULL){
-					messages[count]->messagep = tempp;
-					messages[count]->messagep[(messages[count]->messagelength)-1]=0x00;
-				} else {
-					messages[count]->messagep[messages[count]->messagelength]=0x00;
-				}
-				#ifndef SERDEBUG
-					outputMessageParse(messages[count]);
-				#endif
-				#ifdef SERDEBUG
-					outputMessage(messages[count]);
-				#endif
-				uart_puts_P("[MSG TRUNCATED]\n\r");
-				cleanUpMessage(messages[count]);
-				messages[count]=0;
-				#ifdef SERDEBUG
-					uart_puts_P("| ==-- Message expired, deleted --==\r\n");
-				#endif
+	if(sweptframe==0xFF){
+		current=frame;
+	} else {
+		current=(sweptframe+1)%128;
+	}
+	for(count=0;count<MESSAGE_WHEEL;count++){
+		while(wheel[current%MESSAGE_WHEEL]){
+			expireMessage(wheel[current%MESSAGE_WHEEL]);
+			LOG0(LOG_MESSAGE_EXPIRED);
+		}
+		if(current==frame)break;
+		current=(current+1)%128;
+	}
+	sweptframe=frame;
+}
+
+void outputText(struct message* msg){
+	// writes the text of all fragments, segment by segment
+	struct messagesegment* segment;
+	uint16_t count;
+	for(segment=msg->text;segment;segment=segment->next){
+		for(count=0;count<segment->length;count++){
+			uart_putc(segment->text[count]);
+		}
+	}
+}
+
+void outputPayload(struct message* msg){
+	// the words are shifted through a 32 bit register, and whole bytes are taken from the top. Bytes are packed lsb first,
+	// so every nibble is written through a table that reverses it
+	struct messagespan* span;
+	uint8_t count;
+	uint8_t bits = 0;
+	uint8_t available;
+	uint32_t stream = 0;
+	uint32_t word;
+	for(span=msg->spans;span;span=span->next){
+		for(count=0;count<span->count;count++){
+			if(span->frame){
+				word=*getWord(span->frame,span->start+count);
 			} else {
-				messages[count]->timeout--;
+				word=span->words[count];
+			}
+			word&=0xFFFFF800;
+			available=21;
+			if(count==0){
+				word<<=span->skip;
+				available-=span->skip;
+			}
+			stream|=word>>bits;
+			bits+=available;
+			for(;bits>=8;bits-=8){
+				uart_putc(pgm_read_byte(&hextable[(uint8_t)(stream>>24)&0x0F]));
+				uart_putc(pgm_read_byte(&hextable[(uint8_t)(stream>>28)]));
+				stream<<=8;
 			}
 		}
 	}
@@ -551,84 +891,98 @@ void deleteStaleMessages(){
 
 void outputMessage(struct message* msg){
 	// outputs the message in a debug-format
-	uint8_t count;
+	uint16_t count;
+	if(msg->priority)uart_puts_P("| PRIORITY\r\n");
 	for(count=0;count<(msg->addresslist.addresscount);count++){
-		uart_puts_P("|\tADDR:");ultoa(msg->addresslist.addresspointer[count]-32768, buffer, 10);uart_puts(buffer);uart_puts_P("\r\n");
+		uart_puts_P("|\tADDR:");outputAddress(msg->addresslist.addresspointer[count]);uart_puts_P("\r\n");
 	}
-	uart_puts_P("|   ");uart_puts(msg->messagep);
+	uart_puts_P("|   ");outputText(msg);
 	uart_puts_P("\r\n");
+	if(msg->spans){
+		uart_puts_P("|   HEX:");outputPayload(msg);
+		uart_puts_P("\r\n");
+	}
 }
 
 void outputMessageParse(struct message* msg){
 	// outputs the message in a parseable format
-	uint8_t count;
+	uint16_t count;
 	uart_puts_P("[[msg]]\n\r");
+	if(msg->priority)uart_puts_P("[[priority]]\n\r");
 	for(count=0;count<(msg->addresslist.addresscount);count++){
-		uart_puts_P("[[addr]]");ultoa(msg->addresslist.addresspointer[count]-32768, buffer, 10);uart_puts(buffer);uart_puts_P("\n\r");
+		uart_puts_P("[[addr]]");outputAddress(msg->addresslist.addresspointer[count]);uart_puts_P("\n\r");
 	}
 	uart_puts_P("[[data]]");
-	uart_puts(msg->messagep);
-	uart_puts_P("[[/data]]\n\r[[/msg]]\n\r");
+	outputText(msg);
+	uart_puts_P("[[/data]]\n\r");
+	if(msg->spans){
+		uart_puts_P("[[bin]]");
+		outputPayload(msg);
+		uart_puts_P("[[/bin]]\n\r");
+	}
+	uart_puts_P("[[/msg]]\n\r");
+}
+
+void outputFrameParse(struct frame* frame){
+	// outputs the start of a frame in a parseable format
+	uart_puts_P("[[frame]]");itoa(frame->fiw.cycle, buffer, 10);uart_puts(buffer);uart_puts_P("|");
+	itoa(frame->fiw.frame, buffer, 10);uart_puts(buffer);uart_puts_P("\n\r");
 }
 
 void storeMessage(struct message* msg){
 	// save fragmented message, to be finished later
+	uint16_t slot;
 	uint8_t count;
-	for(count=0;count<MAX_MESSAGES;count++){
-		if(messages[count]){
-			// slot occupied
-		} else {
-			// slot free, save message in slot
-			messages[count]=msg;
-			msg->location=count;
-			return;
-		}
+	
+	// if the store is full, make room by flushing the message that would expire first
+	if(storedmessages==MAX_MESSAGES){
+		count=(sweptframe==0xFF)?0:sweptframe+1;
+		while(!wheel[count%MESSAGE_WHEEL])count++;
+		expireMessage(wheel[count%MESSAGE_WHEEL]);
+		LOG0(LOG_MESSAGE_EVICTED);
 	}
-	// if no slot available, discard the message.
-	cleanUpMessage(msg);
-	#ifdef SERDEBUG
-	uart_puts_P("-- Message deleted, no slots available :( \r\n");
-	#endif
+	
+	// the frame the payload was received in is about to be freed
+	detachSpans(msg);
+	
+	// the time to live starts with the first stored fragment
+	if(msg->expiry==NO_EXPIRY){
+		msg->expiry=(previousframe+LONG_MSG_TTL)%128;
+	}
+	
+	slot=messageHash(msg->primaryaddresss,msg->messageno);
+	while(messages[slot]){
+		slot=(slot+1)&(MAX_MESSAGES-1);
+	}
+	messages[slot]=msg;
+	msg->location=slot;
+	storedmessages++;
+	
+	msg->wheelprev=0;
+	msg->wheelnext=wheel[msg->expiry%MESSAGE_WHEEL];
+	if(msg->wheelnext)msg->wheelnext->wheelprev=msg;
+	wheel[msg->expiry%MESSAGE_WHEEL]=msg;
 }
 
-void processFrame(struct frame* frame){
-	// this function is the entrypoint for frame processing.
-	uint8_t avcount;
-	uint8_t counter;
-	uint8_t counter2;
-	struct vector vect; //
-	struct alphamessageheader head;
-	struct message* msg;
-	#ifdef SERDEBUG
-		uint8_t timer = sys.subsecond;
-	#endif
-	// check for mutex, set if not set
-	cli();
-	if(procmutex==0){
-		procmutex=1;
-	} else {
-		sei();
-		// output a great big warning if processFrame was called while another was active
-		#ifdef SERDEBUG
-			uart_puts_P("!!!! - processFrame called while other frame was being processed! This isn't supposed to happen!!!!\n\r\n\n\n");
-		#endif
-		cleanUpFrame(frame);
-		return;
+uint8_t wordsReceived(struct frame* frame, uint8_t start, uint8_t length){
+	// checks if a range of words has been received and validated, and wasn't lost to a failed allocation or an idle block
+	uint8_t block;
+	if((length==0)||((uint16_t)start+length>88))return 0;
+	for(block=start/8;block<=(uint8_t)(start+length-1)/8;block++){
+		if((block>=frame->blocksready)||(!frame->block[block]))return 0;
 	}
-	sei();
-	
+	return 1;
+}
+
+uint8_t startFrame(struct frame* frame){
 	// first, validate the BIW at word 0. Try to repair errors up to 2 bits
 	switch(validateWord(frame,0,VALIDATE_FLEX_CHECKSUM|REPAIR2)){
 		case REPAIRED_1:
-			#ifdef SERDEBUG
-				uart_puts_P("-- Recovered BIW with 1 bit error");
-			#endif
+			LOG1(LOG_BIW_REPAIRED,1);
 			processBIW(frame);
 			break;
 		case REPAIRED_2:
-			#ifdef SERDEBUG
-				uart_puts_P("-- Recovered BIW with 2 bit error");
-			#endif
+			LOG1(LOG_BIW_REPAIRED,2);
 			processBIW(frame);
 			break;
 		case VALIDATE_PASS:
@@ -637,18 +991,14 @@ void processFrame(struct frame* frame){
 		default:
 		case VALIDATE_FAIL:
 			// BIW failed the checksum and was unrepairable. We're gonna have to get rid of the entire frame
-			#ifdef SERDEBUG
-				uart_puts_P("-- Unable to validate/repair BIW for frame ");itoa(frame->fiw.frame, buffer, 10);uart_puts(buffer);
-				uart_puts_P(", frame discarded\n\r");
-			#endif
-			cleanUpFrame(frame);
-			procmutex=0;
-			return;
+			LOG1(LOG_BIW_FAIL,frame->fiw.frame);
+			return 0;
 			break;		
 	}
 		
 	// delete stale mappings for frames that weren't transmitted in this cycle. If there were frames in between
 	// the previously parsed frame and this one, delete mappings for those frames as well
+	uint8_t counter;
 	if(previousframe==0xFF){
 		previousframe=frame->fiw.frame;
 	} 
@@ -656,25 +1006,23 @@ void processFrame(struct frame* frame){
 		clearMappings(counter);
 	}
 	previousframe=frame->fiw.frame;
+	frametime=((uint16_t)frame->fiw.cycle*128)+(frame->fiw.frame&0x7F);
 	 
 	
 	// start serial output information
-	#ifdef SERDEBUG
-		uart_puts_P("+FRAME ");
-		uart_puts_P("C:");itoa(frame->fiw.cycle, buffer, 10);uart_puts(buffer);
-		uart_puts_P(" F:");itoa(frame->fiw.frame, buffer, 10);uart_puts(buffer);
-		uart_puts_P(" LENGTH:");itoa((frame->biw.carryon)+1, buffer, 10);uart_puts(buffer);
-		uart_puts_P(" BI-LEN:");itoa(frame->biw.endofblockinfo, buffer, 10);uart_puts(buffer);
-		uart_puts_P(" VECT: ");itoa(frame->biw.vectorstart, buffer, 10);uart_puts(buffer);
-		uart_puts_P(" PRIORITY ADR: ");itoa(frame->biw.priority, buffer, 10);uart_puts(buffer);
-		uart_puts_P(" Signal: ");itoa(rssi.avgblock, buffer, 10);uart_puts(buffer);
-		uart_puts_P(" Noise: ");itoa(rssi.avgnoise, buffer, 10);uart_puts(buffer);
-		uart_puts_P(" used: ");ultoa((uint16_t)getMemoryUsed(), buffer, 10);uart_puts(buffer);uart_puts_P(" bytes");
-		uart_puts_P("\r\n");
+	LOG3(LOG_FRAME,frame->fiw.cycle,frame->fiw.frame,(frame->biw.carryon)+1);
+	LOG3(LOG_FRAME_BIW,frame->biw.endofblockinfo,frame->biw.vectorstart,frame->biw.priority);
+	#ifdef DEBUG
+		LOG3(LOG_FRAME_RSSI,rssi.avgblock,rssi.avgnoise,getMemoryUsed());
+	#else
+		LOG3(LOG_FRAME_RSSI,rssi.avgblock,rssi.avgnoise,0);
 	#endif
 	#ifndef SERDEBUG
-		uart_puts_P("[[frame]]");itoa(frame->fiw.cycle, buffer, 10);uart_puts(buffer);uart_puts_P("|");
-		itoa(frame->fiw.frame, buffer, 10);uart_puts(buffer);uart_puts_P("\n\r");
+		#ifdef BINPROTO
+		protoFrame(BINPROTO_FRAME,frame->fiw.cycle,frame->fiw.frame);
+		#else
+		outputFrameParse(frame);
+		#endif
 	#endif
 	
 	
@@ -688,135 +1036,705 @@ void processFrame(struct frame* frame){
 			if(validateWord(frame,1,REPAIR2|VALIDATE_FLEX_CHECKSUM))processBIW2(frame->block[0]->word[1]);		
 	}
 	
-	// if this is a so-called idle block, output this information
-	#ifdef SERDEBUG
+	// if this is a so-called idle block, log this information
 	if((frame->biw.vectorstart==1)&&(frame->biw.endofblockinfo==0)){
-		uart_puts_P("| IDLE...\n\r");
+		LOG0(LOG_IDLE);
 	}
-	#endif
 	
 	// determine length of address and vector field
-	avcount = (frame->biw.vectorstart-frame->biw.endofblockinfo)-1;
+	if(frame->biw.vectorstart>frame->biw.endofblockinfo){
+		frame->avcount = (frame->biw.vectorstart-frame->biw.endofblockinfo)-1;
+	} else {
+		frame->avcount = 0;
+	}
+	return 1;
+}
 
+uint8_t indexVectors(struct frame* frame){
+	// validates and decodes every address/vector pair exactly once, and links the vectors that point to the same message
+	uint8_t counter;
+	uint8_t leader;
+	uint8_t heads[VECTOR_HASH];
+	uint8_t addresstype;
+	uint8_t longaddress;
+	uint64_t address;
+	struct vector* vect;
+	
+	ATOMIC_BLOCK(ATOMIC_FORCEON){
+		frame->vectors=malloc(frame->avcount*sizeof(struct vector));
+	}
+	if(frame->vectors==NULL){
+		telemetryAllocFail(ALLOC_VECTORS);
+		return 0;
+	}
 	
-	// validate all vector checksums, delete if invalid
-	for(counter=0;counter<avcount;counter++){
+	for(counter=0;counter<VECTOR_HASH;counter++){
+		heads[counter]=VECT_END;
+	}
+	for(counter=0;counter<frame->avcount;counter++){
+		vect=&frame->vectors[counter];
+		
+		// a long address takes two address words, and the vector takes the two vector words next to them
+		validateWord(frame,counter+frame->biw.addressstart,REPAIR2);
+		address=decodeAddress(*getWord(frame,counter+frame->biw.addressstart));
+		addresstype=getAddressType((uint32_t)address);
+		longaddress=(addresstype==ADDR_LONG1)&&(counter+1<frame->avcount);
+		if(longaddress){
+			validateWord(frame,counter+1+frame->biw.addressstart,REPAIR2);
+			address|=(uint64_t)decodeAddress(*getWord(frame,counter+1+frame->biw.addressstart))<<LONG_ADDRESS_SHIFT;
+		}
+		
+		// validate the vector checksum, ignore the vector if invalid
 		switch(validateWord(frame,counter+frame->biw.vectorstart,REPAIR2|VALIDATE_FLEX_CHECKSUM)){
 			case REPAIRED_2:
-				#ifdef SERDEBUG
-					uart_puts_P("2-bit error in vector repaired! \r\n");
-				#endif
+				LOG0(LOG_VECTOR_REPAIRED);
 			case VALIDATE_PASS:
 			case REPAIRED_1:
+				*vect=decodeVector(*getWord(frame,counter+frame->biw.vectorstart),address);
+				vect->addresstype=addresstype;
 				break;
+			default:
 			case VALIDATE_FAIL:
-				#ifdef SERDEBUG
-					uart_puts_P("Irrepairable vector discarded :(\r\n");
-				#endif
-				*getWord(frame,counter+frame->biw.vectorstart)=0;
+				LOG0(LOG_VECTOR_DISCARDED);
+				vect->type=VECT_NULL;
 				break;
 		}
-	}
-
-	// find all vectors of the non-instruction type
-	for(counter=0;counter<avcount;counter++){
-		// decode the first vector
-		validateWord(frame,counter+(frame->biw.addressstart),REPAIR2);
-		vect = decodeVector(*getWord(frame,counter+frame->biw.vectorstart),*getWord(frame,counter+(frame->biw.addressstart)));
-		switch(vect.type){
+		vect->next=VECT_END;
+		vect->hashnext=VECT_END;
+		vect->done=0;
+		
+		switch(vect->type){
 			case VECT_ALPHA:
-				// delete the vector
-				*getWord(frame, counter+frame->biw.vectorstart) = 0;
-				
-				// decode the message header
-				head = decodeAlphaHeader(*getWord(frame,vect.start),*getWord(frame,1+vect.start));
-
-				// check if it is an initial fragment (always 0x03);
-				if(head.fragmentnumber!=0x03){
-					// see if we can find a message with this number and address			
-					msg=findMessage(vect.address,head.messagenumber);
-				} else {
-					// new message;
-					msg = 0;
+			case VECT_HEX:
+			case VECT_SECURE:
+			case VECT_NUMERIC:
+			case VECT_NUMERIC_FORMAT:
+			case VECT_NUMERIC_NO:
+				// find the first vector to the same message, through the start word hash
+				for(leader=heads[vect->start%VECTOR_HASH];leader!=VECT_END;leader=frame->vectors[leader].hashnext){
+					if((frame->vectors[leader].start==vect->start)&&(frame->vectors[leader].type==vect->type))break;
 				}
-				
-				if(msg){
-					// initial message retrieved, clear the slot (not doing this would break multipart messages with more than 2 parts)
-					messages[msg->location]=0x00;
-					msg->location=NO_LOC_ASSIGNED;
+				if(leader==VECT_END){
+					// first vector to this message
+					vect->hashnext=heads[vect->start%VECTOR_HASH];
+					heads[vect->start%VECTOR_HASH]=counter;
 				} else {
-					msg = addMessage();
-					
-					// check if we were able to allocate the space for a message
-					if(msg==NULL){
-						cleanUpFrame(frame);
-					}
-					addAddressToMessage(vect.address,frame->fiw.frame,msg);
-					msg->primaryaddresss = vect.address;
-					for(counter2=counter+1;counter2<avcount;counter2++){
-						if(decodeVector(*getWord(frame, counter+frame->biw.vectorstart),*getWord(frame, counter+frame->biw.addressstart)).start==vect.start){
-							// found another vector to the same message. output address and delete vector
-							*getWord(frame,counter2+frame->biw.vectorstart)=0;// found and decoded, clear the vector in the block/word
-							addAddressToMessage(decodeVector(*getWord(frame, counter+frame->biw.vectorstart),*getWord(frame, counter+frame->biw.addressstart)).address,frame->fiw.frame,msg);
-						}
+					// another address for a known message, add it to the end of the list. It's handled together with the first
+					while(frame->vectors[leader].next!=VECT_END){
+						leader=frame->vectors[leader].next;
 					}
+					frame->vectors[leader].next=counter;
+					vect->done=1;
+				}
+				break;
+		}
+		
+		// the second word of a long address doesn't get a vector of its own
+		if(longaddress){
+			counter++;
+			vect=&frame->vectors[counter];
+			vect->type=VECT_NULL;
+			vect->next=VECT_END;
+			vect->hashnext=VECT_END;
+			vect->done=1;
+		}
+	}
+	return 1;
+}
+
+struct message* newVectorMessage(struct frame* frame, uint8_t index){
+	// creates a message for a vector, with the addresses of all the vectors that point to the same message
+	uint8_t member;
+	struct vector* vect = &frame->vectors[index];
+	struct message* msg = addMessage();
+	if(msg==NULL){
+		return NULL;
+	}
+	addAddressToMessage(vect->address,frame->fiw.frame,msg);
+	msg->primaryaddresss = vect->address;
+	for(member=vect->next;member!=VECT_END;member=frame->vectors[member].next){
+		addAddressToMessage(frame->vectors[member].address,frame->fiw.frame,msg);
+	}
+	return msg;
+}
+
+uint8_t lastMessageWord(struct frame* frame, uint8_t index){
+	// short messages are carried in the vector word, numeric messages to long addresses end one word early
+	struct vector* vect = &frame->vectors[index];
+	if(vect->type==VECT_SHORT)return index+frame->biw.vectorstart;
+	if(longNumeric(vect))return vect->start+vect->length-2;
+	return vect->start+vect->length-1;
+}
+
+void deliverMessage(struct frame* frame, uint8_t index, struct message* msg){
+	// a message is a priority message if any of its fragments was sent to one of the priority addresses at the start of
+	// the address field
+	uint32_t received;
+	if(index<frame->biw.priority)msg->priority=1;
+	
+	// check if this is a complete message, or if it's continued later
+	if(msg->iscomplete){
+		#ifndef SERDEBUG
+		#ifdef BINPROTO
+		// every record stands on its own, priority messages have a record type of their own
+		protoMessage(msg,1);
+		#else
+		// priority messages are sent on as a chunk of their own, with a frame start and end of their own, so the receiving
+		// side can pass it on without waiting for the end of the frame. The 0x08 in front ends the frame text so far, the
+		// receiving side keeps that until the end of the frame
+		if(msg->priority){
+			uart_putc(0x08);
+			outputFrameParse(frame);
+			outputMessageParse(msg);
+			uart_puts_P("[[/frame]]\n\r");
+			uart_putc(0x08);
+		} else {
+			outputMessageParse(msg);
+		}
+		#endif
+		#endif
+		#ifdef SERDEBUG
+		outputMessage(msg);
+		#endif
+		
+		// time from the end of the block holding the last word, to the message being queued for the UART
+		received=frame->blocktime+((uint32_t)(lastMessageWord(frame,index)/8)*BLOCK_TICKS);
+		telemetryLatency(msg->priority,getTicks()-received);
+		cleanUpMessage(msg);
+	} else {
+		// incomplete message, store for further completion
+		storeMessage(msg);
+	}
+}
+
+struct message* fragmentMessage(struct frame* frame, uint8_t index, struct alphamessageheader* head){
+	struct vector* vect = &frame->vectors[index];
+	struct message* msg;
+	
+	// check if it is an initial fragment (always 0x03);
+	if(head->fragmentnumber!=0x03){
+		// see if we can find a message with this number and address			
+		msg=findMessage(vect->address,head->messagenumber);
+	} else {
+		// new message;
+		msg = 0;
+	}
+	
+	if(msg){
+		// initial message retrieved, take it out of the store (not doing this would break multipart messages with more than 2 parts)
+		unstoreMessage(msg);
+	} else {
+		msg = newVectorMessage(frame,index);
+	}
+	return msg;
+}
+
+void processAlphaVector(struct frame* frame, uint8_t index){
+	struct vector* vect = &frame->vectors[index];
+	struct alphamessageheader head;
+	struct fragmentsums sums = {0,0};
+	struct message* msg;
+	uint16_t size;
+	
+	LOG2(LOG_VECTOR,vect->start,vect->length);
+	
+	// decode the message header, repair it first
+	validateWord(frame,vect->start,REPAIR2);
+	head = decodeAlphaHeader(*getWord(frame,vect->start),*getWord(frame,1+vect->start));
+	
+	// determine the size of the text, and verify the fragment before it's added to a (stored) message
+	repairMessageWords(frame,vect->start+1,vect->start+vect->length);
+	size=unpackAlpha(frame,vect->start+1,vect->start+vect->length,(head.fragmentnumber==3)?1:0,NULL,&sums);
+	if(!fragmentValid(&head,sums.check)){
+		vect->done=1;
+		return;
+	}
+	
+	// check if we were able to allocate the space for a message. If not, leave the vector for another try
+	msg = fragmentMessage(frame,index,&head);
+	if(msg==NULL){
+		return;
+	}
+	
+	// the vector is done
+	vect->done=1;
+	
+	// Save message to struct;
+	addAlphaMessageContent(frame,vect->start,vect->length,size,sums.signature,msg);
+	if(msg->iscomplete&&!signatureValid(msg)){
+		cleanUpMessage(msg);
+		return;
+	}
+	deliverMessage(frame,index,msg);
+}
+
+void processBinaryVector(struct frame* frame, uint8_t index){
+	// hex and secure messages are fragmented like alpha messages, their payload is passed on without conversion
+	struct vector* vect = &frame->vectors[index];
+	struct alphamessageheader head;
+	struct message* msg;
+	uint16_t sum = 0;
+	uint8_t word;
+	
+	LOG2(LOG_VECTOR,vect->start,vect->length);
+	
+	validateWord(frame,vect->start,REPAIR2);
+	head = decodeAlphaHeader(*getWord(frame,vect->start),*getWord(frame,1+vect->start));
+	
+	// the payload isn't unpacked here, so the fragment check gets a pass of its own
+	repairMessageWords(frame,vect->start+1,vect->start+vect->length);
+	for(word=vect->start+1;word<vect->start+vect->length;word++){
+		sum+=wordSum(*getWord(frame,word));
+	}
+	if(!fragmentValid(&head,sum)){
+		vect->done=1;
+		return;
+	}
+	
+	msg = fragmentMessage(frame,index,&head);
+	if(msg==NULL){
+		return;
+	}
+	vect->done=1;
+	
+	addBinaryMessageContent(frame,vect->start,vect->length,msg);
+	deliverMessage(frame,index,msg);
+}
+
+void processNumericVector(struct frame* frame, uint8_t index){
+	struct vector* vect = &frame->vectors[index];
+	struct message* msg;
+	uint16_t size;
+	uint8_t skip;
+	uint8_t firstword;
+	uint8_t start;
+	uint8_t end;
+	char* text;
+	
+	LOG2(LOG_VECTOR,vect->start,vect->length);
+	
+	msg = newVectorMessage(frame,index);
+	if(msg==NULL){
+		return;
+	}
+	vect->done=1;
+	
+	// numbered numeric messages start with a 6 bit message number, after the 2 bit check
+	if(vect->type==VECT_NUMERIC_NO){
+		skip=10;
+	} else {
+		skip=2;
+	}
+	// for a long address, the first word of the message is the second vector word
+	if(longNumeric(vect)){
+		firstword=index+1+frame->biw.vectorstart;
+		start=vect->start;
+		end=vect->start+vect->length-1;
+	} else {
+		firstword=vect->start;
+		start=vect->start+1;
+		end=vect->start+vect->length;
+	}
+	repairMessageWords(frame,firstword,firstword+1);
+	repairMessageWords(frame,start,end);
+	size=unpackNumeric(frame,firstword,start,end,skip,NULL);
+	if(size){
+		text=addMessageSegment(msg,size);
+		if(text)unpackNumeric(frame,firstword,start,end,skip,text);
+	}
+	
+	// numeric messages are never fragmented
+	msg->iscomplete=1;
+	deliverMessage(frame,index,msg);
+}
+
+void processShortVector(struct frame* frame, uint8_t index){
+	// short messages are carried in the vector word itself. Type 0 holds 3 numeric characters, the other types are
+	// tone-only pages, these are output without text
+	struct vector* vect = &frame->vectors[index];
+	uint32_t vword = *getWord(frame,index+frame->biw.vectorstart);
+	struct message* msg;
+	uint8_t count;
+	uint8_t size = 0;
+	char chars[3];
+	char* text;
+	
+	msg = newVectorMessage(frame,index);
+	if(msg==NULL){
+		return;
+	}
+	vect->done=1;
+	
+	if((vword&0x01800000)==0){
+		chars[0]=pgm_read_byte(&numerictable[(uint8_t)(vword>>19)&0x0F]);
+		chars[1]=pgm_read_byte(&numerictable[(uint8_t)(vword>>15)&0x0F]);
+		chars[2]=pgm_read_byte(&numerictable[(uint8_t)(vword>>11)&0x0F]);
+		for(count=0;count<3;count++){
+			if(chars[count])size++;
+		}
+		if(size){
+			text=addMessageSegment(msg,size);
+			if(text){
+				for(count=0;count<3;count++){
+					if(chars[count])*text++=chars[count];
 				}
-				
-				// Save message to struct;
-				validateWord(frame,vect.start,REPAIR2);
-				addAlphaMessageContent(frame,vect.start,vect.length,msg);
-				
-				// check if this is a complete message, or if it's continued later
-				if(msg->iscomplete){
-					#ifndef SERDEBUG
-					outputMessageParse(msg);
-					#endif
-					#ifdef SERDEBUG
-					outputMessage(msg);
-					#endif
-					cleanUpMessage(msg);
+			}
+		}
+	}
+	
+	msg->iscomplete=1;
+	deliverMessage(frame,index,msg);
+}
+
+uint8_t vectorSubscribed(struct frame* frame, uint8_t index){
+	// a message is decoded if any of its addresses is subscribed. Only subscribed addresses are added to the member list
+	// of a temporary address, so a temporary address is subscribed if it has members
+	uint8_t member;
+	struct vector* vect;
+	for(member=index;member!=VECT_END;member=frame->vectors[member].next){
+		vect=&frame->vectors[member];
+		if((vect->address>>4)==0x1F780){
+			if(mapping[frame->fiw.frame%MAP_FRAMES].frame!=frame->fiw.frame)continue;
+			if(mapping[frame->fiw.frame%MAP_FRAMES].list[vect->address&0x0F])return 1;
+		} else if(filterMatch(getCapcode(vect->address))){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+uint8_t longNumeric(struct vector* vect){
+	return (vect->addresstype==ADDR_LONG1)&&((vect->type==VECT_NUMERIC)||(vect->type==VECT_NUMERIC_FORMAT)||(vect->type==VECT_NUMERIC_NO));
+}
+
+static uint32_t hashWord(uint32_t hash, uint32_t word){
+	// FNV-1a, a word at a time
+	return (hash^word)*16777619UL;
+}
+
+uint32_t fragmentHash(struct frame* frame, uint8_t index){
+	// the words are repaired first, so a copy with a bit error hashes the same as a clean one. Nothing is decoded yet
+	struct vector* vect = &frame->vectors[index];
+	uint32_t hash = 2166136261UL;
+	uint32_t addresses = 0;
+	uint8_t member;
+	uint8_t word;
+	uint8_t end;
+	
+	// the addresses are added up, so the order in which they're sent doesn't matter
+	for(member=index;member!=VECT_END;member=frame->vectors[member].next){
+		addresses+=hashWord((uint32_t)frame->vectors[member].address,(uint32_t)(frame->vectors[member].address>>32));
+	}
+	hash=hashWord(hash,addresses);
+	hash=hashWord(hash,vect->type);
+	
+	if(vect->type==VECT_SHORT){
+		return hashWord(hash,*getWord(frame,index+frame->biw.vectorstart));
+	}
+	end=vect->start+vect->length;
+	if(longNumeric(vect)){
+		hash=hashWord(hash,*getWord(frame,index+1+frame->biw.vectorstart));
+		end--;
+	}
+	repairMessageWords(frame,vect->start,end);
+	for(word=vect->start;word<end;word++){
+		hash=hashWord(hash,*getWord(frame,word));
+	}
+	return hash;
+}
+
+uint8_t seenFragment(uint32_t hash){
+	uint8_t count;
+	for(count=0;count<DEDUP_ENTRIES;count++){
+		if((dedup[count].time!=DEDUP_EMPTY)&&(dedup[count].hash==hash)&&
+			(((frametime+FRAMES_PER_HOUR-dedup[count].time)%FRAMES_PER_HOUR)<DEDUP_WINDOW)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void rememberFragment(uint32_t hash){
+	dedup[dedupnext].hash=hash;
+	dedup[dedupnext].time=frametime;
+	dedupnext=(dedupnext+1)%DEDUP_ENTRIES;
+}
+
+void processMessages(struct frame* frame, uint8_t ended){
+	// handles every message of which all words have been received. Messages are output in the order in which they
+	// complete, not in vector order. Of the messages that complete in the same block, the ones for the priority addresses
+	// go first, as these are at the start of the address field
+	uint8_t counter;
+	uint8_t ready;
+	uint32_t hash;
+	struct vector* vect;
+	for(counter=0;counter<frame->avcount;counter++){
+		vect=&frame->vectors[counter];
+		if(vect->done)continue;
+		
+		// messages nobody subscribed to are dropped before any of their words are touched
+		if((vect->type!=VECT_NULL)&&(vect->type!=VECT_INSTRUCTION)&&(!vectorSubscribed(frame,counter))){
+			LOG0(LOG_VECTOR_FILTERED);
+			vect->done=1;
+			continue;
+		}
+		
+		switch(vect->type){
+			case VECT_ALPHA:
+			case VECT_HEX:
+			case VECT_SECURE:
+			case VECT_NUMERIC:
+			case VECT_NUMERIC_FORMAT:
+			case VECT_NUMERIC_NO:
+				// numeric messages to long addresses start with the second vector word, one word less is in the message field
+				if(longNumeric(vect)){
+					ready=(vect->length==1)||wordsReceived(frame,vect->start,vect->length-1);
 				} else {
-					// incomplete message, store for further completion
-					storeMessage(msg);
-				}	
+					ready=wordsReceived(frame,vect->start,vect->length);
+				}
+				break;
+			case VECT_SHORT:
+				ready=1;
 				break;
+			default:
+				continue;
+		}
+		
+		if(!ready){
+			if(ended){
+				// the message content never arrived (or points outside the frame)
+				LOG0(LOG_VECTOR_DISCARDED);
+				vect->done=1;
+			}
+			continue;
+		}
+		
+		// fragments that were handled recently (repeated in this frame, or simulcast) are dropped as well
+		hash=fragmentHash(frame,counter);
+		if(seenFragment(hash)){
+			LOG1(LOG_DUPLICATE,frame->fiw.repeat?1:0);
+			telemetryCount(&telemetry.duplicates);
+			vect->done=1;
+			continue;
+		}
+		
+		switch(vect->type){
+			case VECT_ALPHA:
+				processAlphaVector(frame,counter);
+				break;
+			case VECT_HEX:
+			case VECT_SECURE:
+				processBinaryVector(frame,counter);
+				break;
+			case VECT_SHORT:
+				processShortVector(frame,counter);
+				break;
+			default:
+				processNumericVector(frame,counter);
+				break;
+		}
+		
+		// a vector that couldn't be handled (no memory) is tried again later, and isn't a duplicate then
+		if(vect->done){
+			rememberFragment(hash);
+		}
+	}
+}
+
+uint8_t frameMonitored(struct frame* frame){
+	// the continuation of a fragmented message, or a group call on a temporary address, can be in any frame
+	if(storedmessages)return 1;
+	if(mapping[frame->fiw.frame%MAP_FRAMES].frame==frame->fiw.frame)return 1;
+	return filterFrame(frame->fiw.frame,frame->biw.collapse);
+}
+
+void advanceFrame(struct frame* frame, uint8_t ended){
+	// does all the work that has become possible with the blocks received so far
+	if(frame->stage==PROC_BIW){
+		if(!wordsReceived(frame,0,1)){
+			if(ended)frame->stage=PROC_DISCARD;
+			return;
+		}
+		if(!startFrame(frame)){
+			frame->stage=PROC_DISCARD;
+			return;
 		}
+		if(frameMonitored(frame)){
+			frame->stage=PROC_VECTORS;
+		} else {
+			// only the traffic is counted
+			LOG1(LOG_FRAME_SKIPPED,frame->avcount);
+			telemetryCount(&telemetry.skippedframes);
+			telemetry.skippedvectors+=frame->avcount;
+			frame->stage=PROC_SKIP;
+			return;
+		}
+	}
+	
+	if(frame->stage==PROC_VECTORS){
+		// wait for the entire address and vector field, as several vectors can point to the same message
+		if(frame->avcount){
+			if(!wordsReceived(frame,frame->biw.addressstart,frame->avcount*2))return;
+			if(!indexVectors(frame))return;
+		}
+		frame->stage=PROC_MESSAGES;
+	}
+	
+	if(frame->stage==PROC_MESSAGES){
+		processMessages(frame,ended);
+	}
+}
+
+void finishFrame(struct frame* frame){
+	uint8_t counter;
+	uint8_t count;
+	uint8_t slot;
+	#ifdef BINLOG
+		uint8_t timer = sys.subsecond;
+	#endif
+	#ifdef BINPROTO
+		// the frame is gone by the time the end record is sent
+		uint8_t cycle = frame->fiw.cycle;
+		uint8_t framenumber = frame->fiw.frame;
+	#endif
+	
+	// nothing was output for a frame without a valid BIW
+	if(frame->stage==PROC_DISCARD){
+		cleanUpFrame(frame);
+		return;
 	}
 	
 	// remove all the mappings for this frame
 	clearMappings(frame->fiw.frame);
 	
 	// make new mappings (process all instruction vectors)
-	for(counter=0;counter<avcount;counter++){
-		vect = decodeVector(*getWord(frame, counter+frame->biw.vectorstart),*getWord(frame, counter+frame->biw.addressstart));
-		if(vect.type==VECT_INSTRUCTION)addMapping(vect.tempframe,vect.tempaddr,vect.address);
+	if(frame->stage==PROC_MESSAGES){
+		for(counter=0;counter<frame->avcount;counter++){
+			if((frame->vectors[counter].type==VECT_INSTRUCTION)&&(filterMatch(getCapcode(frame->vectors[counter].address)))){
+				addMapping(frame->vectors[counter].tempframe,frame->vectors[counter].tempaddr,frame->vectors[counter].address);
+			}
+		}
 	}
 	
 	// check if some unfinished messages have perished
-	deleteStaleMessages();
+	deleteStaleMessages(frame->fiw.frame);
 	
 	//cleanup this frame
 	cleanUpFrame(frame);
 	
+	// update the telemetry, fragmented messages and mappings only change while processing, so this catches their peaks
+	telemetryPeak(&telemetry.storedpeak,(storedmessages>0xFF)?0xFF:storedmessages);
+	count=0;
+	for(counter=0;counter<MAP_FRAMES;counter++){
+		if(mapping[counter].frame!=MAP_NO_FRAME){
+			for(slot=0;slot<16;slot++){
+				if(mapping[counter].list[slot])count++;
+			}
+		}
+	}
+	telemetryPeak(&telemetry.mappingpeak,count);
+	telemetryFrame();
+	
 	#ifndef SERDEBUG
+		#ifdef BINPROTO
+		protoFrame(BINPROTO_END,cycle,framenumber);
+		#else
 		uart_puts_P("[[/frame]]\n\r");
 		uart_putc(0x08);
+		#endif
 	#endif
-	#ifdef SERDEBUG
+	#ifdef BINLOG
 		uint16_t timer2 = sys.subsecond;
 		uint16_t subtimer = TCNT0;
 		subtimer*=8;
 		subtimer/=125;
 		if(timer2<timer){
-			ultoa((uint16_t)((1000*((timer2+125))-timer)/125)+subtimer, buffer, 10);
+			timer2 = (uint16_t)((1000*((timer2+125))-timer)/125)+subtimer;
 		} else {
-			ultoa((uint16_t)((1000*((timer2)-timer))/125)+subtimer, buffer, 10);
+			timer2 = (uint16_t)((1000*((timer2)-timer))/125)+subtimer;
 		}
-		uart_puts_P("\\_______________________________________ Frame processed in ");
-		uart_puts(buffer);
-		uart_puts_P(" ms - Memory used/free: ");ultoa((uint16_t)getMemoryUsed(), buffer, 10);uart_puts(buffer);uart_puts_P("/");ultoa((uint16_t)getFreeMemory(), buffer, 10);uart_puts(buffer);uart_puts_P(" bytes\r\n");
+		#ifdef DEBUG
+			LOG3(LOG_FRAME_DONE,timer2,getMemoryUsed(),getFreeMemory());
+		#else
+			LOG3(LOG_FRAME_DONE,timer2,0,0);
+		#endif
 	#endif
+}
+
+void processFrame(struct frame* frame){
+	// this function is the entrypoint for frame processing, and is called by the first stage after every received block
+	uint8_t blocks;
+	uint8_t ended;
+	PROFILE_BEGIN(PROBE_FRAME);
+	// check for mutex, set if not set
+	cli();
+	if(procmutex==0){
+		procmutex=1;
+		activeframe=frame;
+	} else {
+		// the processor is busy. If it's busy with this frame, it will notice the new block by itself. Otherwise remember
+		// the frame, it will be picked up as soon as the active frame is done
+		if(frame!=activeframe){
+			if(pendingframe&&(pendingframe!=frame)){
+				// the processor is more than a frame behind, log a great big warning and drop the oldest waiting frame
+				LOG0(LOG_PROC_COLLISION);
+				cleanUpFrame(pendingframe);
+			}
+			pendingframe=frame;
+		}
+		sei();
+		PROFILE_END(PROBE_FRAME);
+		return;
+	}
+	sei();
 	
-	// unset mutex
-	procmutex = 0;
-}
\ No newline at end of file
+	while(1){
+		// the first stage sets the end flag after updating the block count, so once the flag is seen, all blocks are in
+		ended=frame->ended;
+		blocks=frame->blocksready;
+		#ifdef RAWFRAMES
+			// archive mode, nothing is decoded. The frame is sent on as a whole once it has ended
+			if(ended){
+				outputRawFrame(frame);
+				cleanUpFrame(frame);
+				telemetryFrame();
+				frame=0;
+			}
+		#else
+			advanceFrame(frame,ended);
+			if(ended){
+				finishFrame(frame);
+				frame=0;
+			}
+		#endif
+		
+		// the serial port is ours, write out the trace records collected in the meantime
+		binlogFlush();
+		
+		// check if more work arrived while processing, before letting go of the mutex
+		cli();
+		if(frame){
+			if(pendingframe){
+				// the first stage moved on to the next frame without ending this one, finish it
+				frame->ended=1;
+			}
+			if((frame->ended)||(frame->blocksready!=blocks)){
+				sei();
+				continue;
+			}
+		} else if(pendingframe){
+			frame=pendingframe;
+			pendingframe=0;
+			activeframe=frame;
+			sei();
+			continue;
+		}
+		
+		// unset mutex
+		activeframe=0;
+		procmutex=0;
+		sei();
+		break;
+	}
+	PROFILE_END(PROBE_FRAME);
+}
@@ -4,7 +4,9 @@
  *  @code #include <flexprocess.h> @endcode
  * 
  *  @brief The second stage processes the frames as received by the first stage.
- *	Entrypoint is processFrame(*frame)
+ *	Entrypoint is processFrame(*frame), which is called after every received block. Processing is incremental: the BIW
+ *	is decoded as soon as block 0 is in, the vectors once the address and vector field are in, and every message as soon
+ *	as its last word is in. Mappings and stale messages are handled when the frame has ended
  *
  *  @note Based on US patent US55555183
  *  @author Jelmer Bruijn
@@ -15,35 +17,97 @@
 #define FLEXPROCESS_H_
 
 // Configurable
-// This defines how many mapping structs may be valid at any given time
-#define MAX_MAPPINGS 8
+// Number of frames for which temporary address mappings can be kept at the same time. The mapping table is indexed
+// directly by frame number modulo MAP_FRAMES, set to 128 for a table that covers the entire cycle
+#ifndef MAP_FRAMES
+#define MAP_FRAMES 4
+#endif
 
-// How long (long) messages last until they timeout (in frames)
-#define LONG_MSG_TTL 10
+// Number of addresses per chunk in the member list of a temporary address
+#define MAP_CHUNK 8
 
-// how many simultaneous messages can be stored
-#define MAX_MESSAGES 5
+// How long (long) messages last until they timeout (in frames), must be less than MESSAGE_WHEEL
+#define LONG_MSG_TTL 10
 
+// how many simultaneous messages can be stored, must be a power of 2. Stored messages are kept in a hash table indexed
+// by address and message number. Can be set to thousands for a host build
+#ifndef MAX_MESSAGES
+#define MAX_MESSAGES 8
+#endif
+
+// timing wheel for stored messages, one list per frame number (modulo the wheel size). Must divide 128
+#define MESSAGE_WHEEL 16
+
+// verify the fragment check of alpha, hex and secure fragments and the signature of alpha messages. 0 is off, 1 only
+// counts and logs the mismatches, 2 drops the fragments and messages that don't match as well. Counting is the default
+// until the check formula has been validated against live traffic
+#ifndef FRAGMENT_CHECK
+#define FRAGMENT_CHECK 1
+#endif
+#define CHECK_COUNT 1
+#define CHECK_DROP 2
+
+// Duplicate suppression: the number of recently handled fragments that are remembered, and for how many frames (one
+// frame is 1.875 seconds). Networks repeat pages in later frames and on other transmitters. A frame holds at most 43
+// fragments (short messages, two words each), a smaller cache can lose a fragment before the frame has even ended
+#ifndef DEDUP_ENTRIES
+#define DEDUP_ENTRIES 44
+#endif
+#ifndef DEDUP_WINDOW
+#define DEDUP_WINDOW 64
+#endif
+
+#if (MAX_MESSAGES&(MAX_MESSAGES-1))
+#error MAX_MESSAGES must be a power of 2
+#endif
+#if (LONG_MSG_TTL>=MESSAGE_WHEEL)
+#error LONG_MSG_TTL must be less than MESSAGE_WHEEL
+#endif
+
+
+// Addresses are kept as a single 64 bit key: the (decoded) first address word in the lowest 21 bits, and for long
+// addresses the second address word above it. A short address is just its address word, so every address table
+// compares and hashes short and long addresses the same way
+#define LONG_ADDRESS_SHIFT 21
+#define ADDRESS_WORD_MASK 0x1FFFFFUL
+
+// a chunk of the member list of a temporary address, filled by short instruction vectors
+struct mappingchunk {
+	struct mappingchunk* next;
+	struct mappingchunk* last;		// only valid in the first chunk of a list
+	uint16_t total;					// only valid in the first chunk of a list
+	uint8_t count;
+	uint64_t address[MAP_CHUNK];
+};
 
-// mapping struct. A mapping like this is created for a short instruction vector
-struct mapping {
-	uint8_t tempaddress;
-	uint32_t *addressp;
-	uint8_t addresscount;
-	uint8_t frame;	
+// mappings for a single frame, one member list per temporary address
+struct mappingrow {
+	uint8_t frame;					// frame the row is valid for, MAP_NO_FRAME if unused
+	struct mappingchunk* list[16];
 };
 
+#define MAP_NO_FRAME 0xFF
+
 // alpha/hex/binary/secure/short-instruction vector
 struct vector{
 	uint8_t length;
 	uint8_t start;
-	uint32_t address;
-	uint8_t addresstype;
+	uint64_t address;
+	uint8_t addresstype;	// type of the first address word, ADDR_LONG1 for a long address
 	uint8_t tempaddr;
 	uint8_t tempframe;
 	uint8_t type;	
+	uint8_t next;			// index of the next vector to the same message, VECT_END if there is none
+	uint8_t hashnext;		// next message in the same start word hash bucket (only used while indexing)
+	uint8_t done;			// set once the vector has been handled
 };
 
+// end of a vector list
+#define VECT_END 0xFF
+
+// number of start word hash buckets used to group vectors by message
+#define VECTOR_HASH 8
+
 // struct to hold the decoded alpha-message header information
 struct alphamessageheader {
 	uint16_t fragmentcheck;
@@ -56,20 +120,54 @@ struct alphamessageheader {
 	uint32_t word;
 };
 
+// sums over a fragment that are checked against the fragment check and the message signature
+struct fragmentsums {
+	uint16_t check;					// info bits, in groups of 8, 8 and 5 bits
+	uint8_t signature;				// characters after the signature
+};
+
+// message signature that wasn't received (the first fragment is missing)
+#define SIGNATURE_UNKNOWN 0xFF
+
+// segment of message text, every fragment of a message adds one segment of exactly the right size
+struct messagesegment {
+	struct messagesegment* next;
+	uint16_t length;
+	char text[];
+};
+
+// binary payload of a hex or secure fragment. The words are read straight from the frame while it exists, they're only
+// copied into the span when a fragmented message has to be stored for a later frame
+struct messagespan {
+	struct messagespan* next;
+	struct frame* frame;			// frame holding the words, NULL once the words have been copied
+	uint8_t start;					// first word in the frame
+	uint8_t count;					// number of words
+	uint8_t skip;					// bits to skip in the first word (signature)
+	uint32_t words[];				// copied words
+};
+
 // message struct, holds an entire message
 struct message {
-	uint32_t primaryaddresss;
-	char* messagep;
-	uint16_t messagelength;
+	uint64_t primaryaddresss;
+	struct messagesegment* text;		// text segments, in fragment order
+	struct messagesegment* lasttext;	// last segment, new fragments are appended here
+	uint16_t messagelength;				// total length of the text
+	struct messagespan* spans;			// binary payload, in fragment order
+	struct messagespan* lastspan;
+	uint16_t payloadbits;				// total length of the binary payload
 	uint8_t messageno;
 	uint8_t signature;
 	uint8_t sigtemp;
-	uint8_t timeout;
+	uint8_t expiry;					// frame number at which the stored message expires
 	uint8_t iscomplete;
-	uint8_t location;
+	uint8_t priority;				// one of the fragments was sent to a priority address
+	uint16_t location;				// slot in the hash table
+	struct message* wheelnext;		// other messages that expire in the same wheel slot
+	struct message* wheelprev;
 	struct addresslist {
-		uint32_t* addresspointer;
-		uint8_t addresscount;
+		uint64_t* addresspointer;
+		uint16_t addresscount;
 	} addresslist;
 };
 
@@ -95,17 +193,37 @@ struct message {
 #define ADDR_LONG2 7
 #define ADDR_IDLE2 8
 
+// frame processing stages
+#define PROC_BIW 0
+#define PROC_VECTORS 1
+#define PROC_MESSAGES 2
+#define PROC_DISCARD 3
+#define PROC_SKIP 4					// no subscribed pager monitors the frame, only the BIW is decoded
+
 // no message location assigned flag
-#define NO_LOC_ASSIGNED 0xFF
+#define NO_LOC_ASSIGNED 0xFFFF
+
+// no expiry assigned (message hasn't been stored yet)
+#define NO_EXPIRY 0xFF
+
+// frames in a full hour of 15 cycles, frame times wrap around at this value
+#define FRAMES_PER_HOUR 1920
+#define DEDUP_EMPTY 0xFFFF
+
+// a recently handled fragment
+struct dedupentry {
+	uint32_t hash;
+	uint16_t time;					// frame time (cycle*128+frame) at which it was handled
+};
 
 volatile uint8_t procmutex;
 
 /** @brief  Decodes given vector and produces a struct containing relevant info
  *  @param  vword vector-word
- *	@param	address Addressword (relevant for short instruction vectors)
+ *	@param	address Address key of the vector (see LONG_ADDRESS_SHIFT)
  *	@return The decoded vector
  */
-struct vector decodeVector(uint32_t vword, uint32_t address);
+struct vector decodeVector(uint32_t vword, uint64_t address);
 
 /** @brief  Returns the validity of any word in the frame
  *  @param  frame Pointer to the frame that will be checked
@@ -138,17 +256,19 @@ void cleanUpMessage(struct message* msg);
  */
 struct message* addMessage();
 
-/** @brief  Removes all mappings for any given frame
+/** @brief  Removes all mappings for any given frame, and frees the member lists
  *  @param  curframe Current frame-number
  */
 void clearMappings(uint8_t curframe);
 
-/** @brief  Adds a mapping to the mapping-table
+/** @brief  Adds a mapping to the mapping-table. Addresses are appended to the member list of the temporary address,
+ *			which grows a chunk at a time
  *  @param  frame framenumber for the mapping
  *	@param	tempaddress temporary address for mapping
  *	@param	address	address for which the mapping is valid
+ *	@return 1 if the mapping was added, 0 if there was no memory
  */
-uint8_t addMapping(uint8_t frame, uint8_t tempaddress, uint32_t address);
+uint8_t addMapping(uint8_t frame, uint8_t tempaddress, uint64_t address);
 
 
 /** @brief	Adds all valid mappings for a specific temporary address and frame to the addresslist in the message
@@ -156,35 +276,120 @@ uint8_t addMapping(uint8_t frame, uint8_t tempaddress, uint32_t address);
  *  @param  frame framenumber for the mapping
  *	@param	msg Message to add the addresses to
  */
-void addMappingsToMessage(uint32_t address,uint8_t frame, struct message* msg);
+void addMappingsToMessage(uint64_t address,uint8_t frame, struct message* msg);
 
 /** @brief	Adds an address to the message, growing the messagelist by one
  *	@param	address Address to find mappings for
  *  @param  frame framenumber for mappings as needed
  *	@param	msg Message to add the addresses to
  */
-void addAddressToMessage(uint32_t address, uint8_t frame, struct message* msg);
+void addAddressToMessage(uint64_t address, uint8_t frame, struct message* msg);
 
-/** @brief	Decodes an address from a message (currently, only short addresses are supported)
+/** @brief	Decodes a single address word. Long addresses are made from two decoded words (see LONG_ADDRESS_SHIFT)
  *	@param	addressword The word containing the address that needs to be decoded
- *	@return Decoded address
+ *	@return Decoded address word
  */
 uint32_t decodeAddress(uint32_t addressword);
 
-/** @brief	Decodes the address type from a message (currently unused)
- *	@param	addressword The word containing the address
- *	@return Decoded address type (see #defines)
+/** @brief	Classifies a decoded address word by its range, with a table instead of a chain of compares
+ *	@param	address The decoded address word
+ *	@return Decoded address type (see #defines), ADDR_LONG1 for the first word of a long address
+ */
+uint8_t getAddressType(uint32_t address);
+
+/** @brief	Converts an address key to the capcode that is programmed into the pager
+ *	@param	address Address key
+ *	@return Capcode
+ */
+uint64_t getCapcode(uint64_t address);
+
+/** @brief	Writes the capcode of an address key to the UART. Long addresses are converted to their 9+ digit capcode
+ *	@param	address Address key
+ */
+void outputAddress(uint64_t address);
+
+
+/** @brief  Adds up the info bits of a word for the fragment check, in groups of 8, 8 and 5 bits
+ *  @param  word The word
+ *  @return Sum of the three groups
+ */
+uint16_t wordSum(uint32_t word);
+
+/** @brief  Converts a run of alphanumeric message words to text, in a single pass. Control characters are left out,
+ *	invalid words are written inverted (with escape sequences), including their control characters
+ *  @param  frame Pointer to the frame that contains the words
+ *	@param	start First word to convert
+ *	@param	end Word after the last word to convert
+ *	@param	firstbyte Number of characters to skip in the first word
+ *	@param	text Buffer for the text, or NULL to only count the characters
+ *	@param	sums Sums for the fragment check and signature, added to while counting (unused when writing the text)
+ *  @return The number of characters (written)
+ */
+uint16_t unpackAlpha(struct frame* frame, uint8_t start, uint8_t end, uint8_t firstbyte, char* text, struct fragmentsums* sums);
+
+/** @brief  Converts a run of numeric message words to text, in a single pass. Fill characters are left out, invalid
+ *	words are written inverted (with escape sequences)
+ *  @param  frame Pointer to the frame that contains the words
+ *	@param	firstword First word to convert. For long addresses, this is the second vector word
+ *	@param	start Word to continue with after the first word
+ *	@param	end Word after the last word to convert
+ *	@param	skip Number of header bits to skip in the first word
+ *	@param	text Buffer for the text, or NULL to only count the characters
+ *  @return The number of characters (written)
+ */
+uint16_t unpackNumeric(struct frame* frame, uint8_t firstword, uint8_t start, uint8_t end, uint8_t skip, char* text);
+
+/** @brief  Tries to repair the invalid words of a message in blocks with an extended repair policy
+ *  @param  frame Pointer to the frame that contains the words
+ *	@param	start First word of the message
+ *	@param	end Word after the last word of the message
  */
-uint8_t getAddressType(uint32_t addressword);
+void repairMessageWords(struct frame* frame, uint8_t start, uint8_t end);
 
+/** @brief  Appends a new text segment to a message
+ *  @param  msg Pointer to the message
+ *	@param	size Length of the text in the segment
+ *  @return Pointer to the text of the new segment, or NULL if there was no memory
+ */
+char* addMessageSegment(struct message* msg, uint16_t size);
+
+/** @brief  Adds the payload of a hex or secure fragment to a message, as a span referencing the words in the frame
+ *  @param  frame Pointer to the frame that contains the content
+ *	@param	start Word that contains the message header
+ *	@param	length Total amount of words in the message
+ *	@param	message pointer to the message where the content will be added
+ */
+void addBinaryMessageContent(struct frame* frame, uint8_t start, uint8_t length, struct message* message);
+
+/** @brief  Copies the words of all spans that still reference a frame into the spans, so the message can outlive the
+ *	frame. Called before a fragmented message is stored
+ *  @param  msg Pointer to the message
+ */
+void detachSpans(struct message* msg);
 
-/** @brief  Adds alphanumeric content to a message struct
+/** @brief  Adds alphanumeric content to a message struct, as a new text segment of exactly the right size
  *  @param  frame Pointer to the frame that contains the content
  *	@param	start Word that contains the alphanumeric header
  *	@param	length Total amount of words in the alpha message
+ *	@param	size Length of the text, as counted by unpackAlpha
+ *	@param	sigsum Sum of the characters, as counted by unpackAlpha
  *	@param	message pointer to the message where the content will be added
  */
-void addAlphaMessageContent(struct frame* frame, uint8_t start, uint8_t length, struct message* message);
+void addAlphaMessageContent(struct frame* frame, uint8_t start, uint8_t length, uint16_t size, uint8_t sigsum, struct message* message);
+
+/** @brief  Verifies the fragment check of an alpha, hex or secure fragment, and counts a mismatch
+ *  @param  head Pointer to the decoded header of the fragment
+ *	@param	sum Sum of the words after the header (see wordSum)
+ *  @return 1 if the fragment is valid (or FRAGMENT_CHECK doesn't drop fragments)
+ */
+uint8_t fragmentValid(struct alphamessageheader* head, uint16_t sum);
+
+/** @brief  Verifies the signature of a completed alpha message, and counts a mismatch
+ *  @param  msg Pointer to the message
+ *  @return 1 if the signature matches, if the first fragment (with the signature) was missed, or if FRAGMENT_CHECK
+ *			doesn't drop messages
+ */
+uint8_t signatureValid(struct message* msg);
 
 /** @brief	Decodes the header for an alphanumeric message
  *  @param  firstword The first header word (the majority)
@@ -192,17 +397,46 @@ void addAlphaMessageContent(struct frame* frame, uint8_t start, uint8_t length,
  */
 struct alphamessageheader decodeAlphaHeader(uint32_t firstword,uint32_t secondword);
 
+/** @brief	Calculates the home slot of a message in the hash table
+ *	@param	address The first (usually only) address for which the message is valid
+ *	@param	messageno Message identification number
+ *	@return Slot in the hash table
+ */
+uint16_t messageHash(uint64_t address, uint8_t messageno);
+
 /** @brief	Finds a stored message, by message number and address
  *	@param	address The first (usually only) address for which the message is valid
  *	@param	messageno Message identification number
  *	@return Pointer to the stored message
  */
-struct message* findMessage(uint32_t address, uint8_t messageno);
+struct message* findMessage(uint64_t address, uint8_t messageno);
 
-/** @brief	Checks if there are any lingering messages in the buffer that werent finished. Decrements TTL counter
- *			on all messages
+/** @brief	Removes a message from the hash table and the timing wheel, without deleting it
+ *	@param	msg Pointer to the message
+ */
+void unstoreMessage(struct message* msg);
+
+/** @brief	Outputs a message that will never be finished as truncated, and deletes it
+ *	@param	msg Pointer to the message
+ */
+void expireMessage(struct message* msg);
+
+/** @brief	Expires all stored messages that were due in the frames since the last call, up to and including the given
+ *			frame
+ *	@param	frame Current frame number
+ */
+void deleteStaleMessages(uint8_t frame);
+
+/** @brief	Writes the text of a message to the UART, walking all segments
+ *	@param	msg Pointer to the message
  */
-void deleteStaleMessages();
+void outputText(struct message* msg);
+
+/** @brief	Writes the binary payload of a message as hex, packed into bytes straight from the words
+ *	(least significant bit first, as received)
+ *	@param	msg Pointer to the message
+ */
+void outputPayload(struct message* msg);
 
 /** @brief	Prints message and it's addressee's in a debug format
  *	@param	msg Pointer to the message
@@ -214,12 +448,151 @@ void outputMessage(struct message* msg);
  */
 void outputMessageParse(struct message* msg);
 
-/** @brief	Stores the message in the buffer in order to add more fragments later
+/** @brief	Prints the start of a frame in a parseable format
+ *	@param	frame Pointer to the frame
+ */
+void outputFrameParse(struct frame* frame);
+
+/** @brief	Stores the message in the buffer in order to add more fragments later. If the buffer is full, the message
+ *			closest to expiring is output (truncated) to make room
  *	@param	msg Pointer to the message
  */
 void storeMessage(struct message* msg);
 
-/** @brief	Processes the frame (entrypoint for frame processor)
+/** @brief	Checks if a range of words in the frame has been received (and wasn't lost)
+ *	@param	frame Pointer to the frame
+ *	@param	start First word
+ *	@param	length Number of words
+ *	@return 1 if all words are available
+ */
+uint8_t wordsReceived(struct frame* frame, uint8_t start, uint8_t length);
+
+/** @brief	Validates and decodes the BIW and extended BIWs, and writes the frame header
+ *	@param	frame Pointer to the frame
+ *	@return 0 if the BIW was invalid, and the frame should be discarded
+ */
+uint8_t startFrame(struct frame* frame);
+
+/** @brief	Validates (and repairs) the vector and address words of a frame, and decodes them once into the vector
+ *			index of the frame. Vectors pointing to the same message are linked to the first one. Invalid vectors are
+ *			indexed as VECT_NULL
+ *	@param	frame Pointer to the frame
+ *	@return 0 if there was no memory for the index
+ */
+uint8_t indexVectors(struct frame* frame);
+
+/** @brief	Creates a message for a vector, with the addresses of all the vectors linked to it
+ *	@param	frame Pointer to the frame
+ *	@param	index Index of the vector in the vector index
+ *	@return Pointer to the new message, or NULL if there was no memory
+ */
+struct message* newVectorMessage(struct frame* frame, uint8_t index);
+
+/** @brief	Finds the last word of a message, the message is complete once the block holding it is received
+ *	@param	frame Pointer to the frame
+ *	@param	index Index of the vector in the vector index
+ *	@return Number of the last word in the frame
+ */
+uint8_t lastMessageWord(struct frame* frame, uint8_t index);
+
+/** @brief	Outputs and deletes a complete message, or stores an incomplete message for the next fragment. Priority
+ *	messages are marked, and their latency is counted separately
+ *	@param	frame Pointer to the frame holding the last fragment
+ *	@param	index Index of the vector of the last fragment in the vector index
+ *	@param	msg Pointer to the message
+ */
+void deliverMessage(struct frame* frame, uint8_t index, struct message* msg);
+
+/** @brief	Finds the stored message a fragment belongs to (and takes it out of the store), or creates a new message
+ *	for an initial fragment
+ *	@param	frame Pointer to the frame
+ *	@param	index Index of the vector in the vector index
+ *	@param	head Decoded fragment header
+ *	@return Pointer to the message, or NULL if there was no memory
+ */
+struct message* fragmentMessage(struct frame* frame, uint8_t index, struct alphamessageheader* head);
+
+/** @brief	Adds the payload of a hex or secure vector to a (new or stored) message, and outputs it if it is complete
+ *	@param	frame Pointer to the frame
+ *	@param	index Index of the vector in the vector index
+ */
+void processBinaryVector(struct frame* frame, uint8_t index);
+
+/** @brief	Adds the content of an alpha vector to a (new or stored) message, and outputs it if it is complete
+ *	@param	frame Pointer to the frame
+ *	@param	index Index of the vector in the vector index
+ */
+void processAlphaVector(struct frame* frame, uint8_t index);
+
+/** @brief	Decodes a numeric vector (plain, special format or numbered) into a message and outputs it
+ *	@param	frame Pointer to the frame
+ *	@param	index Index of the vector in the vector index
+ */
+void processNumericVector(struct frame* frame, uint8_t index);
+
+/** @brief	Decodes a short message vector (3 numeric characters, or tone-only) into a message and outputs it
+ *	@param	frame Pointer to the frame
+ *	@param	index Index of the vector in the vector index
+ */
+void processShortVector(struct frame* frame, uint8_t index);
+
+/** @brief	Checks the subscription filter for all the addresses of a message
+ *	@param	frame Pointer to the frame
+ *	@param	index Index of the (first) vector of the message in the vector index
+ *	@return 1 if the message has to be decoded
+ */
+uint8_t vectorSubscribed(struct frame* frame, uint8_t index);
+
+/** @brief	Checks if a vector is a numeric message to a long address, these start with the second vector word
+ *	@param	vect Pointer to the vector
+ *	@return 1 if the first word of the message is in the vector field
+ */
+uint8_t longNumeric(struct vector* vect);
+
+/** @brief	Hashes the type, addresses and content words of a fragment, after repairing the words but before decoding
+ *	@param	frame Pointer to the frame
+ *	@param	index Index of the (first) vector of the message in the vector index
+ *	@return Hash of the fragment
+ */
+uint32_t fragmentHash(struct frame* frame, uint8_t index);
+
+/** @brief	Checks if a fragment was handled within the last DEDUP_WINDOW frames
+ *	@param	hash Hash of the fragment
+ *	@return 1 if it is a duplicate
+ */
+uint8_t seenFragment(uint32_t hash);
+
+/** @brief	Remembers a handled fragment, replacing the oldest one
+ *	@param	hash Hash of the fragment
+ */
+void rememberFragment(uint32_t hash);
+
+/** @brief	Checks if a frame has to be decoded. Frames in which no subscribed pager wakes up are skipped, unless a
+ *	fragmented message or a temporary address is waiting for them
+ *	@param	frame Pointer to the frame, the BIW must have been decoded
+ *	@return 1 if the address and vector field and the messages have to be decoded
+ */
+uint8_t frameMonitored(struct frame* frame);
+
+/** @brief	Processes all vectors of which the message content has been received
+ *	@param	frame Pointer to the frame
+ *	@param	ended 1 if the frame has ended, vectors that are still incomplete will be discarded
+ */
+void processMessages(struct frame* frame, uint8_t ended);
+
+/** @brief	Does all the processing that has become possible with the blocks received so far
+ *	@param	frame Pointer to the frame
+ *	@param	ended 1 if the frame has ended
+ */
+void advanceFrame(struct frame* frame, uint8_t ended);
+
+/** @brief	Finishes an ended frame: updates the mappings, times out stale messages and frees the frame
+ *	@param	frame Pointer to the frame
+ */
+void finishFrame(struct frame* frame);
+
+/** @brief	Processes the frame (entrypoint for frame processor). Called after every received block, with blocksready
+ *			and ended updated. If the processor is busy, the work is picked up when it's done with the current work
  *	@param	frame Pointer to the frame
  */
 void processFrame(struct frame* frame);
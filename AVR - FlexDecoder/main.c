@@ -19,6 +19,8 @@
 #include "flex.h"
 #include "flexprocess.h"
 #include "memdebug.h"
+#include "telemetry.h"
+#include "filter.h"
 
 char buffer[10];
 
@@ -28,6 +30,8 @@ int main(void){
 	wdt_reset();
 	wdt_enable(WDTO_4S);
 	
+	// the filter has to be ready before the first frame is processed
+	initFilter();
 	startFlex();
 	
 	// setup timer 0 for the second counter, will trigger 125 times / second
@@ -36,14 +40,17 @@ int main(void){
 	TCCR0B|=(1<<CS02)|(1<<CS00)|(1<<WGM02);
 	TCCR0A|=(1<<WGM01)|(1<<WGM00);
 	
-	// everything else is interrupt driven
+	// everything else is interrupt driven, the main loop only handles the (slow) filter commands
 	while (1){
-
+		filterPoll();
 	}
 }
 
 // triggers 125 times / second
 ISR(TIMER0_COMPA_vect){
+	PROFILE_BEGIN(PROBE_TIMER0);
+	TELEMETRY_STACK();
+	sys.uptime++;
 	sys.subsecond=(sys.subsecond+1)%125;
 	sei();
 	if(sys.subsecond==0){
@@ -57,4 +64,5 @@ ISR(TIMER0_COMPA_vect){
 		// feed the dog every second
 		wdt_reset();
 	}
+	PROFILE_END(PROBE_TIMER0);
 }
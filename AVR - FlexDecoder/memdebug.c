@@ -11,7 +11,6 @@
  *  http://andybrown.me.uk/ws/terms-and-conditions
  */
  
-#ifdef DEBUG
  
 #include <stdlib.h>
 #include <avr/io.h>
@@ -158,6 +157,3 @@ size_t getLargestNonFreeListBlock()
  
   return cp-brkval;
 }
- 
- 
-#endif // DEBUG
\ No newline at end of file
@@ -12,7 +12,8 @@
  */
  
  
-#ifdef DEBUG
+#ifndef MEMDEBUG_H_
+#define MEMDEBUG_H_
  
  
 #ifdef __cplusplus
@@ -37,4 +38,4 @@ extern size_t getLargestNonFreeListBlock();
 #endif
  
  
-#endif // DEBUG
\ No newline at end of file
+#endif // MEMDEBUG_H_
\ No newline at end of file
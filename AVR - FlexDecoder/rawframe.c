@@ -0,0 +1,50 @@
+/*
+ * rawframe.c
+ *
+ * Raw frame output for archive mode, see rawframe.h
+ */
+
+#include <avr/io.h>
+#include <util/crc16.h>
+
+#include "uart.h"
+#include "flex.h"
+#include "rawframe.h"
+
+static uint16_t crc;
+
+// writes a byte and adds it to the crc
+static void putByte(uint8_t byte){
+	crc=_crc_ccitt_update(crc,byte);
+	uart_putc(byte);
+}
+
+void outputRawFrame(struct frame* frame){
+	uint8_t block;
+	uint8_t word;
+	uint8_t count;
+	uint32_t value;
+
+	uart_putc(RAWFRAME_SYNC);
+	uart_putc(RAWFRAME_TYPE);
+	crc=0xFFFF;
+	putByte(frame->fiw.cycle);
+	putByte(frame->fiw.frame);
+	putByte(frame->fiw.repeat?RAWFRAME_REPEAT:0);
+	putByte(frame->blocksready);
+	for(block=0;block<RAWFRAME_WORDS/8;block++){
+		putByte(frame->block[block]?frame->block[block]->check:0);
+	}
+	for(block=0;block<RAWFRAME_WORDS/8;block++){
+		for(word=0;word<8;word++){
+			value=frame->block[block]?frame->block[block]->word[word]:0;
+			for(count=0;count<4;count++){
+				putByte((uint8_t)value);
+				value>>=8;
+			}
+		}
+	}
+	value=crc;
+	uart_putc((uint8_t)value);
+	uart_putc((uint8_t)(value>>8));
+}
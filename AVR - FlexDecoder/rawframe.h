@@ -0,0 +1,39 @@
+/**
+ *  @file
+ *  @defgroup Jelmers FLEX decoder raw frame output <rawframe.h>
+ *  @code #include <rawframe.h> @endcode
+ *
+ *  @brief Archive mode. With RAWFRAMES defined the frame processor doesn't decode anything: every frame is sent on as a
+ *	whole once it has ended, as validated by the first stage. The messages are decoded on the host, when they're asked
+ *	for (see flexarchive in the Linux tools). The only work left on the decoder is the BCH validation of the blocks.
+ *
+ *	A record is RAWFRAME_SYNC, RAWFRAME_TYPE, followed by
+ *		cycle, frame, flags, blocks					1 byte each, flags bit 0 is the FIW repeat bit
+ *		valid[RAWFRAME_WORDS/8]						bit (word%8) of byte (word/8) is set if the word passed the BCH check
+ *		word[RAWFRAME_WORDS]						4 bytes each, little endian, first received bit in bit 31
+ *		crc											CRC-CCITT (0x8408, start 0xFFFF) over everything after the type,
+ *													2 bytes, little endian
+ *	Blocks that weren't stored (idle, or no memory) are sent as 0 words that didn't pass. Records are mixed with the
+ *	regular text output and the trace records (binlog.h).
+ */
+
+#ifndef RAWFRAME_H_
+#define RAWFRAME_H_
+
+//#define RAWFRAMES
+
+#define RAWFRAME_SYNC 0x02
+#define RAWFRAME_TYPE 'F'
+#define RAWFRAME_WORDS 88
+#define RAWFRAME_REPEAT 0x01
+
+// bytes after the type, including the crc
+#define RAWFRAME_LENGTH (4+(RAWFRAME_WORDS/8)+(RAWFRAME_WORDS*4)+2)
+
+/** @brief  Writes a frame to the UART as a raw frame record. Must only be called from the frame processor, once the
+ *	frame has ended
+ *  @param  frame Pointer to the frame
+ */
+void outputRawFrame(struct frame* frame);
+
+#endif /* RAWFRAME_H_ */
@@ -0,0 +1,135 @@
+/*
+ * telemetry.c
+ *
+ * Heap and stack telemetry, see telemetry.h
+ */
+
+#include <avr/io.h>
+#include <stdlib.h>
+#include <util/atomic.h>
+
+#include "uart.h"
+#include "flex.h"
+#include "flexprocess.h"
+#include "binproto.h"
+#include "telemetry.h"
+#include "memdebug.h"
+
+// the block is text, a BINPROTO receiver that splits the output at the 0 bytes would get it glued to the end record of
+// the frame, so binary builds only keep the counters
+#if TELEMETRY_INTERVAL && !defined(BINPROTO)
+#define TELEMETRY_OUTPUT
+#endif
+
+struct telemetry telemetry;
+
+void initTelemetry(void){
+	uint8_t count;
+	telemetry.frames = 0;
+	telemetry.heapused = 0;
+	telemetry.heappeak = 0;
+	telemetry.largestfree = 0;
+	telemetry.largestfreemin = 0xFFFF;
+	telemetry.freeblocks = 0;
+	telemetry.freeblocksmax = 0;
+	telemetry.stackmin = RAMEND;
+	telemetry.storedpeak = 0;
+	telemetry.mappingpeak = 0;
+	for(count=0;count<ALLOC_SITES;count++){
+		telemetry.allocfail[count]=0;
+	}
+	telemetry.duplicates = 0;
+	telemetry.badfragments = 0;
+	telemetry.badsignatures = 0;
+	telemetry.prioritymessages = 0;
+	telemetry.prioritylatency = 0;
+	telemetry.latency = 0;
+	telemetry.skippedframes = 0;
+	telemetry.skippedvectors = 0;
+	telemetry.rejectedmappings = 0;
+}
+
+void telemetryAllocFail(uint8_t site){
+	// saturate instead of wrapping, a wrapped counter would hide the problem
+	if(telemetry.allocfail[site]<0xFF)telemetry.allocfail[site]++;
+}
+
+void telemetryCount(uint16_t* counter){
+	if(*counter<0xFFFF)(*counter)++;
+}
+
+void telemetryLatency(uint8_t priority, uint32_t ticks){
+	uint16_t latency = (ticks>0xFFFFUL*1000/64)?0xFFFF:(uint16_t)((ticks*64)/1000);
+	if(priority){
+		telemetryCount(&telemetry.prioritymessages);
+		if(latency>telemetry.prioritylatency)telemetry.prioritylatency=latency;
+	} else if(latency>telemetry.latency){
+		telemetry.latency=latency;
+	}
+}
+
+void telemetryPeak(uint8_t* peak, uint8_t inuse){
+	if(inuse>*peak)*peak=inuse;
+}
+
+#ifdef TELEMETRY_OUTPUT
+static char buffer[11];
+
+// writes a number and a separator
+static void putNumber(uint32_t number, char separator){
+	ultoa(number, buffer, 10);
+	uart_puts(buffer);
+	uart_putc(separator);
+}
+#endif
+
+void telemetryFrame(void){
+	#ifdef TELEMETRY_OUTPUT
+	uint8_t count;
+	#endif
+
+	// walking the free list while another allocation is going on would be a bad idea
+	ATOMIC_BLOCK(ATOMIC_FORCEON){
+		telemetry.heapused = getMemoryUsed();
+		telemetry.largestfree = getLargestAvailableMemoryBlock();
+		telemetry.freeblocks = getNumberOfBlocksInFreeList();
+	}
+	telemetry.frames++;
+	if(telemetry.heapused>telemetry.heappeak)telemetry.heappeak=telemetry.heapused;
+	if(telemetry.largestfree<telemetry.largestfreemin)telemetry.largestfreemin=telemetry.largestfree;
+	if(telemetry.freeblocks>telemetry.freeblocksmax)telemetry.freeblocksmax=telemetry.freeblocks;
+
+	#ifdef TELEMETRY_OUTPUT
+	if(telemetry.frames%TELEMETRY_INTERVAL)return;
+
+	uart_puts_P("[[telemetry]]");
+	putNumber(telemetry.frames,'|');
+	putNumber(telemetry.heapused,'|');
+	putNumber(telemetry.heappeak,'|');
+	putNumber(telemetry.largestfree,'|');
+	putNumber(telemetry.largestfreemin,'|');
+	putNumber(telemetry.freeblocks,'|');
+	putNumber(telemetry.freeblocksmax,'|');
+	putNumber(RAMEND-telemetry.stackmin,'|');
+	putNumber(telemetry.storedpeak,'|');
+	putNumber(telemetry.mappingpeak,'|');
+	for(count=0;count<ALLOC_SITES;count++){
+		putNumber(telemetry.allocfail[count],(count==ALLOC_SITES-1)?'|':',');
+	}
+	putNumber(telemetry.duplicates,'|');
+	putNumber(telemetry.badfragments,'|');
+	putNumber(telemetry.badsignatures,'|');
+	putNumber(telemetry.prioritymessages,'|');
+	putNumber(telemetry.prioritylatency,'|');
+	putNumber(telemetry.latency,'|');
+	putNumber(telemetry.skippedframes,'|');
+	putNumber(telemetry.skippedvectors,'|');
+	putNumber(telemetry.rejectedmappings,'\n');
+	uart_putc('\r');
+
+	// the largest free block and the latencies are reported as a trend, every interval starts over
+	telemetry.largestfreemin = 0xFFFF;
+	telemetry.prioritylatency = 0;
+	telemetry.latency = 0;
+	#endif
+}
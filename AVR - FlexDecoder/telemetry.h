@@ -0,0 +1,97 @@
+/**
+ *  @file
+ *  @defgroup Jelmers FLEX decoder heap and stack telemetry <telemetry.h>
+ *  @code #include <telemetry.h> @endcode
+ *
+ *  @brief Keeps track of heap usage, heap fragmentation, stack depth and allocation failures, and periodically writes
+ *	these figures to the serial output as
+ *	[[telemetry]]frames|used|peak|largest|largestmin|freeblocks|freeblocksmax|stack|storedpeak|mappingpeak|fail,fail,...
+ *	|duplicates|badfragments|badsignatures|prioritymessages|prioritylatency|latency|skippedframes|skippedvectors|rejectedmappings
+ *
+ *	Latencies are the longest time in ms from the end of the block holding the last word of a message to the message
+ *	being written to the UART, during the last interval. Priority messages are counted separately.
+ *
+ *	Heap figures are sampled once per processed frame (walking the free list), the stack pointer is sampled in the ISRs,
+ *	as the deepest stack is always reached in a nested interrupt.
+ */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+// number of processed frames between two telemetry blocks (32 frames is about a minute), 0 disables the output. BINPROTO
+// builds don't send the block
+#ifndef TELEMETRY_INTERVAL
+#define TELEMETRY_INTERVAL 32
+#endif
+
+// allocation call sites
+#define ALLOC_FRAME 0
+#define ALLOC_BLOCK 1
+#define ALLOC_MESSAGE 2
+#define ALLOC_MESSAGETEXT 3
+#define ALLOC_ADDRESSLIST 4
+#define ALLOC_MAPPING 5
+#define ALLOC_MAPPINGADDR 6
+#define ALLOC_VECTORS 7
+#define ALLOC_SITES 8
+
+struct telemetry{
+	uint32_t frames;				// frames processed since boot
+	uint16_t heapused;				// heap in use after the last frame
+	uint16_t heappeak;				// highest heap usage seen
+	uint16_t largestfree;			// largest block that could be allocated after the last frame
+	uint16_t largestfreemin;		// smallest 'largest block' seen during this interval
+	uint8_t freeblocks;				// blocks in the free list after the last frame
+	uint8_t freeblocksmax;			// most blocks in the free list seen
+	uint16_t stackmin;				// lowest stack pointer seen in the ISRs
+	uint8_t storedpeak;				// most fragmented messages stored at the same time
+	uint8_t mappingpeak;			// most temporary address mappings in use at the same time
+	uint8_t allocfail[ALLOC_SITES];	// failed allocations per call site
+	uint16_t duplicates;			// repeated fragments that were dropped
+	uint16_t badfragments;			// fragments of which the fragment check didn't match
+	uint16_t badsignatures;			// messages of which the signature didn't match
+	uint16_t prioritymessages;		// messages for a priority address that were output
+	uint16_t prioritylatency;		// longest latency of a priority message during this interval (ms)
+	uint16_t latency;				// longest latency of any other message during this interval (ms)
+	uint16_t skippedframes;			// frames no subscribed pager monitors, these aren't decoded
+	uint32_t skippedvectors;		// address words in the skipped frames
+	uint16_t rejectedmappings;		// group calls lost because the mapping row was taken by another frame still to come
+};
+
+extern struct telemetry telemetry;
+
+// samples the stack pointer, cheap enough to be used in every ISR
+#define TELEMETRY_STACK() if(SP<telemetry.stackmin)telemetry.stackmin=SP
+
+/** @brief  Resets all counters, called once at startup
+ */
+void initTelemetry(void);
+
+/** @brief  Counts a failed allocation
+ *  @param  site Call site of the allocation (see #defines)
+ */
+void telemetryAllocFail(uint8_t site);
+
+/** @brief  Counts an event, the counter saturates instead of wrapping
+ *  @param  counter Pointer to the counter
+ */
+void telemetryCount(uint16_t* counter);
+
+/** @brief  Records the latency of an output message
+ *  @param  priority 1 for a priority message
+ *	@param	ticks Time from receiving the last word to the output, in clock ticks (64 us)
+ */
+void telemetryLatency(uint8_t priority, uint32_t ticks);
+
+/** @brief  Updates a 'most in use' counter
+ *  @param  peak Pointer to the peak counter (storedpeak or mappingpeak)
+ *	@param	inuse Number of items currently in use
+ */
+void telemetryPeak(uint8_t* peak, uint8_t inuse);
+
+/** @brief  Samples the heap after a processed frame, and writes the telemetry block to the UART every
+ *	TELEMETRY_INTERVAL frames. Must only be called from the frame processor
+ */
+void telemetryFrame(void);
+
+#endif /* TELEMETRY_H_ */
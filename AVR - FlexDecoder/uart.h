@@ -80,7 +80,7 @@ LICENSE:
  *  CDEFS += -DUART_RX_BUFFER_SIZE=nn to your Makefile.
  */
 #ifndef UART_RX_BUFFER_SIZE
-#define UART_RX_BUFFER_SIZE 4
+#define UART_RX_BUFFER_SIZE 32
 #endif
 
 /** @brief  Size of the circular transmit buffer, must be power of 2 
@@ -1,42 +1,158 @@
 buffer = ""
+chunk = ""
+partial = ""
+priority = {}
 mutex = 0
 
+-- set to 1 for a decoder built with BINPROTO. Its records are COBS encoded and end with a 0 byte, instead of text chunks
+-- ending with a backspace. They're posted base64 encoded (needs the encoder module), one record per line
+binary = 0
+
 function Begin()
+   LoadFilter()
    WifiConnect()
 end
 
 function Listen()
     uart.setup(0, 115200, 8, uart.PARITY_NONE, uart.STOPBITS_1, 1)
-    uart.on("data", "\b", DataIn, 0)
+    if(binary==1) then
+        uart.on("data", "\0", DataIn, 0)
+    else
+        uart.on("data", "\b", DataIn, 0)
+    end
     print("Now listening")
 end
 
+-- sends the capcodes in filter.txt (one per line) to the decoder. The decoder keeps the filter in its EEPROM, so this
+-- is done at boot only if the file changed since it was last sent (its checksum is kept in filter.sum), call
+-- LoadFilter(1) to send it anyway. From the FC until the last FA line the decoder rejects every capcode, and EEPROM
+-- writes are slow, so the commands are paced: clearing takes about 2 seconds
+function LoadFilter(force)
+    filtersum = FilterSum()
+    if(filtersum==nil) then
+        return
+    end
+    if(force~=1 and file.open("filter.sum","r")~=nil) then
+        local last = file.readline()
+        file.close()
+        if(last==filtersum.."\n") then
+            return
+        end
+    end
+    file.open("filter.txt","r")
+    uart.write(0, "FC\n")
+    tmr.register(3,2500,tmr.ALARM_SEMI,SendFilterLine)
+    tmr.start(3)
+end
+
+-- a checksum of filter.txt, or nil if there's no filter
+function FilterSum()
+    local sum = 0
+    local line
+    if(file.open("filter.txt","r")==nil) then
+        return nil
+    end
+    line = file.readline()
+    while(line~=nil) do
+        for i=1,string.len(line) do
+            sum = (sum*31+string.byte(line,i))%65521
+        end
+        line = file.readline()
+    end
+    file.close()
+    return tostring(sum)
+end
+
+function SendFilterLine()
+    local line = file.readline()
+    if(line==nil) then
+        file.close()
+        file.open("filter.sum","w")
+        file.writeline(filtersum)
+        file.close()
+        return
+    end
+    line = string.gsub(line, "%s", "")
+    if(string.len(line)>0) then
+        uart.write(0, "FA"..line.."\n")
+    end
+    tmr.register(3,20,tmr.ALARM_SEMI,SendFilterLine)
+    tmr.start(3)
+end
+
+-- chunks end with a backspace. Regular chunks are batched in the buffer, priority messages are sent on their own, ahead
+-- of the buffer. A priority message has a frame start and end of its own, and the backspace in front of it cuts off the
+-- frame it came in: that part is kept until the rest of the frame is in
 function DataIn(data)
-    buffer = buffer .. data
-    if(string.len(data)==256) then -- edge case
-        if(string.byte(data,256)=="\b") then
-            PublishBuffer()
+    chunk = chunk .. data
+    if(string.len(data)==256) then -- edge case, the chunk may continue
+        if(string.byte(data,256)~=((binary==1) and 0 or 8)) then
+            return
         end
-    else
-        PublishBuffer()
     end
+    if(binary==1) then
+        RecordIn(chunk)
+        chunk = ""
+        return
+    end
+    if(string.find(chunk,"[[priority]]",1,true)) then
+        table.insert(priority, chunk)
+    elseif(string.find(chunk,"[[/frame]]",1,true)) then
+        buffer = buffer .. partial .. chunk
+        partial = ""
+    elseif(string.len(chunk)>1) then
+        partial = partial .. chunk
+    end
+    chunk = ""
     data = nil
+    Publish()
 end
 
-function PublishBuffer()
-    print("Sending data, len ="..string.len(buffer))
+-- a binary record. The byte after the COBS code is the record type, priority records ('P') go out right away, the rest
+-- is batched until the end of the frame ('E')
+function RecordIn(record)
+    local rtype = string.byte(record,2)
+    if(string.len(record)<4) then -- just the 0 in front of a record
+        return
+    end
+    record = encoder.toBase64(string.sub(record,1,-2)).."\n"
+    if(rtype==80) then
+        table.insert(priority, record)
+    else
+        buffer = buffer .. record
+    end
+    if(rtype==80 or rtype==69) then
+        Publish()
+    end
+end
+
+function Publish()
+    if(priority[1]~=nil) then
+        PostData(priority[1], function() table.remove(priority, 1) end)
+    elseif(string.len(buffer)>0) then
+        local length = string.len(buffer)
+        PostData(buffer, function() buffer = string.sub(buffer, length+1) end)
+    end
+end
+
+function PostData(data, sent)
+    print("Sending data, len ="..string.len(data))
   if(isconnected==1) then
     if(mutex==0) then
        mutex = 1
-    http.post("http://CHANGEME",'Content-Type: text/xml\r\n',buffer,
+    http.post("http://CHANGEME",(binary==1) and 'Content-Type: text/plain\r\n' or 'Content-Type: text/xml\r\n',data,
   function(code, data)
     if (code < 0) then
       print("HTTP request failed")
     else
-        buffer = ""
+        sent()
       --print(code)
     end
     mutex=0
+    -- send whatever came in while this request was busy, priority messages first
+    if (code >= 0) then
+        Publish()
+    end
   end)
   end
   end
@@ -0,0 +1,481 @@
+/*
+ * flexarchive.c
+ *
+ * Stores the raw frames of a RAWFRAMES build of the AVR decoder (see rawframe.h), and decodes them when they're asked
+ * for. The decoder doesn't have the memory to keep anything, so it sends every frame on, and the messages are only
+ * decoded for the frames a query actually touches.
+ *
+ * The archive is a directory with two files of fixed size slots, used as a ring:
+ *   frames    the raw frame records, with the time they were received
+ *   index     a header with the capacity and the sequence number of the next frame, followed by an entry per slot with
+ *             the time, the cycle and frame number and a 256 bit bloom filter of the capcodes in the address field
+ * A frame is written to its slot first, then to the index, and the header is updated last, so a frame that was cut short
+ * by a crash is never referenced. Queries only read the frames whose index entry matches.
+ *
+ * Build: gcc -O2 -Wall -I"../AVR - FlexDecoder" -o flexarchive flexarchive.c flexdecode.c
+ * Usage: flexarchive store <dir> [-c frames] [/dev/ttyUSB0|capture-file]   (reads stdin if no input is given)
+ *        flexarchive query <dir> [-r capcode] [-s from] [-e to]            (times in seconds since the epoch)
+ * Query output uses the [[frame]]/[[msg]]/[[addr]]/[[data]]/[[bin]] format of the decoder.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/stat.h>
+
+#include "flexdecode.h"
+
+struct frame;
+#include "rawframe.h"
+
+// 24 hours of frames
+#define DEFAULT_CAPACITY 46080
+
+#define INDEX_MAGIC 0x58454C46UL
+#define BLOOM_BYTES 32
+
+// fragmented messages that are being joined, and recently output fragments (to drop repeats and simulcasts)
+#define PENDING_MESSAGES 64
+#define RECENT_FRAGMENTS 8
+#define RECENT_WINDOW 64
+
+struct indexheader {
+	uint32_t magic;
+	uint32_t capacity;
+	uint64_t next;					// sequence number of the next frame, the slot is next%capacity
+};
+
+struct indexentry {
+	uint64_t sequence;
+	int64_t time;
+	uint8_t cycle;
+	uint8_t frame;
+	uint8_t bloom[BLOOM_BYTES];
+};
+
+struct frameslot {
+	int64_t time;
+	uint8_t record[RAWFRAME_LENGTH];
+};
+
+struct archive {
+	int frames;
+	int index;
+	struct indexheader header;
+};
+
+// a message of which not all fragments have been seen yet
+struct pending {
+	int used;
+	uint64_t age;
+	struct flexmessage head;		// addresses and flags of the first fragment seen
+	char* text;
+	size_t length;
+	uint8_t* data;
+	size_t bits;
+	uint8_t sigsum;
+};
+
+struct query {
+	uint64_t capcode;
+	int filtered;
+	uint64_t sequence;
+	int64_t time;
+	int framestarted;
+	struct pending pending[PENDING_MESSAGES];
+	uint64_t recent[RECENT_FRAGMENTS];
+	uint64_t recentseq[RECENT_FRAGMENTS];
+	uint8_t recentnext;
+};
+
+// puts a serial port in raw 115200 baud mode, does nothing for regular files
+static void setupPort(int fd){
+	struct termios tio;
+	if(!isatty(fd))return;
+	if(tcgetattr(fd,&tio))return;
+	cfmakeraw(&tio);
+	cfsetispeed(&tio,B115200);
+	cfsetospeed(&tio,B115200);
+	tcsetattr(fd,TCSANOW,&tio);
+}
+
+static uint64_t mix(uint64_t value){
+	value^=value>>33;
+	value*=0xFF51AFD7ED558CCDULL;
+	value^=value>>33;
+	value*=0xC4CEB9FE1A85EC53ULL;
+	return value^(value>>33);
+}
+
+static void bloomAdd(uint8_t* bloom, uint64_t capcode){
+	uint64_t hash = mix(capcode);
+	uint8_t count;
+	for(count=0;count<3;count++){
+		bloom[(hash&0xFF)/8]|=1<<(hash&7);
+		hash>>=8;
+	}
+}
+
+static int bloomMatch(const uint8_t* bloom, uint64_t capcode){
+	uint64_t hash = mix(capcode);
+	uint8_t count;
+	for(count=0;count<3;count++){
+		if(!(bloom[(hash&0xFF)/8]&(1<<(hash&7))))return 0;
+		hash>>=8;
+	}
+	return 1;
+}
+
+static int openArchive(struct archive* archive, const char* dir, uint32_t capacity, int create){
+	char path[4096];
+	int flags = create?O_RDWR|O_CREAT:O_RDONLY;
+	if(create)mkdir(dir,0755);
+	snprintf(path,sizeof(path),"%s/frames",dir);
+	archive->frames=open(path,flags,0644);
+	if(archive->frames<0){
+		perror(path);
+		return 0;
+	}
+	snprintf(path,sizeof(path),"%s/index",dir);
+	archive->index=open(path,flags,0644);
+	if(archive->index<0){
+		perror(path);
+		return 0;
+	}
+	if(pread(archive->index,&archive->header,sizeof(archive->header),0)!=sizeof(archive->header)){
+		if(!create){
+			fprintf(stderr,"%s: empty archive\n",dir);
+			return 0;
+		}
+		archive->header.magic=INDEX_MAGIC;
+		archive->header.capacity=capacity;
+		archive->header.next=0;
+		if(pwrite(archive->index,&archive->header,sizeof(archive->header),0)!=sizeof(archive->header)){
+			perror(path);
+			return 0;
+		}
+	}
+	if(archive->header.magic!=INDEX_MAGIC||archive->header.capacity==0){
+		fprintf(stderr,"%s: not an archive\n",dir);
+		return 0;
+	}
+	return 1;
+}
+
+static off_t entryOffset(struct archive* archive, uint64_t sequence){
+	return sizeof(struct indexheader)+(off_t)(sequence%archive->header.capacity)*sizeof(struct indexentry);
+}
+
+static off_t slotOffset(struct archive* archive, uint64_t sequence){
+	return (off_t)(sequence%archive->header.capacity)*sizeof(struct frameslot);
+}
+
+static int storeFrame(struct archive* archive, const uint8_t* record, const struct flexframe* frame){
+	struct frameslot slot;
+	struct indexentry entry;
+	uint64_t capcodes[FLEX_WORDS];
+	int count;
+	int index;
+
+	memset(&slot,0,sizeof(slot));
+	memset(&entry,0,sizeof(entry));
+	slot.time=time(NULL);
+	memcpy(slot.record,record,RAWFRAME_LENGTH);
+	entry.sequence=archive->header.next;
+	entry.time=slot.time;
+	entry.cycle=frame->cycle;
+	entry.frame=frame->frame;
+	count=flexFrameAddresses(frame,capcodes,FLEX_WORDS);
+	for(index=0;index<count;index++){
+		bloomAdd(entry.bloom,capcodes[index]);
+	}
+
+	// the slot, then the index entry, then the header: the header never points at a frame that isn't complete
+	if(pwrite(archive->frames,&slot,sizeof(slot),slotOffset(archive,entry.sequence))!=sizeof(slot))return 0;
+	if(pwrite(archive->index,&entry,sizeof(entry),entryOffset(archive,entry.sequence))!=sizeof(entry))return 0;
+	archive->header.next++;
+	return pwrite(archive->index,&archive->header,sizeof(archive->header),0)==sizeof(archive->header);
+}
+
+static int store(const char* dir, uint32_t capacity, int fd){
+	struct archive archive;
+	struct flexscanner scanner;
+	struct flexframe frame;
+	uint8_t buffer[4096];
+	ssize_t length;
+	ssize_t pos;
+
+	if(!openArchive(&archive,dir,capacity,1))return 1;
+	memset(&scanner,0,sizeof(scanner));
+	while((length=read(fd,buffer,sizeof(buffer)))>0){
+		for(pos=0;pos<length;pos++){
+			if(!flexScan(&scanner,buffer[pos],&frame))continue;
+			if(!storeFrame(&archive,scanner.record,&frame)){
+				perror(dir);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void outputCapcode(uint64_t capcode){
+	printf("[[addr]]%llu\n",(unsigned long long)capcode);
+}
+
+static void outputMessage(struct query* query, const struct flexmessage* head, const char* text, size_t length, const uint8_t* data, size_t bits){
+	size_t count;
+	if(!query->framestarted){
+		printf("[[frame]]%u|%u|%lld\n",head->cycle,head->frame,(long long)query->time);
+		query->framestarted=1;
+	}
+	printf("[[msg]]\n");
+	if(head->priority)printf("[[priority]]\n");
+	for(count=0;count<head->addresscount;count++){
+		outputCapcode(head->capcode[count]);
+	}
+	printf("[[data]]");
+	fwrite(text,1,length,stdout);
+	printf("[[/data]]\n");
+	if((head->type==FLEX_HEX)||(head->type==FLEX_SECURE)){
+		printf("[[bin]]");
+		for(count=0;count<bits/8;count++){
+			printf("%02X",data[count]);
+		}
+		printf("[[/bin]]\n");
+	}
+	printf("[[/msg]]\n");
+}
+
+static int wanted(struct query* query, const struct flexmessage* msg){
+	uint16_t count;
+	if(!query->filtered)return 1;
+	for(count=0;count<msg->addresscount;count++){
+		if(msg->capcode[count]==query->capcode)return 1;
+	}
+	return 0;
+}
+
+// drops fragments that were output a short while ago, as the decoder does for repeated frames and simulcasts
+static int repeated(struct query* query, const struct flexmessage* msg){
+	uint64_t hash = 14695981039346656037ULL;
+	uint8_t count;
+	const uint8_t* bytes;
+	size_t length;
+	size_t pos;
+	for(count=0;count<3;count++){
+		switch(count){
+			case 0:
+				bytes=(const uint8_t*)msg->capcode;
+				length=msg->addresscount*sizeof(uint64_t);
+				break;
+			case 1:
+				bytes=(const uint8_t*)msg->text;
+				length=msg->length;
+				break;
+			default:
+				bytes=msg->data;
+				length=(msg->bits+7)/8;
+				break;
+		}
+		for(pos=0;pos<length;pos++){
+			hash=(hash^bytes[pos])*1099511628211ULL;
+		}
+	}
+	hash=(hash^((uint64_t)msg->type<<8|msg->messageno<<2|msg->fragment))*1099511628211ULL;
+	for(count=0;count<RECENT_FRAGMENTS;count++){
+		if((query->recent[count]==hash)&&(query->sequence-query->recentseq[count]<RECENT_WINDOW))return 1;
+	}
+	query->recent[query->recentnext]=hash;
+	query->recentseq[query->recentnext]=query->sequence;
+	query->recentnext=(query->recentnext+1)%RECENT_FRAGMENTS;
+	return 0;
+}
+
+static void flushPending(struct query* query, struct pending* pending){
+	outputMessage(query,&pending->head,pending->text,pending->length,pending->data,pending->bits);
+	free(pending->text);
+	free(pending->data);
+	memset(pending,0,sizeof(*pending));
+}
+
+static struct pending* findPending(struct query* query, const struct flexmessage* msg){
+	uint8_t count;
+	struct pending* pending;
+	for(count=0;count<PENDING_MESSAGES;count++){
+		pending=&query->pending[count];
+		if(pending->used&&(pending->head.type==msg->type)&&(pending->head.messageno==msg->messageno)&&
+			(pending->head.capcode[0]==msg->capcode[0])){
+			return pending;
+		}
+	}
+	return NULL;
+}
+
+static struct pending* newPending(struct query* query, const struct flexmessage* msg){
+	uint8_t count;
+	struct pending* oldest = &query->pending[0];
+	for(count=0;count<PENDING_MESSAGES;count++){
+		if(!query->pending[count].used){
+			oldest=&query->pending[count];
+			break;
+		}
+		if(query->pending[count].age<oldest->age)oldest=&query->pending[count];
+	}
+	// the table is full, the message that has waited longest goes out as it is
+	if(oldest->used)flushPending(query,oldest);
+	oldest->used=1;
+	oldest->age=query->sequence;
+	oldest->head=*msg;
+	oldest->head.signature=FLEX_NO_SIGNATURE;
+	return oldest;
+}
+
+static void addFragment(struct pending* pending, const struct flexmessage* msg){
+	size_t count;
+	if(msg->signature!=FLEX_NO_SIGNATURE)pending->head.signature=msg->signature;
+	pending->head.priority|=msg->priority;
+	pending->sigsum+=msg->sigsum;
+	pending->text=realloc(pending->text,pending->length+msg->length);
+	memcpy(pending->text+pending->length,msg->text,msg->length);
+	pending->length+=msg->length;
+	pending->data=realloc(pending->data,(pending->bits+msg->bits+7)/8+1);
+	for(count=0;count<msg->bits;count++){
+		if(!(pending->bits%8))pending->data[pending->bits/8]=0;
+		if(msg->data[count/8]&(1<<(count%8)))pending->data[pending->bits/8]|=1<<(pending->bits%8);
+		pending->bits++;
+	}
+}
+
+static void handleMessage(const struct flexmessage* msg, void* context){
+	struct query* query = context;
+	struct pending* pending;
+
+	if(!wanted(query,msg)||repeated(query,msg))return;
+
+	// numeric and short messages are never fragmented
+	if((msg->type!=FLEX_ALPHA)&&(msg->type!=FLEX_HEX)&&(msg->type!=FLEX_SECURE)){
+		outputMessage(query,msg,msg->text,msg->length,msg->data,msg->bits);
+		return;
+	}
+	pending=(msg->fragment==3)?NULL:findPending(query,msg);
+	if(!pending){
+		if(!msg->continued){
+			outputMessage(query,msg,msg->text,msg->length,msg->data,msg->bits);
+			return;
+		}
+		pending=newPending(query,msg);
+	}
+	addFragment(pending,msg);
+	if(msg->continued)return;
+
+	// only messages of which the first fragment was seen have a signature
+	if((pending->head.type==FLEX_ALPHA)&&(pending->head.signature!=FLEX_NO_SIGNATURE)&&
+		(((~pending->sigsum)&0x7F)!=pending->head.signature)){
+		free(pending->text);
+		free(pending->data);
+		memset(pending,0,sizeof(*pending));
+		return;
+	}
+	pending->head.cycle=msg->cycle;
+	pending->head.frame=msg->frame;
+	flushPending(query,pending);
+}
+
+static int query(const char* dir, struct query* query, int64_t from, int64_t to){
+	struct archive archive;
+	struct indexentry entry;
+	struct frameslot slot;
+	struct flexframe frame;
+	uint64_t first;
+	uint8_t count;
+
+	if(!openArchive(&archive,dir,0,0))return 1;
+	first=(archive.header.next>archive.header.capacity)?archive.header.next-archive.header.capacity:0;
+	for(query->sequence=first;query->sequence<archive.header.next;query->sequence++){
+		// the index decides which frames are read at all
+		if(pread(archive.index,&entry,sizeof(entry),entryOffset(&archive,query->sequence))!=sizeof(entry))break;
+		if(entry.sequence!=query->sequence)continue;
+		if((entry.time<from)||(entry.time>to))continue;
+		if(query->filtered&&!bloomMatch(entry.bloom,query->capcode))continue;
+
+		if(pread(archive.frames,&slot,sizeof(slot),slotOffset(&archive,query->sequence))!=sizeof(slot))break;
+		if(!flexParseRecord(slot.record,&frame))continue;
+		query->time=slot.time;
+		query->framestarted=0;
+		flexDecodeFrame(&frame,handleMessage,query);
+		if(query->framestarted)printf("[[/frame]]\n");
+	}
+
+	// messages of which the last fragment wasn't seen are output as they are
+	query->framestarted=0;
+	for(count=0;count<PENDING_MESSAGES;count++){
+		if(query->pending[count].used)flushPending(query,&query->pending[count]);
+	}
+	if(query->framestarted)printf("[[/frame]]\n");
+	return 0;
+}
+
+static void usage(void){
+	fprintf(stderr,"usage: flexarchive store <dir> [-c frames] [/dev/ttyUSB0|capture-file]\n");
+	fprintf(stderr,"       flexarchive query <dir> [-r capcode] [-s from] [-e to]\n");
+}
+
+int main(int argc, char** argv){
+	struct query* state;
+	uint32_t capacity = DEFAULT_CAPACITY;
+	int64_t from = INT64_MIN;
+	int64_t to = INT64_MAX;
+	int fd = 0;
+	int arg;
+	int result;
+
+	if(argc<3){
+		usage();
+		return 1;
+	}
+
+	if(!strcmp(argv[1],"store")){
+		for(arg=3;arg<argc;arg++){
+			if(!strcmp(argv[arg],"-c")&&(arg+1<argc)){
+				capacity=strtoul(argv[++arg],NULL,10);
+			} else {
+				fd=open(argv[arg],O_RDONLY|O_NOCTTY);
+				if(fd<0){
+					perror(argv[arg]);
+					return 1;
+				}
+				setupPort(fd);
+			}
+		}
+		return store(argv[2],capacity,fd);
+	}
+
+	if(!strcmp(argv[1],"query")){
+		state=calloc(1,sizeof(struct query));
+		for(arg=3;arg+1<argc;arg+=2){
+			if(!strcmp(argv[arg],"-r")){
+				state->capcode=strtoull(argv[arg+1],NULL,10);
+				state->filtered=1;
+			} else if(!strcmp(argv[arg],"-s")){
+				from=strtoll(argv[arg+1],NULL,10);
+			} else if(!strcmp(argv[arg],"-e")){
+				to=strtoll(argv[arg+1],NULL,10);
+			} else {
+				usage();
+				return 1;
+			}
+		}
+		result=query(argv[2],state,from,to);
+		free(state);
+		return result;
+	}
+
+	usage();
+	return 1;
+}
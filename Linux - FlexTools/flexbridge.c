@@ -0,0 +1,938 @@
+/*
+ * flexbridge.c
+ *
+ * Forwards the output of the AVR decoder to an HTTP server, in place of the ESP8266 (see "ESP8266 - FlexDecoder"). The
+ * serial port is read into a ring buffer, and the [[frame]]/[[msg]] records (or the binary records of protocol v2) are
+ * parsed where they are (see flexstream.h). The records are collected into batches, which are POSTed as text/plain in
+ * the format of the decoder, over a single keep-alive HTTP/1.1 connection with several requests in flight.
+ *
+ * A batch is closed at the end of a frame once it has reached the batch size or its oldest record is older than the
+ * batch time. A priority message is sent right away in a batch of its own, with the start and end of its frame, ahead
+ * of the batches that are waiting.
+ * Batches are only forgotten after a 2xx response (or a 4xx, which won't get better by retrying), so a batch can arrive
+ * twice but isn't lost. When the server can't be reached, the bridge retries with a backoff from 0.5 to 60 seconds, and
+ * the batches go to the spool directory (if one is given), oldest first when the spool is full. The spool is sent first
+ * when the server is back, also after a restart of the bridge. Without a spool, batches are kept in memory, up to 4 MB.
+ *
+ * With -l, the bridge also runs a publish/subscribe server for local consumers on that port (see flexpubsub.h), with
+ * the policy for slow subscribers given by -P. With -r, every record is also published in a shared memory ring of that
+ * name (see flexshm.h, flexwatch shows what's in it), for consumers on the same machine. The HTTP server, -l and -r can
+ * each be left out, as long as one of them is given.
+ *
+ * Build: gcc -O2 -Wall -I"../AVR - FlexDecoder" -o flexbridge flexbridge.c flexstream.c flexpubsub.c flexshm.c flexproto.c
+ * Usage: flexbridge [http://host[:port]/path] [-b bytes] [-t ms] [-p depth] [-s spooldir] [-m spoolbytes]
+ *                   [-l port] [-P drop|disconnect] [-r /flexring] [/dev/ttyUSB0|capture-file]
+ *                   (reads stdin if no input is given)
+ *        -b batch size (16384), -t batch time (2000, 0 sends every frame), -p requests in flight (4),
+ *        -m spool size limit (64 MB), -P policy for slow subscribers (drop)
+ * With a capture file, the bridge exits when everything has been sent, or spooled while the server is down.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "flexstream.h"
+#include "flexpubsub.h"
+#include "flexshm.h"
+
+#define INPUT_RING 65536
+#define RESPONSE_BUFFER 16384
+#define MEMORY_QUEUE (4*1024*1024)
+// room behind the batch size for the record that completes it
+#define BATCH_SLACK 16384
+
+#define BACKOFF_MIN 500
+#define BACKOFF_MAX 60000
+
+// spool files are numbered from the middle, so batches can also be put in front of the spool
+#define SPOOL_START (1ULL<<40)
+
+#define LINK_DOWN 0
+#define LINK_CONNECTING 1
+#define LINK_UP 2
+
+// response parser states
+#define RESPONSE_HEAD 0
+#define RESPONSE_BODY 1
+#define RESPONSE_CHUNKSIZE 2
+#define RESPONSE_CHUNK 3
+#define RESPONSE_TRAILER 4
+
+struct batch {
+	struct batch* next;
+	uint64_t sequence;				// spool file, 0 if the batch is only in memory
+	size_t length;
+	char body[];
+};
+
+struct queue {
+	struct batch* first;
+	struct batch* last;
+	size_t bytes;
+	unsigned count;
+};
+
+// configuration
+static int uplink = 0;
+static int pubsub = 0;
+static int ring = 0;
+static struct flexshm shm;
+static char host[256];
+static char port[16] = "80";
+static char path[1024] = "/";
+static size_t batchsize = 16384;
+static long batchtime = 2000;
+static unsigned depth = 4;
+static const char* spooldir = NULL;
+static uint64_t spoolmax = 64*1024*1024;
+
+// frame the records are from
+static uint8_t cycle;
+static uint8_t frame;
+static int inframe = 0;
+static int wrapped = 0;
+
+// batch that is being filled
+static char* pending;
+static size_t pendinglength = 0;
+static long pendingsince;
+
+// batch with a priority message
+static char* urgent;
+
+static struct queue queue;			// waiting to be sent
+static struct queue inflight;		// sent (or being sent), waiting for the response
+static struct batch* sending;		// first batch in flight that isn't completely written
+static size_t sendoffset;			// bytes of it written, request header included
+
+static int linkstate = LINK_DOWN;
+static int failing = 0;				// set from a failed attempt up to the next 2xx response
+static int sock = -1;
+static long retryat = 0;
+static long backoff = BACKOFF_MIN;
+
+static char response[RESPONSE_BUFFER];
+static size_t responselength;
+static int responsestate;
+static size_t responseremaining;
+static int responsestatus;
+static int responseclose;
+
+// spool files spoolfirst..spoolnext-1, spoolread is the next one to send
+static uint64_t spoolfirst = SPOOL_START;
+static uint64_t spoolnext = SPOOL_START;
+static uint64_t spoolread = SPOOL_START;
+static uint64_t spoolbytes = 0;
+
+static unsigned long sent = 0;
+static unsigned long dropped = 0;
+
+static volatile sig_atomic_t stop = 0;
+
+static long now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000L+ts.tv_nsec/1000000;
+}
+
+static void onSignal(int sig){
+	(void)sig;
+	stop=1;
+}
+
+// puts a serial port in raw 115200 baud mode, does nothing for regular files
+static void setupPort(int fd){
+	struct termios tio;
+	if(!isatty(fd))return;
+	if(tcgetattr(fd,&tio))return;
+	cfmakeraw(&tio);
+	cfsetispeed(&tio,B115200);
+	cfsetospeed(&tio,B115200);
+	tcsetattr(fd,TCSANOW,&tio);
+}
+
+static int parseUrl(const char* url){
+	const char* pos;
+	const char* slash;
+	const char* colon;
+	size_t length;
+	if(strncmp(url,"http://",7))return 0;
+	pos=url+7;
+	slash=strchr(pos,'/');
+	if(!slash)slash=pos+strlen(pos);
+	colon=memchr(pos,':',slash-pos);
+	length=(colon?colon:slash)-pos;
+	if(!length||(length>=sizeof(host)))return 0;
+	memcpy(host,pos,length);
+	host[length]=0;
+	if(colon){
+		length=slash-colon-1;
+		if(!length||(length>=sizeof(port)))return 0;
+		memcpy(port,colon+1,length);
+		port[length]=0;
+	}
+	if(*slash){
+		if(strlen(slash)>=sizeof(path))return 0;
+		strcpy(path,slash);
+	}
+	return 1;
+}
+
+static void push(struct queue* q, struct batch* b){
+	b->next=NULL;
+	if(q->last){
+		q->last->next=b;
+	} else {
+		q->first=b;
+	}
+	q->last=b;
+	q->bytes+=b->length;
+	q->count++;
+}
+
+static void pushFront(struct queue* q, struct batch* b){
+	b->next=q->first;
+	q->first=b;
+	if(!q->last)q->last=b;
+	q->bytes+=b->length;
+	q->count++;
+}
+
+static struct batch* pop(struct queue* q){
+	struct batch* b = q->first;
+	if(!b)return NULL;
+	q->first=b->next;
+	if(!q->first)q->last=NULL;
+	q->bytes-=b->length;
+	q->count--;
+	return b;
+}
+
+static struct batch* newBatch(const char* body, size_t length){
+	struct batch* b = malloc(sizeof(struct batch)+length);
+	if(!b){
+		perror("malloc");
+		exit(1);
+	}
+	b->next=NULL;
+	b->sequence=0;
+	b->length=length;
+	memcpy(b->body,body,length);
+	return b;
+}
+
+static void spoolName(char* name, size_t size, uint64_t sequence, const char* suffix){
+	snprintf(name,size,"%s/%016llx%s",spooldir,(unsigned long long)sequence,suffix);
+}
+
+// removes a spool file, returns its size
+static uint64_t spoolRemove(uint64_t sequence){
+	char name[1100];
+	struct stat st;
+	spoolName(name,sizeof(name),sequence,"");
+	if(stat(name,&st))return 0;
+	unlink(name);
+	return st.st_size;
+}
+
+// writes a batch to the spool under its sequence number. The file is written under a temporary name first, so a crash
+// never leaves half a batch in the spool
+static int spoolWrite(struct batch* b){
+	char name[1100];
+	char temp[1100];
+	int fd;
+	spoolName(name,sizeof(name),b->sequence,"");
+	spoolName(temp,sizeof(temp),b->sequence,".tmp");
+	fd=open(temp,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if(fd<0){
+		perror(temp);
+		return 0;
+	}
+	if((write(fd,b->body,b->length)!=(ssize_t)b->length)||close(fd)||rename(temp,name)){
+		perror(temp);
+		unlink(temp);
+		return 0;
+	}
+	spoolbytes+=b->length;
+	return 1;
+}
+
+// drops the oldest spool files until the spool fits its limit again
+static void spoolTrim(void){
+	uint64_t size;
+	while((spoolbytes>spoolmax)&&(spoolfirst<spoolnext)){
+		size=spoolRemove(spoolfirst++);
+		spoolbytes-=(size<spoolbytes)?size:spoolbytes;
+		dropped++;
+	}
+	if(spoolread<spoolfirst)spoolread=spoolfirst;
+}
+
+static int spoolEmpty(void){
+	return !spooldir||(spoolfirst>=spoolnext);
+}
+
+// adds a batch behind the spool (or in front of it) and frees it. Returns 0 if it couldn't be written
+static int spoolBatch(struct batch* b, int front){
+	if(front){
+		if(spoolread>spoolfirst)return 0;
+		b->sequence=spoolfirst-1;
+	} else {
+		b->sequence=spoolnext;
+	}
+	if(!spoolWrite(b))return 0;
+	if(front){
+		spoolfirst--;
+		spoolread=spoolfirst;
+	} else {
+		spoolnext++;
+	}
+	free(b);
+	spoolTrim();
+	return 1;
+}
+
+// reads the next spool file into a batch, NULL if there are no more
+static struct batch* spoolLoad(void){
+	char name[1100];
+	struct stat st;
+	struct batch* b;
+	int fd;
+	while(spoolread<spoolnext){
+		spoolName(name,sizeof(name),spoolread++,"");
+		fd=open(name,O_RDONLY);
+		if(fd<0)continue;
+		if(fstat(fd,&st)){
+			close(fd);
+			continue;
+		}
+		b=malloc(sizeof(struct batch)+st.st_size);
+		if(!b||(read(fd,b->body,st.st_size)!=st.st_size)){
+			free(b);
+			close(fd);
+			continue;
+		}
+		close(fd);
+		b->next=NULL;
+		b->sequence=spoolread-1;
+		b->length=st.st_size;
+		return b;
+	}
+	return NULL;
+}
+
+// picks up the batches that were spooled before a restart
+static void spoolOpen(void){
+	DIR* dir;
+	struct dirent* entry;
+	struct stat st;
+	char name[1100];
+	unsigned long long sequence;
+	int count = 0;
+	mkdir(spooldir,0755);
+	dir=opendir(spooldir);
+	if(!dir){
+		perror(spooldir);
+		exit(1);
+	}
+	while((entry=readdir(dir))){
+		if(strlen(entry->d_name)<16)continue;
+		if(strstr(entry->d_name,".tmp")){
+			snprintf(name,sizeof(name),"%s/%s",spooldir,entry->d_name);
+			unlink(name);
+			continue;
+		}
+		if((strlen(entry->d_name)!=16)||(sscanf(entry->d_name,"%llx",&sequence)!=1))continue;
+		snprintf(name,sizeof(name),"%s/%s",spooldir,entry->d_name);
+		if(stat(name,&st))continue;
+		if(!count||(sequence<spoolfirst))spoolfirst=sequence;
+		if(!count||(sequence>=spoolnext))spoolnext=sequence+1;
+		spoolbytes+=st.st_size;
+		count++;
+	}
+	closedir(dir);
+	spoolread=spoolfirst;
+	if(count)fprintf(stderr,"flexbridge: %d batches in the spool\n",count);
+}
+
+// a batch was answered, or is given up on
+static void batchDone(struct batch* b){
+	if(b->sequence){
+		spoolbytes-=(b->length<spoolbytes)?b->length:spoolbytes;
+		spoolRemove(b->sequence);
+		if(b->sequence>=spoolfirst)spoolfirst=b->sequence+1;
+	}
+	free(b);
+}
+
+static void queueBatch(struct batch* b, int priority){
+	// new batches go behind the spool, to keep them in order. Priority messages go in front when they can be sent now:
+	// the memory queue is sent before the spool, so while the link is up they don't wait for a spool that is draining
+	struct batch* second;
+	int direct = priority&&(linkstate==LINK_UP);
+	if(spooldir&&!direct&&(!spoolEmpty()||(queue.bytes>MEMORY_QUEUE)||(failing&&!priority))){
+		if(spoolBatch(b,0))return;
+	}
+	if(priority){
+		pushFront(&queue,b);
+	} else {
+		push(&queue,b);
+	}
+	// without a spool the oldest batches are dropped, but not the priority message that was just added
+	while((queue.bytes>MEMORY_QUEUE)&&(queue.count>1)){
+		if(queue.first==b){
+			second=b->next;
+			b->next=second->next;
+			if(queue.last==second)queue.last=b;
+			queue.bytes-=second->length;
+			queue.count--;
+			free(second);
+		} else {
+			free(pop(&queue));
+		}
+		dropped++;
+	}
+}
+
+static void flushPending(void){
+	if(!pendinglength)return;
+	queueBatch(newBatch(pending,pendinglength),0);
+	pendinglength=0;
+}
+
+static void onItem(const struct flexitem* item, void* context){
+	size_t length;
+	struct flexitem tag;
+	(void)context;
+	// the decoder sends a priority message in the middle of its frame, with a frame start and end of its own. Those are
+	// left out, the consumers and the batches get every frame once
+	if(item->type==ITEM_FRAME){
+		if(inframe&&(item->cycle==cycle)&&(item->frame==frame)){
+			wrapped=1;
+			return;
+		}
+		inframe=1;
+		cycle=item->cycle;
+		frame=item->frame;
+	} else if(item->type==ITEM_END){
+		if(wrapped){
+			wrapped=0;
+			return;
+		}
+		inframe=0;
+	}
+	// local consumers and subscribers get everything right away, it isn't batched
+	if(ring)flexShmPublish(&shm,item,cycle,frame);
+	if(pubsub)pubsubPublish(item,cycle,frame);
+	if(!uplink)return;
+	// a priority message doesn't wait for the batch, it goes out in a batch of its own with the start and end of its frame
+	if((item->type==ITEM_MESSAGE)&&item->priority){
+		memset(&tag,0,sizeof(tag));
+		tag.type=ITEM_FRAME;
+		tag.cycle=cycle;
+		tag.frame=frame;
+		length=flexFormatItem(&tag,urgent,batchsize+BATCH_SLACK);
+		length+=flexFormatItem(item,urgent+length,batchsize+BATCH_SLACK-length);
+		tag.type=ITEM_END;
+		length+=flexFormatItem(&tag,urgent+length,batchsize+BATCH_SLACK-length);
+		queueBatch(newBatch(urgent,length),1);
+		return;
+	}
+	if(!pendinglength)pendingsince=now();
+	length=flexFormatItem(item,pending+pendinglength,batchsize+BATCH_SLACK-pendinglength);
+	if(pendinglength+length>=batchsize+BATCH_SLACK-1){
+		// doesn't fit, it goes in the next batch
+		flushPending();
+		pendingsince=now();
+		length=flexFormatItem(item,pending,batchsize+BATCH_SLACK);
+	}
+	pendinglength+=length;
+	if((item->type==ITEM_END)&&((pendinglength>=batchsize)||(now()-pendingsince>=batchtime))){
+		flushPending();
+	}
+}
+
+// puts the batches in flight back in the queue, and the queue in the spool (if there is one)
+static void closeLink(int failed){
+	struct batch* b;
+	struct batch* back = NULL;
+	if(sock>=0)close(sock);
+	sock=-1;
+	// in flight, the batches from memory come before the ones from the spool, which are still in the spool
+	while((b=pop(&inflight))){
+		if(b->sequence){
+			free(b);
+		} else {
+			b->next=back;
+			back=b;
+		}
+	}
+	while(back){
+		b=back;
+		back=back->next;
+		pushFront(&queue,b);
+	}
+	spoolread=spoolfirst;
+	sending=NULL;
+	if(spooldir){
+		// in front of the spool, last one first
+		while(queue.last){
+			b=queue.first;
+			if(b==queue.last){
+				b=pop(&queue);
+			} else {
+				while(b->next!=queue.last)b=b->next;
+				queue.last=b;
+				b=b->next;
+				queue.last->next=NULL;
+				queue.bytes-=b->length;
+				queue.count--;
+			}
+			if(!spoolBatch(b,1)){
+				push(&queue,b);
+				break;
+			}
+		}
+	}
+	linkstate=LINK_DOWN;
+	if(failed){
+		failing=1;
+		retryat=now()+backoff;
+		fprintf(stderr,"flexbridge: %s:%s unavailable, retrying in %ld ms\n",host,port,backoff);
+		backoff=(backoff*2<BACKOFF_MAX)?backoff*2:BACKOFF_MAX;
+	} else {
+		retryat=now();
+	}
+}
+
+static int startLink(int epoll){
+	struct addrinfo hints;
+	struct addrinfo* result;
+	struct epoll_event event;
+	int error;
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_socktype=SOCK_STREAM;
+	error=getaddrinfo(host,port,&hints,&result);
+	if(error){
+		fprintf(stderr,"flexbridge: %s: %s\n",host,gai_strerror(error));
+		return 0;
+	}
+	sock=socket(result->ai_family,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+	if(sock<0){
+		freeaddrinfo(result);
+		return 0;
+	}
+	if(connect(sock,result->ai_addr,result->ai_addrlen)&&(errno!=EINPROGRESS)){
+		freeaddrinfo(result);
+		return 0;
+	}
+	freeaddrinfo(result);
+	linkstate=LINK_CONNECTING;
+	responselength=0;
+	responsestate=RESPONSE_HEAD;
+	event.events=EPOLLOUT|EPOLLIN;
+	event.data.fd=sock;
+	epoll_ctl(epoll,EPOLL_CTL_ADD,sock,&event);
+	return 1;
+}
+
+// moves batches into flight, memory first (older, or priority), then the spool
+static void fillPipeline(void){
+	struct batch* b;
+	while(inflight.count<depth){
+		b=pop(&queue);
+		if(!b&&spooldir)b=spoolLoad();
+		if(!b)return;
+		push(&inflight,b);
+		if(!sending){
+			sending=b;
+			sendoffset=0;
+		}
+	}
+}
+
+// writes as much of the requests in flight as the socket takes. Returns 0 on an error
+static int writeRequests(void){
+	char header[1400];
+	int headerlength;
+	struct iovec iov[2];
+	int count;
+	ssize_t length;
+	while(sending){
+		headerlength=snprintf(header,sizeof(header),"POST %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: flexbridge\r\n"
+				"Content-Type: text/plain\r\nContent-Length: %zu\r\n\r\n",path,host,sending->length);
+		if(sendoffset<(size_t)headerlength){
+			iov[0].iov_base=header+sendoffset;
+			iov[0].iov_len=headerlength-sendoffset;
+			iov[1].iov_base=sending->body;
+			iov[1].iov_len=sending->length;
+			count=2;
+		} else {
+			iov[0].iov_base=sending->body+(sendoffset-headerlength);
+			iov[0].iov_len=sending->length-(sendoffset-headerlength);
+			count=1;
+		}
+		length=writev(sock,iov,count);
+		if(length<0)return (errno==EAGAIN)||(errno==EINTR);
+		sendoffset+=length;
+		if(sendoffset==(size_t)headerlength+sending->length){
+			sending=sending->next;
+			sendoffset=0;
+		}
+	}
+	return 1;
+}
+
+// a complete response, for the oldest batch in flight. Returns 0 if the link has to be closed
+static int responseDone(void){
+	struct batch* b;
+	if((responsestatus>=100)&&(responsestatus<200))return 1;
+	b=pop(&inflight);
+	if(!b)return -1;
+	if(sending==b){
+		// answered before it was completely sent
+		sending=b->next;
+		sendoffset=0;
+	}
+	if((responsestatus>=200)&&(responsestatus<300)){
+		sent++;
+		backoff=BACKOFF_MIN;
+		failing=0;
+	} else if((responsestatus>=400)&&(responsestatus<500)&&(responsestatus!=408)&&(responsestatus!=429)){
+		fprintf(stderr,"flexbridge: batch of %zu bytes refused with status %d, dropped\n",b->length,responsestatus);
+		dropped++;
+	} else {
+		fprintf(stderr,"flexbridge: status %d, retrying\n",responsestatus);
+		pushFront(&inflight,b);
+		if(!sending){
+			sending=b;
+			sendoffset=0;
+		}
+		return -1;
+	}
+	batchDone(b);
+	return !responseclose;
+}
+
+static void consume(size_t length){
+	memmove(response,response+length,responselength-length);
+	responselength-=length;
+}
+
+// 1 if the header line at line (up to end) is name with value
+static int headerIs(const char* line, const char* end, const char* name, const char* value){
+	size_t length = strlen(name);
+	if(((size_t)(end-line)<length)||strncasecmp(line,name,length))return 0;
+	line+=length;
+	while((line<end)&&(*line==' '))line++;
+	return ((size_t)(end-line)>=strlen(value))&&!strncasecmp(line,value,strlen(value));
+}
+
+// parses the responses that came in. Returns 1 to keep the link, 0 to close it, -1 if it failed
+static int parseResponses(void){
+	char* end;
+	char* line;
+	char* next;
+	size_t length;
+	int chunked;
+	int result;
+	while(1){
+		switch(responsestate){
+			case RESPONSE_HEAD:
+				end=memmem(response,responselength,"\r\n\r\n",4);
+				if(!end)return responselength<sizeof(response)?1:-1;
+				if(sscanf(response,"HTTP/1.%*d %d",&responsestatus)!=1)return -1;
+				responseremaining=0;
+				responseclose=0;
+				chunked=0;
+				for(line=memchr(response,'\n',end-response)+1;line<end;line=next){
+					next=memchr(line,'\n',end+2-line)+1;
+					if(headerIs(line,next,"content-length:","")){
+						responseremaining=strtoul(line+15,NULL,10);
+					} else if(headerIs(line,next,"transfer-encoding:","chunked")){
+						chunked=1;
+					} else if(headerIs(line,next,"connection:","close")){
+						responseclose=1;
+					}
+				}
+				consume(end+4-response);
+				if((responsestatus==204)||(responsestatus==304)||((responsestatus>=100)&&(responsestatus<200))){
+					responseremaining=0;
+					chunked=0;
+				}
+				responsestate=chunked?RESPONSE_CHUNKSIZE:RESPONSE_BODY;
+				break;
+			case RESPONSE_BODY:
+			case RESPONSE_CHUNK:
+				length=(responseremaining<responselength)?responseremaining:responselength;
+				consume(length);
+				responseremaining-=length;
+				if(responseremaining)return 1;
+				if(responsestate==RESPONSE_CHUNK){
+					responsestate=RESPONSE_CHUNKSIZE;
+					break;
+				}
+				responsestate=RESPONSE_HEAD;
+				result=responseDone();
+				if(result<1)return result;
+				break;
+			case RESPONSE_CHUNKSIZE:
+				end=memmem(response,responselength,"\r\n",2);
+				if(!end)return responselength<sizeof(response)?1:-1;
+				responseremaining=strtoul(response,NULL,16);
+				consume(end+2-response);
+				if(responseremaining){
+					// chunk data and the line end after it
+					responseremaining+=2;
+					responsestate=RESPONSE_CHUNK;
+				} else {
+					responsestate=RESPONSE_TRAILER;
+				}
+				break;
+			default:
+				end=memmem(response,responselength,"\r\n",2);
+				if(!end)return responselength<sizeof(response)?1:-1;
+				length=end-response;
+				consume(length+2);
+				if(!length){
+					responsestate=RESPONSE_HEAD;
+					result=responseDone();
+					if(result<1)return result;
+				}
+				break;
+		}
+	}
+}
+
+// reads what the server sent. Returns 1 to keep the link, 0 to close it, -1 if it failed
+static int readResponses(void){
+	ssize_t length;
+	while(1){
+		length=read(sock,response+responselength,sizeof(response)-responselength);
+		if(length<0)return (errno==EAGAIN)||(errno==EINTR);
+		// the server closing an idle link is fine, with requests in flight it isn't
+		if(length==0)return inflight.count?-1:0;
+		responselength+=length;
+		length=parseResponses();
+		if(length<1)return length;
+	}
+}
+
+static void usage(void){
+	fprintf(stderr,"usage: flexbridge [http://host[:port]/path] [-b bytes] [-t ms] [-p depth] [-s spooldir] [-m spoolbytes]\n");
+	fprintf(stderr,"                  [-l port] [-P drop|disconnect] [-r /flexring] [/dev/ttyUSB0|capture-file]\n");
+}
+
+int main(int argc, char** argv){
+	int fd = 0;
+	int arg;
+	int index;
+	int epoll;
+	int pollable = 1;
+	int done = 0;
+	int count;
+	int result;
+	long timeout;
+	long time;
+	ssize_t length;
+	socklen_t size = sizeof(result);
+	struct flexinput input;
+	struct epoll_event event;
+	struct epoll_event events[64];
+	const char* listenport = NULL;
+	const char* ringname = NULL;
+	int policy = POLICY_DROP;
+
+	for(arg=1;arg<argc;arg++){
+		if(!strncmp(argv[arg],"http://",7)){
+			if(!parseUrl(argv[arg])){
+				usage();
+				return 1;
+			}
+			uplink=1;
+			continue;
+		}
+		if((argv[arg][0]=='-')&&argv[arg][1]&&(arg+1<argc)){
+			switch(argv[arg][1]){
+				case 'l':
+					listenport=argv[++arg];
+					continue;
+				case 'r':
+					ringname=argv[++arg];
+					continue;
+				case 'P':
+					policy=strcmp(argv[++arg],"disconnect")?POLICY_DROP:POLICY_DISCONNECT;
+					continue;
+				case 'b':
+					batchsize=strtoul(argv[++arg],NULL,10);
+					continue;
+				case 't':
+					batchtime=strtol(argv[++arg],NULL,10);
+					continue;
+				case 'p':
+					depth=strtoul(argv[++arg],NULL,10);
+					if(!depth)depth=1;
+					continue;
+				case 's':
+					spooldir=argv[++arg];
+					continue;
+				case 'm':
+					spoolmax=strtoull(argv[++arg],NULL,10);
+					continue;
+			}
+			usage();
+			return 1;
+		}
+		fd=open(argv[arg],O_RDONLY|O_NOCTTY|O_NONBLOCK);
+		if(fd<0){
+			perror(argv[arg]);
+			return 1;
+		}
+		setupPort(fd);
+	}
+	if(!uplink&&!listenport&&!ringname){
+		usage();
+		return 1;
+	}
+	if(fd==0)fcntl(0,F_SETFL,fcntl(0,F_GETFL)|O_NONBLOCK);
+
+	pending=malloc(batchsize+BATCH_SLACK);
+	urgent=malloc(batchsize+BATCH_SLACK);
+	if(!pending||!urgent||!flexInputInit(&input,INPUT_RING)){
+		fprintf(stderr,"flexbridge: out of memory\n");
+		return 1;
+	}
+	if(spooldir)spoolOpen();
+	signal(SIGPIPE,SIG_IGN);
+	signal(SIGINT,onSignal);
+	signal(SIGTERM,onSignal);
+
+	epoll=epoll_create1(EPOLL_CLOEXEC);
+	event.events=EPOLLIN;
+	event.data.fd=fd;
+	if(epoll_ctl(epoll,EPOLL_CTL_ADD,fd,&event)){
+		// regular files can't be polled, they're read whenever there's nothing else to do
+		if(errno!=EPERM){
+			perror("epoll");
+			return 1;
+		}
+		pollable=0;
+	}
+	if(listenport){
+		if(!pubsubListen(epoll,listenport,policy))return 1;
+		pubsub=1;
+	}
+	if(ringname){
+		if(!flexShmCreate(&shm,ringname,FLEXSHM_SIZE)){
+			perror(ringname);
+			return 1;
+		}
+		ring=1;
+	}
+
+	while(!stop){
+		time=now();
+		if(pendinglength&&(time-pendingsince>=2*batchtime+2000)){
+			// no frame end came, the end was lost
+			flushPending();
+		}
+		if((linkstate==LINK_DOWN)&&(time>=retryat)&&(queue.count||!spoolEmpty())){
+			if(!startLink(epoll))closeLink(1);
+		}
+		if(linkstate==LINK_UP){
+			fillPipeline();
+			if(!writeRequests())closeLink(1);
+		}
+		if(done&&!pendinglength&&!queue.count&&!inflight.count&&(spoolEmpty()||failing)){
+			break;
+		}
+		if(sock>=0){
+			event.events=EPOLLIN|(((linkstate==LINK_CONNECTING)||sending)?EPOLLOUT:0);
+			event.data.fd=sock;
+			epoll_ctl(epoll,EPOLL_CTL_MOD,sock,&event);
+		}
+
+		// wait for the input, the socket, or the first deadline
+		timeout=-1;
+		if(pendinglength)timeout=pendingsince+2*batchtime+2000;
+		if((linkstate==LINK_DOWN)&&(queue.count||!spoolEmpty())&&((timeout<0)||(retryat<timeout))){
+			timeout=retryat;
+		}
+		if(timeout>=0)timeout=(timeout>time)?timeout-time:0;
+		if(!pollable&&!done)timeout=0;
+		// a regular file isn't in the epoll set, one slot is kept free to add it
+		count=epoll_wait(epoll,events,pollable?64:63,timeout);
+		if(count<0){
+			if(errno==EINTR)continue;
+			perror("epoll");
+			break;
+		}
+
+		if(!pollable&&!done){
+			events[count].events=EPOLLIN;
+			events[count].data.fd=fd;
+			count++;
+		}
+		for(index=0;index<count;index++){
+			if(events[index].data.fd==fd){
+				length=flexInputRead(&input,fd);
+				if(length>0){
+					flexInputParse(&input,0,onItem,NULL);
+				} else if((length==0)||((errno!=EAGAIN)&&(errno!=EINTR))){
+					flexInputParse(&input,1,onItem,NULL);
+					flushPending();
+					epoll_ctl(epoll,EPOLL_CTL_DEL,fd,NULL);
+					done=1;
+				}
+				continue;
+			}
+			if(events[index].data.fd!=sock){
+				pubsubEvent(events[index].data.fd,events[index].events);
+				continue;
+			}
+			if(linkstate==LINK_CONNECTING){
+				result=0;
+				getsockopt(sock,SOL_SOCKET,SO_ERROR,&result,&size);
+				if(result){
+					closeLink(1);
+					continue;
+				}
+				linkstate=LINK_UP;
+				continue;
+			}
+			if(events[index].events&(EPOLLIN|EPOLLHUP|EPOLLERR)){
+				result=readResponses();
+				if(result<1){
+					closeLink(result<0);
+					continue;
+				}
+			}
+			if(events[index].events&EPOLLOUT){
+				if(!writeRequests())closeLink(1);
+			}
+		}
+	}
+
+	// whatever wasn't answered goes to the spool
+	flushPending();
+	closeLink(0);
+	if(uplink)fprintf(stderr,"flexbridge: %lu batches sent, %lu dropped, %u in memory, %llu in the spool\n",sent,dropped,
+			queue.count,(unsigned long long)(spooldir?spoolnext-spoolfirst:0));
+	return 0;
+}
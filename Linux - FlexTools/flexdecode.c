@@ -0,0 +1,541 @@
+/*
+ * flexdecode.c
+ *
+ * Host-side FLEX frame decoder, see flexdecode.h. Words are kept the way the decoder receives them (first received bit
+ * in bit 31), the field decoding follows flexprocess.c.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "flexdecode.h"
+
+// rawframe.h declares the output function for the firmware's own frame struct
+struct frame;
+#include "rawframe.h"
+
+#define BINLOG_SYNC 0x10
+
+// sizes of the trace record arguments, generated from the same list the firmware uses
+#define BINLOG_ID(name, size1, size2, size3, text) { size1, size2, size3 },
+static const uint8_t logsizes[][3] = {
+#include "binlogids.h"
+};
+#undef BINLOG_ID
+
+#define LOG_COUNT (sizeof(logsizes)/sizeof(logsizes[0]))
+
+// scanner states
+#define SCAN_TEXT 0
+#define SCAN_TYPE 1
+#define SCAN_FRAME 2
+#define SCAN_LOGID 3
+#define SCAN_LOGARGS 4
+
+// vector type of a pair that didn't decode, and address types (as in flexprocess.h)
+#define VECT_NULL 0xFF
+#define ADDR_LONG1 1
+
+// an address/vector pair, and the vectors that point to the same message
+struct hostvector {
+	uint8_t type;
+	uint8_t start;
+	uint8_t length;
+	uint8_t longaddress;
+	uint8_t leader;				// index of the first vector to the same message
+	uint64_t capcode;
+};
+
+// a frame that is being decoded
+struct hostframe {
+	uint32_t word[FLEX_WORDS];
+	uint8_t valid[FLEX_WORDS];
+	uint8_t received[FLEX_BLOCKS];
+	uint8_t priority;
+	uint8_t vectorstart;
+	uint8_t addressstart;
+	uint8_t avcount;
+	struct hostvector vect[FLEX_WORDS];
+};
+
+// alpha characters by their 7 bits as received (lsb first), control characters have bit 7 set
+static const uint8_t alphatable[128] = {
+	0x80,0x40,0x20,0x60,0x90,0x50,0x30,0x70,0x88,0x48,0x28,0x68,0x98,0x58,0x38,0x78,
+	0x84,0x44,0x24,0x64,0x94,0x54,0x34,0x74,0x8C,0x4C,0x2C,0x6C,0x9C,0x5C,0x3C,0x7C,
+	0x82,0x42,0x22,0x62,0x92,0x52,0x32,0x72,0x8A,0x4A,0x2A,0x6A,0x9A,0x5A,0x3A,0x7A,
+	0x86,0x46,0x26,0x66,0x96,0x56,0x36,0x76,0x8E,0x4E,0x2E,0x6E,0x9E,0x5E,0x3E,0x7E,
+	0x81,0x41,0x21,0x61,0x91,0x51,0x31,0x71,0x89,0x49,0x29,0x69,0x99,0x59,0x39,0x79,
+	0x85,0x45,0x25,0x65,0x95,0x55,0x35,0x75,0x8D,0x4D,0x2D,0x6D,0x9D,0x5D,0x3D,0x7D,
+	0x83,0x43,0x23,0x63,0x93,0x53,0x33,0x73,0x8B,0x4B,0x2B,0x6B,0x9B,0x5B,0x3B,0x7B,
+	0x87,0x47,0x27,0x67,0x97,0x57,0x37,0x77,0x8F,0x4F,0x2F,0x6F,0x9F,0x5F,0x3F,0x7F,
+};
+
+// numeric characters by their 4 bits as received (lsb first), the fill character is 0
+static const char numerictable[16] = {
+	'0','8','4',0,'2',' ','6',']','1','9','5','-','3','U','7','[',
+};
+
+// first address word of every address type range, and the type of each range
+#define ADDRESS_RANGES 11
+static const uint32_t addressranges[ADDRESS_RANGES-1] = {
+	0x000001,0x008001,0x1E0001,0x1F0001,0x1F2800,0x1F6800,0x1F7800,0x1F7810,0x1F7FFF,0x1FFFFF,
+};
+static const uint8_t addresstypes[ADDRESS_RANGES] = {
+	0,ADDR_LONG1,2,ADDR_LONG1,6,3,4,5,6,7,8,
+};
+
+// escape sequences around the characters of an invalid word
+static const char inverted[] = "\x1B[7m";
+static const char normal[] = "\x1B[0m";
+
+static uint8_t bitswitch(uint8_t b){
+	b=(b&0xF0)>>4|(b&0x0F)<<4;
+	b=(b&0xCC)>>2|(b&0x33)<<2;
+	return (b&0xAA)>>1|(b&0x55)<<1;
+}
+
+// calculates the BCH code and parity for the 21 info bits of a word, as createCRC() in flex.c
+static uint32_t createCRC(uint32_t in){
+	uint32_t cw = in;
+	uint32_t parity;
+	int bit;
+	for(bit=1;bit<=21;bit++,cw<<=1){
+		if(cw&0x80000000)cw^=0xED200000;
+	}
+	in|=cw>>21;
+	parity=in;
+	parity^=parity>>16;
+	parity^=parity>>8;
+	parity^=parity>>4;
+	parity^=parity>>2;
+	parity^=parity>>1;
+	return in+(parity&1);
+}
+
+static int validateBCH(uint32_t word){
+	return createCRC(word&0xFFFFF800)==word;
+}
+
+// validates the 4 bit checksum of the BIW and vector words, as validateChecksum() in flex.c
+static int validateChecksum(uint32_t word){
+	uint8_t checksum = (word>>28)&0x0F;
+	uint8_t totalizer;
+	word>>=4;
+	totalizer=bitswitch((uint8_t)word)&0x01;
+	word>>=4;
+	totalizer+=bitswitch((uint8_t)word)&0x0F;
+	word>>=4;
+	totalizer+=bitswitch((uint8_t)word)&0x0F;
+	word>>=4;
+	totalizer+=bitswitch((uint8_t)word)&0x0F;
+	word>>=4;
+	totalizer+=bitswitch((uint8_t)word)&0x0F;
+	totalizer=(bitswitch(totalizer&0x0F)^0xFF)>>4;
+	return totalizer==checksum;
+}
+
+// flips the 21 info bits, the first received bit becomes the lsb
+static uint32_t decodeAddress(uint32_t word){
+	uint32_t address = 0;
+	uint8_t bit;
+	for(bit=0;bit<21;bit++){
+		if(word&(0x80000000UL>>bit))address|=1UL<<bit;
+	}
+	return address;
+}
+
+static uint8_t getAddressType(uint32_t address){
+	uint8_t range = 0;
+	uint8_t count;
+	for(count=0;count<ADDRESS_RANGES-1;count++){
+		range+=(address>=addressranges[count]);
+	}
+	return addresstypes[range];
+}
+
+static uint64_t getCapcode(uint32_t first, uint32_t second, int longaddress){
+	if(longaddress){
+		return ((uint64_t)(second^0x1FFFFF)<<15)+2068480UL+first;
+	}
+	return (uint64_t)first-32768;
+}
+
+// adds up the info bits in groups of 8, 8 and 5 bits, each group with the first received bit as lsb
+static uint16_t wordSum(uint32_t word){
+	return bitswitch((uint8_t)(word>>24))+bitswitch((uint8_t)(word>>16))+(bitswitch((uint8_t)(word>>8))&0x1F);
+}
+
+int flexRepairWord(uint32_t* word){
+	uint8_t bit;
+	uint8_t bit2;
+	if(validateBCH(*word))return 1;
+	for(bit=0;bit<32;bit++){
+		if(validateBCH(*word^(1UL<<bit))){
+			*word^=1UL<<bit;
+			return 1;
+		}
+	}
+	for(bit=0;bit<32;bit++){
+		for(bit2=bit+1;bit2<32;bit2++){
+			if(validateBCH(*word^(1UL<<bit)^(1UL<<bit2))){
+				*word^=(1UL<<bit)^(1UL<<bit2);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// CRC-CCITT as _crc_ccitt_update() in avr-libc
+static uint16_t crcUpdate(uint16_t crc, uint8_t byte){
+	uint8_t bit;
+	crc^=byte;
+	for(bit=0;bit<8;bit++){
+		crc=(crc&1)?(crc>>1)^0x8408:crc>>1;
+	}
+	return crc;
+}
+
+int flexParseRecord(const uint8_t* record, struct flexframe* frame){
+	uint16_t crc = 0xFFFF;
+	size_t count;
+	uint8_t byte;
+	const uint8_t* pos = record;
+	for(count=0;count<RAWFRAME_LENGTH-2;count++){
+		crc=crcUpdate(crc,record[count]);
+	}
+	if(crc!=(record[RAWFRAME_LENGTH-2]|(record[RAWFRAME_LENGTH-1]<<8)))return 0;
+	frame->cycle=*pos++;
+	frame->frame=*pos++;
+	frame->flags=*pos++;
+	frame->blocks=*pos++;
+	memcpy(frame->valid,pos,FLEX_BLOCKS);
+	pos+=FLEX_BLOCKS;
+	for(count=0;count<FLEX_WORDS;count++){
+		frame->word[count]=0;
+		for(byte=0;byte<4;byte++){
+			frame->word[count]|=(uint32_t)*pos++<<(8*byte);
+		}
+	}
+	return 1;
+}
+
+int flexScan(struct flexscanner* scanner, uint8_t byte, struct flexframe* frame){
+	switch(scanner->state){
+		case SCAN_TEXT:
+			if(byte==RAWFRAME_SYNC)scanner->state=SCAN_TYPE;
+			if(byte==BINLOG_SYNC)scanner->state=SCAN_LOGID;
+			return 0;
+		case SCAN_TYPE:
+			scanner->length=0;
+			scanner->state=(byte==RAWFRAME_TYPE)?SCAN_FRAME:SCAN_TEXT;
+			return 0;
+		case SCAN_FRAME:
+			scanner->record[scanner->length++]=byte;
+			if(scanner->length<RAWFRAME_LENGTH)return 0;
+			scanner->state=SCAN_TEXT;
+			return flexParseRecord(scanner->record,frame);
+		case SCAN_LOGID:
+			// the arguments of a trace record can hold any byte, they're skipped by their size
+			if(byte>=LOG_COUNT){
+				scanner->state=SCAN_TEXT;
+				return 0;
+			}
+			scanner->length=logsizes[byte][0]+logsizes[byte][1]+logsizes[byte][2];
+			scanner->state=scanner->length?SCAN_LOGARGS:SCAN_TEXT;
+			return 0;
+		case SCAN_LOGARGS:
+			if(--scanner->length==0)scanner->state=SCAN_TEXT;
+			return 0;
+	}
+	scanner->state=SCAN_TEXT;
+	return 0;
+}
+
+// copies a frame, and repairs the words that failed the BCH check on the decoder
+static void loadFrame(struct hostframe* host, const struct flexframe* frame){
+	uint8_t block;
+	uint8_t word;
+	for(block=0;block<FLEX_BLOCKS;block++){
+		// blocks that weren't stored are sent as 0 words that didn't pass, a received 0 word passes
+		host->received[block]=frame->valid[block]!=0;
+		for(word=block*8;word<block*8+8;word++){
+			host->word[word]=frame->word[word];
+			host->valid[word]=(frame->valid[block]>>(word%8))&1;
+			if(frame->word[word])host->received[block]=1;
+		}
+		if(block>=frame->blocks)host->received[block]=0;
+	}
+	for(word=0;word<FLEX_WORDS;word++){
+		if(host->received[word/8]&&!host->valid[word]){
+			host->valid[word]=flexRepairWord(&host->word[word]);
+		}
+	}
+}
+
+static int wordsReceived(struct hostframe* host, uint8_t start, uint8_t length){
+	uint8_t block;
+	if((length==0)||((uint16_t)start+length>FLEX_WORDS))return 0;
+	for(block=start/8;block<=(start+length-1)/8;block++){
+		if(!host->received[block])return 0;
+	}
+	return 1;
+}
+
+// decodes the BIW and the address and vector field, and links the vectors that point to the same message
+static int indexFrame(struct hostframe* host){
+	uint32_t biw = host->word[0];
+	uint32_t vword;
+	uint32_t first;
+	uint32_t second = 0;
+	uint8_t endofblockinfo;
+	uint8_t counter;
+	uint8_t other;
+	struct hostvector* vect;
+
+	if(!host->received[0]||!host->valid[0]||!validateChecksum(biw))return -1;
+	host->vectorstart=bitswitch((uint8_t)(biw>>14))&0x3F;
+	endofblockinfo=bitswitch((uint8_t)(biw>>16))&0x03;
+	host->priority=bitswitch((uint8_t)(biw>>20))&0x0F;
+	host->addressstart=endofblockinfo+1;
+	host->avcount=(host->vectorstart>endofblockinfo)?host->vectorstart-endofblockinfo-1:0;
+	if(host->avcount&&!wordsReceived(host,host->addressstart,host->avcount*2))host->avcount=0;
+
+	for(counter=0;counter<host->avcount;counter++){
+		vect=&host->vect[counter];
+		vect->type=VECT_NULL;
+		vect->leader=counter;
+		first=decodeAddress(host->word[counter+host->addressstart]);
+		vect->longaddress=(getAddressType(first)==ADDR_LONG1)&&(counter+1<host->avcount);
+		if(vect->longaddress)second=decodeAddress(host->word[counter+1+host->addressstart]);
+		vect->capcode=getCapcode(first,second,vect->longaddress);
+
+		vword=host->word[counter+host->vectorstart];
+		if(host->valid[counter+host->vectorstart]&&validateChecksum(vword)&&vword){
+			vect->type=bitswitch((uint8_t)(vword>>20))&0x07;
+			switch(vect->type){
+				case FLEX_NUMERIC:
+				case FLEX_NUMERIC_FORMAT:
+				case FLEX_NUMERIC_NO:
+					vect->length=(bitswitch((uint8_t)(vword>>10))&0x07)+1;
+					vect->start=bitswitch((uint8_t)(vword>>17))&0x7F;
+					break;
+				default:
+					vect->length=bitswitch((uint8_t)(vword>>10))&0x7F;
+					vect->start=bitswitch((uint8_t)(vword>>17))&0x7F;
+					break;
+			}
+			// the first vector with the same start and type gets the message
+			if((vect->type!=FLEX_SHORT)&&(vect->type!=FLEX_INSTRUCTION)){
+				for(other=0;other<counter;other++){
+					if((host->vect[other].leader==other)&&(host->vect[other].type==vect->type)&&
+						(host->vect[other].start==vect->start)){
+						vect->leader=other;
+						break;
+					}
+				}
+			}
+		}
+
+		// the second word of a long address doesn't get a vector of its own
+		if(vect->longaddress){
+			counter++;
+			host->vect[counter].type=VECT_NULL;
+			host->vect[counter].leader=counter;
+		}
+	}
+	return host->avcount;
+}
+
+int flexFrameAddresses(const struct flexframe* frame, uint64_t* capcodes, int max){
+	struct hostframe host;
+	uint8_t counter;
+	int count = 0;
+	loadFrame(&host,frame);
+	if(indexFrame(&host)<0)return -1;
+	for(counter=0;counter<host.avcount;counter++){
+		if((host.vect[counter].type!=VECT_NULL)&&(count<max))capcodes[count++]=host.vect[counter].capcode;
+	}
+	return count;
+}
+
+static void addText(struct flexmessage* msg, const char* text, uint16_t length){
+	if(msg->length+length>FLEX_MAX_TEXT)length=FLEX_MAX_TEXT-msg->length;
+	memcpy(msg->text+msg->length,text,length);
+	msg->length+=length;
+	msg->text[msg->length]=0;
+}
+
+// decodes the alpha characters of a fragment, as unpackAlpha() in flexprocess.c
+static void unpackAlpha(struct hostframe* host, uint8_t start, uint8_t end, uint8_t firstbyte, struct flexmessage* msg){
+	uint8_t word;
+	uint8_t count;
+	uint8_t chars[3];
+	char c;
+	for(word=start;word<end;word++){
+		chars[0]=alphatable[host->word[word]>>25];
+		chars[1]=alphatable[(host->word[word]>>18)&0x7F];
+		chars[2]=alphatable[(host->word[word]>>11)&0x7F];
+		if(!host->valid[word]){
+			msg->errors++;
+			addText(msg,inverted,4);
+		}
+		for(count=firstbyte;count<3;count++){
+			msg->sigsum+=chars[count]&0x7F;
+			if(host->valid[word]&&(chars[count]&0x80))continue;
+			c=(chars[count]&0x80)?(char)0xDB:(char)chars[count];
+			addText(msg,&c,1);
+		}
+		if(!host->valid[word])addText(msg,normal,4);
+		firstbyte=0;
+	}
+}
+
+// decodes the digits of a numeric message, as unpackNumeric() in flexprocess.c
+static void unpackNumeric(struct hostframe* host, uint8_t firstword, uint8_t start, uint8_t end, uint8_t skip, struct flexmessage* msg){
+	uint8_t word;
+	uint8_t bits;
+	uint8_t carried = 0;
+	uint32_t stream;
+	uint32_t carry = 0;
+	char digit;
+	for(word=firstword;;word=start++){
+		stream=(host->word[word]&0xFFFFF800)<<skip;
+		bits=21-skip;
+		skip=0;
+		stream=(stream>>carried)|carry;
+		bits+=carried;
+		if(!host->valid[word]){
+			msg->errors++;
+			addText(msg,inverted,4);
+		}
+		for(;bits>=4;bits-=4){
+			digit=numerictable[stream>>28];
+			stream<<=4;
+			if(!host->valid[word]&&!digit)digit=(char)0xDB;
+			if(digit)addText(msg,&digit,1);
+		}
+		if(!host->valid[word])addText(msg,normal,4);
+		carry=stream;
+		carried=bits;
+		if(start>=end)break;
+	}
+}
+
+// appends the info bits of a word to the payload, lsb first
+static void unpackBits(struct hostframe* host, uint8_t word, uint8_t skip, struct flexmessage* msg){
+	uint8_t bit;
+	if(!host->valid[word])msg->errors++;
+	for(bit=skip;bit<21;bit++){
+		if(msg->bits>=FLEX_MAX_DATA*8)return;
+		if(!(msg->bits%8))msg->data[msg->bits/8]=0;
+		if(host->word[word]&(0x80000000UL>>bit))msg->data[msg->bits/8]|=1<<(msg->bits%8);
+		msg->bits++;
+	}
+}
+
+// decodes the header of an alpha, hex or secure message, and checks the fragment. Returns 0 if the check doesn't match
+static int fragmentHeader(struct hostframe* host, struct hostvector* vect, struct flexmessage* msg){
+	uint32_t header = host->word[vect->start];
+	uint16_t sum = wordSum(header&0x003FFFFF);
+	uint16_t check;
+	uint8_t word;
+	for(word=vect->start+1;word<vect->start+vect->length;word++){
+		sum+=wordSum(host->word[word]);
+	}
+	check=bitswitch((uint8_t)(header>>24))|((uint16_t)(bitswitch((uint8_t)(header>>16))&0x03)<<8);
+	msg->messageno=bitswitch((uint8_t)(header>>11))&0x3F;
+	msg->fragment=bitswitch((uint8_t)(header>>13))&0x03;
+	msg->continued=bitswitch((uint8_t)(header>>14))&0x01;
+	if((msg->fragment==3)&&(vect->length>1)){
+		msg->signature=bitswitch((uint8_t)(host->word[vect->start+1]>>24))&0x7F;
+	}
+	return ((~sum)&0x3FF)==check;
+}
+
+int flexDecodeFrame(const struct flexframe* frame, flexcallback callback, void* context){
+	struct hostframe host;
+	struct flexmessage msg;
+	struct hostvector* vect;
+	uint32_t vword;
+	uint8_t counter;
+	uint8_t member;
+	uint8_t word;
+	uint8_t count;
+	uint8_t firstword;
+	uint8_t start;
+	uint8_t end;
+	char digit;
+	int messages = 0;
+
+	loadFrame(&host,frame);
+	if(indexFrame(&host)<0)return -1;
+
+	for(counter=0;counter<host.avcount;counter++){
+		vect=&host.vect[counter];
+		if((vect->type==VECT_NULL)||(vect->type==FLEX_INSTRUCTION)||(vect->leader!=counter))continue;
+
+		memset(&msg,0,offsetof(struct flexmessage,capcode));
+		msg.cycle=frame->cycle;
+		msg.frame=frame->frame;
+		msg.type=vect->type;
+		msg.priority=counter<host.priority;
+		msg.fragment=3;
+		msg.signature=FLEX_NO_SIGNATURE;
+		msg.length=0;
+		msg.text[0]=0;
+		msg.bits=0;
+		for(member=counter;member<host.avcount;member++){
+			if((host.vect[member].leader==counter)&&(msg.addresscount<FLEX_MAX_ADDRESSES)){
+				msg.capcode[msg.addresscount++]=host.vect[member].capcode;
+			}
+		}
+
+		switch(vect->type){
+			case FLEX_ALPHA:
+			case FLEX_HEX:
+			case FLEX_SECURE:
+				if(!wordsReceived(&host,vect->start,vect->length))continue;
+				if(!fragmentHeader(&host,vect,&msg))continue;
+				if(vect->type==FLEX_ALPHA){
+					unpackAlpha(&host,vect->start+1,vect->start+vect->length,(msg.fragment==3)?1:0,&msg);
+					if((msg.signature!=FLEX_NO_SIGNATURE)&&!msg.continued&&(((~msg.sigsum)&0x7F)!=msg.signature))continue;
+				} else {
+					for(word=vect->start+1;word<vect->start+vect->length;word++){
+						unpackBits(&host,word,((word==vect->start+1)&&(msg.fragment==3))?7:0,&msg);
+					}
+				}
+				break;
+			case FLEX_NUMERIC:
+			case FLEX_NUMERIC_FORMAT:
+			case FLEX_NUMERIC_NO:
+				// for a long address, the first word of the message is the second vector word
+				if(vect->longaddress){
+					if((vect->length>1)&&!wordsReceived(&host,vect->start,vect->length-1))continue;
+					firstword=counter+1+host.vectorstart;
+					start=vect->start;
+					end=vect->start+vect->length-1;
+				} else {
+					if(!wordsReceived(&host,vect->start,vect->length))continue;
+					firstword=vect->start;
+					start=vect->start+1;
+					end=vect->start+vect->length;
+				}
+				unpackNumeric(&host,firstword,start,end,(vect->type==FLEX_NUMERIC_NO)?10:2,&msg);
+				break;
+			case FLEX_SHORT:
+				// 3 numeric characters, or a tone-only page without text
+				vword=host.word[counter+host.vectorstart];
+				if((vword&0x01800000)==0){
+					for(count=0;count<3;count++){
+						digit=numerictable[(vword>>(19-4*count))&0x0F];
+						if(digit)addText(&msg,&digit,1);
+					}
+				}
+				break;
+		}
+		callback(&msg,context);
+		messages++;
+	}
+	return messages;
+}
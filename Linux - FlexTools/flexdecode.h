@@ -0,0 +1,100 @@
+/*
+ * flexdecode.h
+ *
+ * Host-side FLEX frame decoder, for the raw frame records of a RAWFRAMES build of the AVR decoder (see rawframe.h).
+ * Does the same work as the frame processor on the AVR: BCH repair, BIW, address and vector field, and the alpha,
+ * numeric, short, hex and secure messages. Fragments are returned as they are, joining them is up to the caller, and so is
+ * resolving temporary addresses (group calls are returned with the temporary address as capcode).
+ *
+ * Build along with the tool that uses it: gcc -O2 -Wall -I"../AVR - FlexDecoder" -o tool tool.c flexdecode.c
+ */
+
+#ifndef FLEXDECODE_H_
+#define FLEXDECODE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FLEX_WORDS 88
+#define FLEX_BLOCKS 11
+
+// vector types, as in flexprocess.h
+#define FLEX_SECURE 0
+#define FLEX_INSTRUCTION 1
+#define FLEX_SHORT 2
+#define FLEX_NUMERIC 3
+#define FLEX_NUMERIC_FORMAT 4
+#define FLEX_ALPHA 5
+#define FLEX_HEX 6
+#define FLEX_NUMERIC_NO 7
+
+// most addresses a single message can have, the longest text and the longest payload of a single fragment
+#define FLEX_MAX_ADDRESSES 64
+#define FLEX_MAX_TEXT 1024
+#define FLEX_MAX_DATA 240
+
+// signature of a fragment that isn't the first one
+#define FLEX_NO_SIGNATURE 0xFF
+
+// a raw frame, as sent by the decoder
+struct flexframe {
+	uint8_t cycle;
+	uint8_t frame;
+	uint8_t flags;					// RAWFRAME_REPEAT
+	uint8_t blocks;					// blocks received
+	uint8_t valid[FLEX_BLOCKS];		// words that passed the BCH check, bit (word%8) of byte (word/8)
+	uint32_t word[FLEX_WORDS];		// first received bit in bit 31
+};
+
+// a message (or a fragment of one) decoded from a frame
+struct flexmessage {
+	uint8_t cycle;
+	uint8_t frame;
+	uint8_t type;					// FLEX_ALPHA etc.
+	uint8_t priority;				// sent to one of the priority addresses
+	uint8_t messageno;				// alpha, hex and secure only
+	uint8_t fragment;				// fragment number, 3 for the first fragment
+	uint8_t continued;				// more fragments follow in a later frame
+	uint8_t errors;					// words that couldn't be repaired
+	uint8_t signature;				// alpha only, FLEX_NO_SIGNATURE if this isn't the first fragment
+	uint8_t sigsum;					// sum of the characters for the signature, over this fragment
+	uint16_t addresscount;
+	uint64_t capcode[FLEX_MAX_ADDRESSES];
+	uint16_t length;
+	char text[FLEX_MAX_TEXT+1];		// alpha and numeric text, invalid words are shown inverted as on the decoder
+	uint16_t bits;
+	uint8_t data[FLEX_MAX_DATA];	// hex and secure payload, packed lsb first
+};
+
+// called for every message in a frame
+typedef void (*flexcallback)(const struct flexmessage* msg, void* context);
+
+// scanner state for a stream of records mixed with text and trace records
+struct flexscanner {
+	int state;
+	size_t length;
+	uint8_t record[512];
+};
+
+/** Scans a byte from the decoder output.
+ *  Returns 1 when it completes a raw frame with a valid crc, which is then stored in frame; 0 otherwise */
+int flexScan(struct flexscanner* scanner, uint8_t byte, struct flexframe* frame);
+
+/** Checks the crc of a raw frame record (the RAWFRAME_LENGTH bytes after the type), and unpacks it into frame.
+ *  Returns 1 if the record is valid */
+int flexParseRecord(const uint8_t* record, struct flexframe* frame);
+
+/** Checks a word, and tries to repair up to 2 bit errors. Returns 1 if the word is (now) valid */
+int flexRepairWord(uint32_t* word);
+
+/** Decodes the capcodes in the address field of a frame, without decoding any messages.
+ *  Returns the number of capcodes stored, or -1 if the BIW is invalid */
+int flexFrameAddresses(const struct flexframe* frame, uint64_t* capcodes, int max);
+
+/** Decodes all messages in a frame, and calls the callback for each one.
+ *  Fragments with a fragment check that doesn't match are left out, like the AVR does, and so are messages that fit in
+ *  a single fragment and have a signature that doesn't match. The signature of longer messages is up to the caller.
+ *  Returns the number of messages, or -1 if the BIW is invalid */
+int flexDecodeFrame(const struct flexframe* frame, flexcallback callback, void* context);
+
+#endif /* FLEXDECODE_H_ */
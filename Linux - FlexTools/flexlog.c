@@ -0,0 +1,197 @@
+/*
+ * flexlog.c
+ *
+ * Expands the binary trace records of the AVR decoder (see binlog.h) into readable text. Everything that isn't a trace
+ * record (the regular [[frame]]/[[msg]] output) is passed through unchanged, raw frame records (see rawframe.h) are
+ * shown as a single line, flexarchive decodes those. The binary records of protocol v2 (see binproto.h) are shown in
+ * the [[frame]]/[[msg]] text format.
+ *
+ * Build: gcc -O2 -Wall -I"../AVR - FlexDecoder" -o flexlog flexlog.c flexproto.c
+ * Usage: flexlog [/dev/ttyUSB0|capture-file]   (reads stdin if no argument is given)
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+
+#define BINLOG_SYNC 0x10
+
+struct frame;
+#include "rawframe.h"
+struct message;
+#include "binproto.h"
+#include "flexproto.h"
+
+struct logmessage {
+	const char* name;
+	uint8_t size[3];
+	const char* text;
+};
+
+// the message table, generated from the same list the firmware uses
+#define BINLOG_ID(name, size1, size2, size3, text) { #name, { size1, size2, size3 }, text },
+static const struct logmessage messages[] = {
+#include "binlogids.h"
+};
+#undef BINLOG_ID
+
+#define MESSAGE_COUNT (sizeof(messages)/sizeof(messages[0]))
+
+// puts a serial port in raw 115200 baud mode, does nothing for regular files
+static void setupPort(int fd){
+	struct termios tio;
+	if(!isatty(fd))return;
+	if(tcgetattr(fd,&tio))return;
+	cfmakeraw(&tio);
+	cfsetispeed(&tio,B115200);
+	cfsetospeed(&tio,B115200);
+	tcsetattr(fd,TCSANOW,&tio);
+}
+
+// writes a binary record in the text format of the decoder
+static void printRecord(struct flexrecord* record){
+	const uint8_t* pos = record->addresses;
+	uint64_t capcode;
+	uint16_t count;
+	switch(record->type){
+		case BINPROTO_FRAME:
+			printf("[[frame]]%u|%u\n",record->cycle,record->frame);
+			break;
+		case BINPROTO_END:
+			printf("[[/frame]]\n");
+			break;
+		default:
+			printf("[[msg]]\n");
+			if(record->type==BINPROTO_PRIORITY)printf("[[priority]]\n");
+			for(count=0;count<record->addresscount;count++){
+				pos=flexNextAddress(pos,&capcode);
+				printf("[[addr]]%llu\n",(unsigned long long)capcode);
+			}
+			printf("[[data]]%.*s[[/data]]\n",record->textlength,record->text);
+			if(record->payloadlength){
+				printf("[[bin]]");
+				for(count=0;count<record->payloadlength;count++){
+					printf("%02X",record->payload[count]);
+				}
+				printf("[[/bin]]\n");
+			}
+			if(record->type==BINPROTO_TRUNCATED)printf("[MSG TRUNCATED]\n");
+			printf("[[/msg]]\n");
+			break;
+	}
+	fflush(stdout);
+}
+
+// reads a single byte, returns -1 at the end of the input
+static int readByte(int fd){
+	static uint8_t buffer[4096];
+	static ssize_t length = 0;
+	static ssize_t pos = 0;
+	if(pos==length){
+		length = read(fd,buffer,sizeof(buffer));
+		pos = 0;
+		if(length<=0)return -1;
+	}
+	return buffer[pos++];
+}
+
+int main(int argc, char** argv){
+	int fd = 0;
+	int c;
+	int column = 0;
+	uint8_t count;
+	uint8_t byte;
+	int skip;
+	static uint8_t record[4096];
+	static uint8_t decoded[4096];
+	size_t length;
+	struct flexrecord parsed;
+	unsigned long arg[3];
+
+	if(argc>1){
+		fd = open(argv[1],O_RDONLY|O_NOCTTY);
+		if(fd<0){
+			perror(argv[1]);
+			return 1;
+		}
+		setupPort(fd);
+	}
+
+	while((c=readByte(fd))>=0){
+		if(c==0){
+			// binary record, up to the next 0. If it isn't a valid record, it was text in between two records, and the
+			// 0 after it starts the next record
+			while(1){
+				length = 0;
+				while((c=readByte(fd))>0){
+					if(length<sizeof(record))record[length++]=c;
+				}
+				if(c<0){
+					fwrite(record,1,length,stdout);
+					return 0;
+				}
+				// the record is decoded in place, the copy is kept in case it was text
+				memcpy(decoded,record,length);
+				if(length&&flexRecordParse(decoded,length,&parsed))break;
+				fwrite(record,1,length,stdout);
+			}
+			if(column)putchar('\n');
+			column = 0;
+			printRecord(&parsed);
+			continue;
+		}
+		if(c==RAWFRAME_SYNC){
+			c = readByte(fd);
+			if(c<0)break;
+			if(c!=RAWFRAME_TYPE){
+				putchar(RAWFRAME_SYNC);
+				putchar(c);
+				column+=2;
+				continue;
+			}
+			// raw frame record, only the cycle and frame number are shown
+			for(skip=0;skip<RAWFRAME_LENGTH;skip++){
+				int b = readByte(fd);
+				if(b<0)return 0;
+				if(skip<2)arg[skip]=b;
+			}
+			printf("%s[raw frame %lu|%lu]\n", column?"\n":"", arg[0], arg[1]);
+			column = 0;
+			fflush(stdout);
+			continue;
+		}
+		if(c!=BINLOG_SYNC){
+			// regular output, pass through
+			putchar(c);
+			column = (c=='\n')||(c=='\r') ? 0 : column+1;
+			if(c=='\n')fflush(stdout);
+			continue;
+		}
+
+		// trace record: ID followed by the little endian arguments
+		c = readByte(fd);
+		if(c<0)break;
+		if(c>=(int)MESSAGE_COUNT){
+			printf("%s[unknown trace record %d, firmware and flexlog out of sync?]\n", column?"\n":"", c);
+			column = 0;
+			continue;
+		}
+		for(count=0;count<3;count++){
+			arg[count]=0;
+			for(byte=0;byte<messages[c].size[count];byte++){
+				int b = readByte(fd);
+				if(b<0)return 0;
+				arg[count]|=((unsigned long)b)<<(8*byte);
+			}
+		}
+		if(column)putchar('\n');
+		printf(messages[c].text,arg[0],arg[1],arg[2]);
+		putchar('\n');
+		column = 0;
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * flexproto.c
+ *
+ * Parser for the binary records of the AVR decoder, see flexproto.h
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "flexproto.h"
+
+struct message;
+#include "binproto.h"
+
+// CRC-CCITT as _crc_ccitt_update() in avr-libc
+static uint16_t crcUpdate(uint16_t crc, uint8_t byte){
+	uint8_t bit;
+	crc^=byte;
+	for(bit=0;bit<8;bit++){
+		crc=(crc&1)?(crc>>1)^0x8408:crc>>1;
+	}
+	return crc;
+}
+
+size_t flexCobsDecode(uint8_t* buffer, size_t length){
+	// the output never gets ahead of the input, so the record can be decoded where it is
+	size_t in = 0;
+	size_t out = 0;
+	uint8_t code;
+	uint8_t count;
+	while(in<length){
+		code=buffer[in++];
+		if(code==0)return 0;
+		for(count=1;count<code;count++){
+			if(in>=length)return 0;
+			buffer[out++]=buffer[in++];
+		}
+		// every block but the last and the full ones ends with a 0
+		if((code<0xFF)&&(in<length))buffer[out++]=0;
+	}
+	return out;
+}
+
+// reads a varint, returns NULL if it runs past the end
+static const uint8_t* readVarint(const uint8_t* pos, const uint8_t* end, uint64_t* value){
+	uint8_t shift = 0;
+	*value=0;
+	while(pos<end){
+		*value|=(uint64_t)(*pos&0x7F)<<shift;
+		if(!(*pos++&0x80))return pos;
+		shift+=7;
+		if(shift>63)return NULL;
+	}
+	return NULL;
+}
+
+const uint8_t* flexNextAddress(const uint8_t* pos, uint64_t* capcode){
+	// the address list was checked by flexRecordParse()
+	return readVarint(pos,pos+10,capcode);
+}
+
+int flexRecordParse(uint8_t* buffer, size_t length, struct flexrecord* record){
+	const uint8_t* pos;
+	const uint8_t* end;
+	uint64_t value;
+	uint16_t crc = 0xFFFF;
+	uint16_t count;
+	size_t index;
+
+	length=flexCobsDecode(buffer,length);
+	if(length<3)return 0;
+	for(index=0;index<length-2;index++){
+		crc=crcUpdate(crc,buffer[index]);
+	}
+	if(crc!=(buffer[length-2]|(buffer[length-1]<<8)))return 0;
+
+	pos=buffer+1;
+	end=buffer+length-2;
+	record->type=buffer[0];
+	switch(record->type){
+		case BINPROTO_FRAME:
+		case BINPROTO_END:
+			if(!(pos=readVarint(pos,end,&value)))return 0;
+			record->cycle=(uint8_t)value;
+			if(!(pos=readVarint(pos,end,&value)))return 0;
+			record->frame=(uint8_t)value;
+			return pos==end;
+		case BINPROTO_MESSAGE:
+		case BINPROTO_PRIORITY:
+		case BINPROTO_TRUNCATED:
+			if(!(pos=readVarint(pos,end,&value)))return 0;
+			record->addresscount=(uint16_t)value;
+			record->addresses=pos;
+			for(count=0;count<record->addresscount;count++){
+				if(!(pos=readVarint(pos,end,&value)))return 0;
+			}
+			if(!(pos=readVarint(pos,end,&value))||(value>(uint64_t)(end-pos)))return 0;
+			record->textlength=(uint16_t)value;
+			record->text=(const char*)pos;
+			pos+=value;
+			if(!(pos=readVarint(pos,end,&value))||(value>(uint64_t)(end-pos)))return 0;
+			record->payloadlength=(uint16_t)value;
+			record->payload=pos;
+			return pos+value==end;
+	}
+	return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * flexproto.h
+ *
+ * Parser for the binary records of a BINPROTO build of the AVR decoder (see binproto.h). A record is decoded in the
+ * buffer it was received in, the text and payload of a message are pointers into that buffer.
+ *
+ * Build along with the tool that uses it: gcc -O2 -Wall -I"../AVR - FlexDecoder" -o tool tool.c flexproto.c
+ */
+
+#ifndef FLEXPROTO_H_
+#define FLEXPROTO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// a record, decoded in place
+struct flexrecord {
+	uint8_t type;					// BINPROTO_FRAME etc.
+	uint8_t cycle;					// frame records only
+	uint8_t frame;
+	uint16_t addresscount;			// message records only
+	const uint8_t* addresses;		// varints, see flexNextAddress()
+	uint16_t textlength;
+	const char* text;				// not terminated
+	uint16_t payloadlength;
+	const uint8_t* payload;
+};
+
+/** COBS decodes a record in place (without the 0 bytes around it). Returns the decoded length, or 0 if the encoding is
+ *  invalid */
+size_t flexCobsDecode(uint8_t* buffer, size_t length);
+
+/** Decodes a record in place (the bytes between two 0 bytes), and checks its crc.
+ *  Returns 1 if the record is valid, the buffer can't be parsed again afterwards */
+int flexRecordParse(uint8_t* buffer, size_t length, struct flexrecord* record);
+
+/** Reads a capcode from the address list of a message record, call addresscount times starting at record->addresses.
+ *  Returns the position of the next capcode */
+const uint8_t* flexNextAddress(const uint8_t* pos, uint64_t* capcode);
+
+#endif /* FLEXPROTO_H_ */
@@ -0,0 +1,657 @@
+/*
+ * flexpubsub.c
+ *
+ * Publish/subscribe server, see flexpubsub.h
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <regex.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "flexpubsub.h"
+
+#define PROTOCOL_TCP 0
+#define PROTOCOL_HANDSHAKE 1
+#define PROTOCOL_WEBSOCKET 2
+
+#define INPUT_BUFFER 4096
+#define QUEUE_ENTRIES 256
+#define QUEUE_BYTES (1024*1024)
+#define WRITE_VECTORS 32
+
+// longest WebSocket frame header the server sends (no mask)
+#define HEADROOM 10
+
+// a message (or reply) as it's sent, shared by the subscribers it's queued for
+struct shared {
+	unsigned refs;
+	size_t length;					// of the JSON (or reply) text
+	uint8_t header;					// length of the WebSocket header in front of it
+	char data[];					// HEADROOM bytes, then the text
+};
+
+struct subscriber {
+	int fd;
+	uint8_t protocol;
+	uint8_t policy;
+	uint8_t active;					// set by the first command
+	uint8_t closing;				// close when the queue is sent
+	uint8_t writing;				// waiting for EPOLLOUT
+	char input[INPUT_BUFFER];
+	size_t inputlength;
+	uint64_t* rics;					// sorted
+	size_t riccount;
+	regex_t regex;
+	uint8_t hasregex;
+	struct shared* queue[QUEUE_ENTRIES];
+	unsigned queuefirst;
+	unsigned queuecount;
+	size_t queuebytes;
+	size_t sentoffset;				// of the first queued buffer
+	unsigned long dropped;			// since the last message that got through
+};
+
+static int epollfd = -1;
+static int listenfd = -1;
+static int defaultpolicy = POLICY_DROP;
+
+// subscribers by file descriptor
+static struct subscriber** subscribers = NULL;
+static int subscribercapacity = 0;
+
+static char scratch[65536];
+
+static struct shared* sharedNew(const char* text, size_t length){
+	struct shared* b = malloc(sizeof(struct shared)+HEADROOM+length);
+	int byte;
+	if(!b)return NULL;
+	b->refs=0;
+	b->length=length;
+	memcpy(b->data+HEADROOM,text,length);
+	// server frames: FIN and text opcode, unmasked
+	if(length<126){
+		b->header=2;
+		b->data[HEADROOM-1]=length;
+	} else if(length<65536){
+		b->header=4;
+		b->data[HEADROOM-3]=126;
+		b->data[HEADROOM-2]=length>>8;
+		b->data[HEADROOM-1]=length;
+	} else {
+		b->header=10;
+		b->data[HEADROOM-9]=127;
+		for(byte=0;byte<8;byte++)b->data[HEADROOM-1-byte]=(uint8_t)((uint64_t)length>>(8*byte));
+	}
+	b->data[HEADROOM-b->header]=0x81;
+	return b;
+}
+
+static void sharedRelease(struct shared* b){
+	if(!--b->refs)free(b);
+}
+
+// where a subscriber starts sending a buffer
+static const char* sharedStart(struct subscriber* s, struct shared* b){
+	return (s->protocol==PROTOCOL_WEBSOCKET)?b->data+HEADROOM-b->header:b->data+HEADROOM;
+}
+
+static size_t sharedLength(struct subscriber* s, struct shared* b){
+	return (s->protocol==PROTOCOL_WEBSOCKET)?b->length+b->header:b->length;
+}
+
+static void subscriberClose(struct subscriber* s){
+	while(s->queuecount){
+		sharedRelease(s->queue[s->queuefirst]);
+		s->queuefirst=(s->queuefirst+1)%QUEUE_ENTRIES;
+		s->queuecount--;
+	}
+	if(s->hasregex)regfree(&s->regex);
+	free(s->rics);
+	close(s->fd);
+	subscribers[s->fd]=NULL;
+	free(s);
+}
+
+// sends what's queued, as far as the socket takes it. Returns 0 if the subscriber was closed
+static int subscriberWrite(struct subscriber* s){
+	struct iovec iov[WRITE_VECTORS];
+	struct epoll_event event;
+	struct shared* b;
+	unsigned count;
+	ssize_t length;
+	size_t part;
+	while(s->queuecount){
+		for(count=0;(count<s->queuecount)&&(count<WRITE_VECTORS);count++){
+			b=s->queue[(s->queuefirst+count)%QUEUE_ENTRIES];
+			iov[count].iov_base=(char*)sharedStart(s,b);
+			iov[count].iov_len=sharedLength(s,b);
+		}
+		iov[0].iov_base=(char*)iov[0].iov_base+s->sentoffset;
+		iov[0].iov_len-=s->sentoffset;
+		length=writev(s->fd,iov,count);
+		if(length<0){
+			if((errno==EAGAIN)||(errno==EINTR))break;
+			subscriberClose(s);
+			return 0;
+		}
+		// release what was sent completely
+		while(length&&s->queuecount){
+			b=s->queue[s->queuefirst];
+			part=sharedLength(s,b)-s->sentoffset;
+			if((size_t)length<part){
+				s->sentoffset+=length;
+				break;
+			}
+			length-=part;
+			s->sentoffset=0;
+			s->queuebytes-=b->length;
+			sharedRelease(b);
+			s->queuefirst=(s->queuefirst+1)%QUEUE_ENTRIES;
+			s->queuecount--;
+		}
+	}
+	if(!s->queuecount&&s->closing){
+		subscriberClose(s);
+		return 0;
+	}
+	if((s->queuecount!=0)!=s->writing){
+		s->writing=(s->queuecount!=0);
+		event.events=EPOLLIN|(s->writing?EPOLLOUT:0);
+		event.data.fd=s->fd;
+		epoll_ctl(epollfd,EPOLL_CTL_MOD,s->fd,&event);
+	}
+	return 1;
+}
+
+// queues a buffer. Returns 0 if it didn't fit
+static int subscriberQueue(struct subscriber* s, struct shared* b){
+	if((s->queuecount>=QUEUE_ENTRIES)||(s->queuebytes+b->length>QUEUE_BYTES))return 0;
+	b->refs++;
+	s->queue[(s->queuefirst+s->queuecount)%QUEUE_ENTRIES]=b;
+	s->queuecount++;
+	s->queuebytes+=b->length;
+	return 1;
+}
+
+// sends a reply to a command, returns 0 if the subscriber was closed
+static int reply(struct subscriber* s, const char* text){
+	struct shared* b = sharedNew(text,strlen(text));
+	if(!b)return 1;
+	// the handshake is sent without a frame header
+	if(s->protocol==PROTOCOL_HANDSHAKE)b->header=0;
+	if(!subscriberQueue(s,b)){
+		free(b);
+		return 1;
+	}
+	return subscriberWrite(s);
+}
+
+static int compareRic(const void* a, const void* b){
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x>y)-(x<y);
+}
+
+// runs a command line, returns 0 if the subscriber was closed
+static int command(struct subscriber* s, char* line){
+	char* arg;
+	char* end;
+	char error[200];
+	uint64_t* rics;
+	size_t count;
+	int result;
+	while(*line==' ')line++;
+	arg=line+strcspn(line," ");
+	if(*arg)*arg++=0;
+	if(!strcmp(line,"all")){
+		free(s->rics);
+		s->rics=NULL;
+		s->riccount=0;
+		if(s->hasregex)regfree(&s->regex);
+		s->hasregex=0;
+	} else if(!strcmp(line,"ric")){
+		rics=malloc((strlen(arg)/2+1)*sizeof(uint64_t));
+		if(!rics)return reply(s,"error: out of memory\n");
+		for(count=0;*arg;count++){
+			rics[count]=strtoull(arg,&end,10);
+			if(end==arg){
+				free(rics);
+				return reply(s,"error: ric takes capcodes\n");
+			}
+			arg=end+strspn(end," ,");
+		}
+		qsort(rics,count,sizeof(uint64_t),compareRic);
+		free(s->rics);
+		s->rics=count?rics:NULL;
+		if(!count)free(rics);
+		s->riccount=count;
+	} else if(!strcmp(line,"match")){
+		if(s->hasregex)regfree(&s->regex);
+		s->hasregex=0;
+		if(*arg){
+			result=regcomp(&s->regex,arg,REG_EXTENDED|REG_NOSUB);
+			if(result){
+				strcpy(error,"error: ");
+				regerror(result,&s->regex,error+7,sizeof(error)-8);
+				strcat(error,"\n");
+				return reply(s,error);
+			}
+			s->hasregex=1;
+		}
+	} else if(!strcmp(line,"policy")){
+		if(!strcmp(arg,"drop")){
+			s->policy=POLICY_DROP;
+		} else if(!strcmp(arg,"disconnect")){
+			s->policy=POLICY_DISCONNECT;
+		} else {
+			return reply(s,"error: policy is drop or disconnect\n");
+		}
+	} else if(*line){
+		return reply(s,"error: unknown command\n");
+	} else {
+		return 1;
+	}
+	s->active=1;
+	return reply(s,"ok\n");
+}
+
+static void consume(struct subscriber* s, size_t length){
+	memmove(s->input,s->input+length,s->inputlength-length);
+	s->inputlength-=length;
+}
+
+// SHA-1, for the WebSocket handshake
+static void sha1(const uint8_t* data, size_t length, uint8_t* digest){
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	uint32_t w[80];
+	uint32_t a, b, c, d, e, f, k, temp;
+	uint8_t block[64];
+	size_t offset;
+	size_t last;
+	size_t index;
+	int i;
+	// the message, a 1 bit, and the length in bits at the end of the last block
+	last=(length+8)/64*64;
+	for(offset=0;offset<=last;offset+=64){
+		for(i=0;i<64;i++){
+			index=offset+i;
+			if(index<length){
+				block[i]=data[index];
+			} else if(index==length){
+				block[i]=0x80;
+			} else if((offset==last)&&(i>=56)){
+				block[i]=(uint8_t)((uint64_t)length*8>>(8*(63-i)));
+			} else {
+				block[i]=0;
+			}
+		}
+		for(i=0;i<16;i++)w[i]=(uint32_t)block[i*4]<<24|block[i*4+1]<<16|block[i*4+2]<<8|block[i*4+3];
+		for(i=16;i<80;i++){
+			temp=w[i-3]^w[i-8]^w[i-14]^w[i-16];
+			w[i]=(temp<<1)|(temp>>31);
+		}
+		a=h[0];b=h[1];c=h[2];d=h[3];e=h[4];
+		for(i=0;i<80;i++){
+			if(i<20){
+				f=(b&c)|(~b&d);
+				k=0x5A827999;
+			} else if(i<40){
+				f=b^c^d;
+				k=0x6ED9EBA1;
+			} else if(i<60){
+				f=(b&c)|(b&d)|(c&d);
+				k=0x8F1BBCDC;
+			} else {
+				f=b^c^d;
+				k=0xCA62C1D6;
+			}
+			temp=((a<<5)|(a>>27))+f+e+k+w[i];
+			e=d;d=c;c=(b<<30)|(b>>2);b=a;a=temp;
+		}
+		h[0]+=a;h[1]+=b;h[2]+=c;h[3]+=d;h[4]+=e;
+	}
+	for(i=0;i<20;i++)digest[i]=h[i/4]>>(24-8*(i%4));
+}
+
+static void base64(const uint8_t* data, size_t length, char* out){
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i;
+	uint32_t group;
+	for(i=0;i<length;i+=3){
+		group=data[i]<<16|((i+1<length)?data[i+1]<<8:0)|((i+2<length)?data[i+2]:0);
+		*out++=table[group>>18];
+		*out++=table[(group>>12)&0x3F];
+		*out++=(i+1<length)?table[(group>>6)&0x3F]:'=';
+		*out++=(i+2<length)?table[group&0x3F]:'=';
+	}
+	*out=0;
+}
+
+// answers the WebSocket upgrade request, returns 0 if the subscriber was closed
+static int handshake(struct subscriber* s, char* request){
+	static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	char key[128];
+	char accept[32];
+	char answer[256];
+	uint8_t digest[20];
+	char* line;
+	size_t length;
+	for(line=strstr(request,"\r\n");line;line=strstr(line+2,"\r\n")){
+		if(!strncasecmp(line+2,"Sec-WebSocket-Key:",18))break;
+	}
+	if(!line){
+		s->closing=1;
+		return reply(s,"HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n");
+	}
+	line+=20;
+	line+=strspn(line," ");
+	length=strcspn(line," \r");
+	if(length+sizeof(guid)>sizeof(key))length=sizeof(key)-sizeof(guid);
+	memcpy(key,line,length);
+	strcpy(key+length,guid);
+	sha1((const uint8_t*)key,strlen(key),digest);
+	base64(digest,20,accept);
+	snprintf(answer,sizeof(answer),"HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: %s\r\n\r\n",accept);
+	if(!reply(s,answer))return 0;
+	s->protocol=PROTOCOL_WEBSOCKET;
+	return 1;
+}
+
+// handles the frames a WebSocket client sent, returns 0 if the subscriber was closed
+static int websocketFrames(struct subscriber* s){
+	uint8_t* in = (uint8_t*)s->input;
+	size_t header;
+	size_t length;
+	size_t index;
+	uint8_t opcode;
+	uint8_t* mask;
+	struct shared* b;
+	char line[INPUT_BUFFER];
+	while(s->inputlength>=2){
+		opcode=in[0]&0x0F;
+		length=in[1]&0x7F;
+		header=2;
+		if(length==126){
+			if(s->inputlength<4)return 1;
+			length=in[2]<<8|in[3];
+			header=4;
+		} else if(length==127){
+			// commands are short
+			s->closing=1;
+			return subscriberWrite(s);
+		}
+		mask=(in[1]&0x80)?in+header:NULL;
+		if(mask)header+=4;
+		if(header+length>sizeof(s->input)-1){
+			s->closing=1;
+			return subscriberWrite(s);
+		}
+		if(s->inputlength<header+length)return 1;
+		if(mask){
+			for(index=0;index<length;index++)in[header+index]^=mask[index%4];
+		}
+		switch(opcode){
+			case 0x1:
+				memcpy(line,in+header,length);
+				line[length]=0;
+				consume(s,header+length);
+				if(!command(s,line))return 0;
+				continue;
+			case 0x8:
+				s->closing=1;
+				b=sharedNew("",0);
+				if(b){
+					b->data[HEADROOM-2]=(char)0x88;
+					if(!subscriberQueue(s,b))free(b);
+				}
+				return subscriberWrite(s);
+			case 0x9:
+				b=sharedNew((char*)in+header,length);
+				if(b){
+					b->data[HEADROOM-b->header]=(char)0x8A;
+					if(!subscriberQueue(s,b))free(b);
+				}
+				break;
+		}
+		consume(s,header+length);
+		if(!subscriberWrite(s))return 0;
+	}
+	return 1;
+}
+
+// reads what a subscriber sent, returns 0 if it was closed
+static int subscriberRead(struct subscriber* s){
+	ssize_t length;
+	char* end;
+	while(1){
+		length=read(s->fd,s->input+s->inputlength,sizeof(s->input)-1-s->inputlength);
+		if(length<0){
+			if((errno==EAGAIN)||(errno==EINTR))return 1;
+			subscriberClose(s);
+			return 0;
+		}
+		if(length==0){
+			subscriberClose(s);
+			return 0;
+		}
+		s->inputlength+=length;
+		s->input[s->inputlength]=0;
+		if(s->closing){
+			s->inputlength=0;
+			continue;
+		}
+		if((s->protocol==PROTOCOL_TCP)&&!s->active&&(s->inputlength>=4)&&!memcmp(s->input,"GET ",4)){
+			s->protocol=PROTOCOL_HANDSHAKE;
+		}
+		if(s->protocol==PROTOCOL_HANDSHAKE){
+			end=strstr(s->input,"\r\n\r\n");
+			if(!end){
+				if(s->inputlength>=sizeof(s->input)-1)s->inputlength=0;
+				continue;
+			}
+			*end=0;
+			if(!handshake(s,s->input))return 0;
+			consume(s,end+4-s->input);
+		}
+		if(s->protocol==PROTOCOL_WEBSOCKET){
+			if(!websocketFrames(s))return 0;
+			continue;
+		}
+		while((end=memchr(s->input,'\n',s->inputlength))){
+			*end=0;
+			if((end>s->input)&&(end[-1]=='\r'))end[-1]=0;
+			if(!command(s,s->input))return 0;
+			consume(s,end+1-s->input);
+		}
+		if(s->inputlength>=sizeof(s->input)-1)s->inputlength=0;
+	}
+}
+
+static void acceptSubscribers(void){
+	struct subscriber* s;
+	struct subscriber** grown;
+	struct epoll_event event;
+	int fd;
+	int capacity;
+	while((fd=accept4(listenfd,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC))>=0){
+		if(fd>=subscribercapacity){
+			capacity=(fd+64)&~63;
+			grown=realloc(subscribers,capacity*sizeof(struct subscriber*));
+			if(!grown){
+				close(fd);
+				continue;
+			}
+			memset(grown+subscribercapacity,0,(capacity-subscribercapacity)*sizeof(struct subscriber*));
+			subscribers=grown;
+			subscribercapacity=capacity;
+		}
+		s=calloc(1,sizeof(struct subscriber));
+		if(!s){
+			close(fd);
+			continue;
+		}
+		s->fd=fd;
+		s->policy=defaultpolicy;
+		subscribers[fd]=s;
+		event.events=EPOLLIN;
+		event.data.fd=fd;
+		epoll_ctl(epollfd,EPOLL_CTL_ADD,fd,&event);
+	}
+}
+
+int pubsubListen(int epoll, const char* port, int policy){
+	struct addrinfo hints;
+	struct addrinfo* result;
+	struct epoll_event event;
+	int yes = 1;
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family=AF_INET6;
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_flags=AI_PASSIVE;
+	if(getaddrinfo(NULL,port,&hints,&result)){
+		hints.ai_family=AF_INET;
+		if(getaddrinfo(NULL,port,&hints,&result))return 0;
+	}
+	listenfd=socket(result->ai_family,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+	if(listenfd>=0){
+		setsockopt(listenfd,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes));
+	}
+	if((listenfd<0)||bind(listenfd,result->ai_addr,result->ai_addrlen)||listen(listenfd,64)){
+		perror("listen");
+		freeaddrinfo(result);
+		return 0;
+	}
+	freeaddrinfo(result);
+	epollfd=epoll;
+	defaultpolicy=policy;
+	event.events=EPOLLIN;
+	event.data.fd=listenfd;
+	epoll_ctl(epoll,EPOLL_CTL_ADD,listenfd,&event);
+	return 1;
+}
+
+int pubsubEvent(int fd, uint32_t events){
+	struct subscriber* s;
+	if(fd==listenfd){
+		acceptSubscribers();
+		return 1;
+	}
+	if((fd<0)||(fd>=subscribercapacity)||!subscribers[fd])return 0;
+	s=subscribers[fd];
+	if((events&(EPOLLIN|EPOLLHUP|EPOLLERR))&&!subscriberRead(s))return 1;
+	if(events&EPOLLOUT)subscriberWrite(s);
+	return 1;
+}
+
+static int passes(struct subscriber* s, const struct flexitem* item, const char* text){
+	uint16_t count;
+	if(!s->active||s->closing||(s->protocol==PROTOCOL_HANDSHAKE))return 0;
+	if(s->riccount){
+		for(count=0;count<item->addresscount;count++){
+			if(bsearch(&item->capcode[count],s->rics,s->riccount,sizeof(uint64_t),compareRic))break;
+		}
+		if(count==item->addresscount)return 0;
+	}
+	return !s->hasregex||!regexec(&s->regex,text,0,NULL,0);
+}
+
+// writes the JSON of a message, returns its length
+static size_t serialize(const struct flexitem* item, uint8_t cycle, uint8_t frame, char* out, size_t max){
+	static const char hex[] = "0123456789ABCDEF";
+	size_t length;
+	size_t index;
+	uint16_t count;
+	uint8_t c;
+	length=snprintf(out,max,"{\"cycle\":%u,\"frame\":%u,\"priority\":%s,\"truncated\":%s,\"capcodes\":[",cycle,frame,
+			item->priority?"true":"false",item->truncated?"true":"false");
+	for(count=0;count<item->addresscount;count++){
+		length+=snprintf(out+length,max-length,"%s%llu",count?",":"",(unsigned long long)item->capcode[count]);
+	}
+	length+=snprintf(out+length,max-length,"],\"text\":\"");
+	// the text is at most 1024 characters, 6 bytes each when escaped, which fits
+	for(index=0;index<item->textlength;index++){
+		c=item->text[index];
+		if((c=='"')||(c=='\\')){
+			out[length++]='\\';
+			out[length++]=c;
+		} else if((c<0x20)||(c>=0x7F)){
+			length+=sprintf(out+length,"\\u%04x",c);
+		} else {
+			out[length++]=c;
+		}
+	}
+	out[length++]='"';
+	if(item->payloadlength){
+		length+=snprintf(out+length,max-length,",\"payload\":\"");
+		for(index=0;index<item->payloadlength;index++){
+			if(item->payloadhex){
+				out[length++]=item->payload[index];
+			} else {
+				out[length++]=hex[item->payload[index]>>4];
+				out[length++]=hex[item->payload[index]&0x0F];
+			}
+		}
+		out[length++]='"';
+	}
+	return length;
+}
+
+void pubsubPublish(const struct flexitem* item, uint8_t cycle, uint8_t frame){
+	static char text[2048];
+	struct shared* b = NULL;
+	struct subscriber* s;
+	struct shared* note;
+	char dropped[64];
+	size_t length = 0;
+	int fd;
+	if(item->type!=ITEM_MESSAGE)return;
+	length=(item->textlength<sizeof(text)-1)?item->textlength:sizeof(text)-1;
+	if(length)memcpy(text,item->text,length);
+	text[length]=0;
+	for(fd=0;fd<subscribercapacity;fd++){
+		s=subscribers[fd];
+		if(!s||!passes(s,item,text))continue;
+		if(!b){
+			// serialized for the first subscriber that takes it, shared by the others
+			length=serialize(item,cycle,frame,scratch,sizeof(scratch)-32);
+			scratch[length++]='}';
+			scratch[length++]='\n';
+			b=sharedNew(scratch,length);
+			if(!b)return;
+			b->refs=1;
+		}
+		if(s->dropped&&(s->queuecount<QUEUE_ENTRIES-1)){
+			// the count of the messages it missed goes in front of this one
+			snprintf(dropped,sizeof(dropped),"{\"dropped\":%lu}\n",s->dropped);
+			note=sharedNew(dropped,strlen(dropped));
+			if(note){
+				if(subscriberQueue(s,note)){
+					s->dropped=0;
+				} else {
+					free(note);
+				}
+			}
+		}
+		if(!subscriberQueue(s,b)){
+			if(s->policy==POLICY_DISCONNECT){
+				fprintf(stderr,"flexpubsub: subscriber %d doesn't keep up, disconnected\n",fd);
+				subscriberClose(s);
+				continue;
+			}
+			s->dropped++;
+			continue;
+		}
+		subscriberWrite(s);
+	}
+	if(b)sharedRelease(b);
+}
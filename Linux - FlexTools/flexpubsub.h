@@ -0,0 +1,43 @@
+/*
+ * flexpubsub.h
+ *
+ * Publish/subscribe server for decoded messages, run from the epoll loop of flexbridge. Subscribers connect over plain
+ * TCP or WebSocket (on the same port, a connection that starts with "GET " is a WebSocket), and send commands as lines
+ * (or as WebSocket text frames):
+ *   all                   everything
+ *   ric 1234567 1600001   only messages to one of these capcodes
+ *   match ^A[12] .*BRAND  only messages whose text matches this (extended) regular expression
+ *   policy drop|disconnect   what happens when the subscriber doesn't keep up
+ * A subscriber doesn't get anything before its first command. ric and match can be combined, both have to match. Each
+ * command is answered with "ok" or "error: ...".
+ *
+ * Messages are sent as a line of JSON (a text frame for WebSocket):
+ *   {"cycle":1,"frame":4,"priority":false,"truncated":false,"capcodes":[1234567],"text":"HELLO","payload":"DEADBEEF"}
+ * A message is serialized once, into a reference counted buffer that the queues of all subscribers it passes point to.
+ * The buffer has room for the WebSocket frame header in front of the JSON, so both kinds of subscriber send it as is.
+ *
+ * Subscribers are written to without blocking. When one has more than 256 messages or 1 MB waiting, new messages are
+ * dropped for it (policy drop, the next message that gets through is preceded by {"dropped":n}) or it's disconnected
+ * (policy disconnect), so a slow subscriber never holds up the decoder or the other subscribers.
+ */
+
+#ifndef FLEXPUBSUB_H_
+#define FLEXPUBSUB_H_
+
+#include <stdint.h>
+
+#include "flexstream.h"
+
+#define POLICY_DROP 0
+#define POLICY_DISCONNECT 1
+
+/** Starts listening on port, the connections are added to epoll. Returns 0 on failure */
+int pubsubListen(int epoll, const char* port, int policy);
+
+/** Handles an epoll event. Returns 0 if fd isn't one of the pub/sub server */
+int pubsubEvent(int fd, uint32_t events);
+
+/** Sends a message item to every subscriber whose filter it passes */
+void pubsubPublish(const struct flexitem* item, uint8_t cycle, uint8_t frame);
+
+#endif /* FLEXPUBSUB_H_ */
@@ -0,0 +1,877 @@
+/*
+ * flexsearch.c
+ *
+ * Full text search over the messages that flexbridge publishes in its shared memory ring (see flexshm.h). The server
+ * keeps the most recent messages (-n, 100000 by default, and with -a no older than that many hours) and an inverted
+ * index of the words in their text, and answers queries over a unix socket. A message is indexed as soon as it's in the
+ * ring, the ring is looked at at least every 10 ms.
+ *
+ * Words are runs of letters and digits, without case. Every word has a posting list, the ids of the messages it's in:
+ * the first one as it is, the rest as the distance to the one before, in varints of 7 bits. Ids only go up, so a
+ * message is added at the end of the lists of its words, and the messages that fell out of the retention are at the
+ * front of the lists. Those are cut off once a quarter of what was indexed since the last time has gone, words that
+ * are left without messages are removed then, so the memory stays in proportion to the retention.
+ *
+ * A query is a line of terms, all of which have to match:
+ *   A1             the word A1
+ *   BRAND*         a word that starts with BRAND
+ *   "P 1"          the words P and 1, next to each other
+ *   AB-1*          the word AB, followed by a word that starts with 1
+ *   ric 1234567    a message to this capcode (several ric terms: to one of them)
+ *   limit 20       at most this many results, 100 by default
+ * The matching messages are sent newest first, a line of JSON each, followed by "ok <matches>" (or "error: ..."):
+ *   {"id":812,"time":1792349784.210,"cycle":1,"frame":4,"priority":false,"capcodes":[1234567],"text":"A1 BRAND ..."}
+ * "stats" answers with the number of messages, words and posting bytes.
+ *
+ * Build: gcc -O2 -Wall -I"../AVR - FlexDecoder" -o flexsearch flexsearch.c flexshm.c flexstream.c flexproto.c
+ * Usage: flexsearch serve [-u socket] [-n messages] [-a hours] [-o] [/flexring]   (-o starts at the oldest record)
+ *        flexsearch query [-u socket] <terms>
+ * The socket is /tmp/flexsearch.sock by default, anything that can write a line to it works as a client, like
+ * socat - UNIX-CONNECT:/tmp/flexsearch.sock
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "flexshm.h"
+
+#define DEFAULT_SOCKET "/tmp/flexsearch.sock"
+#define DEFAULT_RETENTION 100000
+#define DEFAULT_LIMIT 100
+#define MAX_LIMIT 10000
+
+#define MAX_WORD 32
+#define MAX_TERMS 16
+#define MAX_RICS 16
+#define INPUT_MAX 1024
+// a client that has more than this waiting is closed
+#define OUTPUT_MAX (4*1024*1024)
+#define POLL_MS 10
+
+#define SHM_RECORD_MAX (sizeof(struct shmrecord)+ITEM_ADDRESSES*sizeof(uint64_t)+2*0xFFFF+16)
+
+#define NS 1000000000LL
+
+#define TERM_WORD 0
+#define TERM_PREFIX 1
+#define TERM_PHRASE 2
+
+struct message {
+	uint64_t id;					// 0 for a free slot
+	int64_t time;
+	uint8_t cycle;
+	uint8_t frame;
+	uint8_t flags;
+	uint16_t addresscount;
+	uint16_t textlength;
+	uint64_t* capcode;				// one allocation with the text behind the capcodes
+	char* text;
+};
+
+struct postings {
+	char* word;
+	uint64_t first;					// id of the first message
+	uint64_t last;					// id of the last one, the next is stored as the distance to it
+	uint32_t count;
+	uint32_t length;				// bytes of varints behind the first one
+	uint32_t capacity;
+	uint8_t* deltas;
+};
+
+struct term {
+	int type;
+	char words[MAX_TERMS][MAX_WORD];
+	int wordcount;
+	int prefix;						// the last word is a prefix
+};
+
+struct client {
+	int fd;
+	char input[INPUT_MAX];
+	size_t inputlength;
+	char* output;
+	size_t outputlength;
+	size_t outputcapacity;
+	size_t sent;
+	int writing;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static int epollfd = -1;
+static int listenfd = -1;
+static struct client** clients = NULL;
+static int clientcapacity = 0;
+
+// the retained messages, by id%retention
+static struct message* messages = NULL;
+static uint64_t retention = DEFAULT_RETENTION;
+static int64_t maxage = 0;
+static uint64_t nextid = 1;
+static uint64_t oldest = 1;
+static uint64_t trimmed = 1;
+
+// the posting lists, open addressing
+static struct postings** table = NULL;
+static size_t tablesize = 0;
+static size_t wordcount = 0;
+static size_t postingbytes = 0;
+
+static int64_t now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+	return ts.tv_sec*NS+ts.tv_nsec;
+}
+
+static void onSignal(int sig){
+	(void)sig;
+	stop=1;
+}
+
+static int isWordChar(char c){
+	return ((c>='0')&&(c<='9'))||((c>='A')&&(c<='Z'))||((c>='a')&&(c<='z'));
+}
+
+// the next word from pos on, upper case and cut short at MAX_WORD-1. Returns its length, 0 at the end
+static size_t nextWord(const char* text, size_t length, size_t* pos, char* word){
+	size_t count = 0;
+	while((*pos<length)&&!isWordChar(text[*pos]))(*pos)++;
+	while((*pos<length)&&isWordChar(text[*pos])){
+		if(count<MAX_WORD-1)word[count++]=((text[*pos]>='a')&&(text[*pos]<='z'))?text[*pos]-32:text[*pos];
+		(*pos)++;
+	}
+	word[count]=0;
+	return count;
+}
+
+static uint64_t hashWord(const char* word){
+	uint64_t hash = 14695981039346656037ULL;
+	while(*word)hash=(hash^(uint8_t)*word++)*1099511628211ULL;
+	return hash;
+}
+
+static struct postings** findSlot(struct postings** slots, size_t size, const char* word){
+	size_t slot = hashWord(word)&(size-1);
+	while(slots[slot]&&strcmp(slots[slot]->word,word))slot=(slot+1)&(size-1);
+	return &slots[slot];
+}
+
+static struct postings* findPostings(const char* word){
+	if(!tablesize)return NULL;
+	return *findSlot(table,tablesize,word);
+}
+
+static void resize(size_t size){
+	struct postings** grown = calloc(size,sizeof(struct postings*));
+	size_t slot;
+	if(!grown)return;
+	for(slot=0;slot<tablesize;slot++){
+		if(table[slot])*findSlot(grown,size,table[slot]->word)=table[slot];
+	}
+	free(table);
+	table=grown;
+	tablesize=size;
+}
+
+static void addPosting(const char* word, uint64_t id){
+	struct postings** slot;
+	struct postings* p;
+	uint64_t delta;
+	uint8_t* grown;
+	if(wordcount*2>=tablesize)resize(tablesize?tablesize*2:4096);
+	slot=findSlot(table,tablesize,word);
+	p=*slot;
+	if(!p){
+		p=calloc(1,sizeof(struct postings));
+		if(!p)return;
+		p->word=strdup(word);
+		p->first=id;
+		p->last=id;
+		p->count=1;
+		*slot=p;
+		wordcount++;
+		return;
+	}
+	// a word that is in the message twice
+	if(p->last==id)return;
+	if(p->length+10>p->capacity){
+		grown=realloc(p->deltas,p->capacity*2+16);
+		if(!grown)return;
+		postingbytes+=p->capacity+16;
+		p->deltas=grown;
+		p->capacity=p->capacity*2+16;
+	}
+	delta=id-p->last;
+	while(delta>=0x80){
+		p->deltas[p->length++]=(delta&0x7F)|0x80;
+		delta>>=7;
+	}
+	p->deltas[p->length++]=delta;
+	p->last=id;
+	p->count++;
+}
+
+static uint64_t readVarint(const uint8_t* data, uint32_t* pos){
+	uint64_t value = 0;
+	uint8_t shift = 0;
+	while(data[*pos]&0x80){
+		value|=(uint64_t)(data[(*pos)++]&0x7F)<<shift;
+		shift+=7;
+	}
+	value|=(uint64_t)data[(*pos)++]<<shift;
+	return value;
+}
+
+// cuts off the messages that are no longer retained. Returns 0 if none are left
+static int trimPostings(struct postings* p){
+	uint8_t* grown;
+	uint32_t pos = 0;
+	while(p->first<oldest){
+		if(p->count==1)return 0;
+		p->first+=readVarint(p->deltas,&pos);
+		p->count--;
+	}
+	if(pos){
+		memmove(p->deltas,p->deltas+pos,p->length-pos);
+		p->length-=pos;
+	}
+	// gives back what a list that was cut short doesn't need anymore
+	if((p->capacity>64)&&(p->length<p->capacity/4)){
+		grown=realloc(p->deltas,p->length*2+16);
+		if(grown){
+			postingbytes-=p->capacity-(p->length*2+16);
+			p->deltas=grown;
+			p->capacity=p->length*2+16;
+		}
+	}
+	return 1;
+}
+
+static void freePostings(struct postings* p){
+	postingbytes-=p->capacity;
+	free(p->deltas);
+	free(p->word);
+	free(p);
+}
+
+// trims every list and drops the words without messages, the table is built again without them
+static void trimAll(void){
+	struct postings** old = table;
+	size_t oldsize = tablesize;
+	size_t slot;
+	size_t size = 4096;
+	for(slot=0;slot<oldsize;slot++){
+		if(old[slot]&&!trimPostings(old[slot])){
+			freePostings(old[slot]);
+			old[slot]=NULL;
+			wordcount--;
+		}
+	}
+	while(size<=wordcount*3)size*=2;
+	table=NULL;
+	tablesize=0;
+	resize(size);
+	for(slot=0;slot<oldsize;slot++){
+		if(old[slot])*findSlot(table,tablesize,old[slot]->word)=old[slot];
+	}
+	free(old);
+	trimmed=oldest;
+}
+
+static void expire(struct message* m){
+	if(m->id>=oldest)oldest=m->id+1;
+	free(m->capcode);
+	memset(m,0,sizeof(*m));
+}
+
+static void expireOld(void){
+	int64_t limit;
+	struct message* m;
+	if(maxage){
+		limit=now()-maxage;
+		while(oldest<nextid){
+			m=&messages[oldest%retention];
+			if(!m->id){
+				oldest++;
+				continue;
+			}
+			if(m->time>=limit)break;
+			expire(m);
+		}
+	}
+	// once a quarter of what was indexed since the last time has gone
+	if((oldest>trimmed)&&((oldest-trimmed)*4>=nextid-trimmed))trimAll();
+}
+
+static void indexMessage(const struct shmrecord* record){
+	struct flexitem item;
+	struct message* m;
+	char word[MAX_WORD];
+	size_t pos = 0;
+	flexShmItem(record,&item);
+	if(item.type!=ITEM_MESSAGE)return;
+	m=&messages[nextid%retention];
+	if(m->id)expire(m);
+	m->capcode=malloc(item.addresscount*sizeof(uint64_t)+item.textlength+1);
+	if(!m->capcode)return;
+	m->id=nextid++;
+	m->time=record->time;
+	m->cycle=item.cycle;
+	m->frame=item.frame;
+	m->flags=record->flags;
+	m->addresscount=item.addresscount;
+	m->textlength=item.textlength;
+	m->text=(char*)(m->capcode+item.addresscount);
+	memcpy(m->capcode,item.capcode,item.addresscount*sizeof(uint64_t));
+	if(item.textlength)memcpy(m->text,item.text,item.textlength);
+	m->text[item.textlength]=0;
+	while(nextWord(m->text,m->textlength,&pos,word))addPosting(word,m->id);
+	if(nextid-oldest>retention)oldest=nextid-retention;
+}
+
+// appends to the output of a client. Returns 0 if it has too much waiting
+static int clientAppend(struct client* c, const char* text, size_t length){
+	char* grown;
+	size_t capacity;
+	if(c->outputlength+length>OUTPUT_MAX)return 0;
+	if(c->outputlength+length>c->outputcapacity){
+		capacity=c->outputcapacity*2+length+4096;
+		grown=realloc(c->output,capacity);
+		if(!grown)return 0;
+		c->output=grown;
+		c->outputcapacity=capacity;
+	}
+	memcpy(c->output+c->outputlength,text,length);
+	c->outputlength+=length;
+	return 1;
+}
+
+static void clientClose(struct client* c){
+	close(c->fd);
+	clients[c->fd]=NULL;
+	free(c->output);
+	free(c);
+}
+
+// sends what's waiting, as far as the socket takes it. Returns 0 if the client was closed
+static int clientWrite(struct client* c){
+	struct epoll_event event;
+	ssize_t length;
+	while(c->sent<c->outputlength){
+		length=write(c->fd,c->output+c->sent,c->outputlength-c->sent);
+		if(length<0){
+			if((errno==EAGAIN)||(errno==EINTR))break;
+			clientClose(c);
+			return 0;
+		}
+		c->sent+=length;
+	}
+	if(c->sent==c->outputlength){
+		c->sent=0;
+		c->outputlength=0;
+	}
+	if((c->outputlength!=0)!=c->writing){
+		c->writing=(c->outputlength!=0);
+		event.events=EPOLLIN|(c->writing?EPOLLOUT:0);
+		event.data.fd=c->fd;
+		epoll_ctl(epollfd,EPOLL_CTL_MOD,c->fd,&event);
+	}
+	return 1;
+}
+
+// the retained ids of a posting list, in order. Returns the count
+static size_t decodePostings(const struct postings* p, uint64_t* ids){
+	uint64_t id = p->first;
+	uint32_t pos = 0;
+	uint32_t count;
+	size_t length = 0;
+	for(count=0;count<p->count;count++){
+		if(count)id+=readVarint(p->deltas,&pos);
+		if(id>=oldest)ids[length++]=id;
+	}
+	return length;
+}
+
+static int compareIds(const void* a, const void* b){
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x>y)-(x<y);
+}
+
+// the ids of the messages with a word that starts with prefix, in order
+static size_t prefixIds(const char* prefix, uint64_t* ids){
+	static uint32_t* seen = NULL;
+	static uint32_t stamp = 0;
+	const struct postings* p;
+	size_t prefixlength = strlen(prefix);
+	size_t length = 0;
+	size_t slot;
+	uint64_t id;
+	uint32_t pos;
+	uint32_t count;
+	if(!seen){
+		seen=calloc(retention,sizeof(uint32_t));
+		if(!seen)return 0;
+	}
+	// a message is taken once, whichever of its words matched
+	stamp++;
+	// a scan of the words, they're short and there are at most a few hundred thousand
+	for(slot=0;slot<tablesize;slot++){
+		p=table[slot];
+		if(!p||strncmp(p->word,prefix,prefixlength))continue;
+		id=p->first;
+		pos=0;
+		for(count=0;count<p->count;count++){
+			if(count)id+=readVarint(p->deltas,&pos);
+			if((id<oldest)||(seen[id%retention]==stamp))continue;
+			seen[id%retention]=stamp;
+			ids[length++]=id;
+		}
+	}
+	qsort(ids,length,sizeof(uint64_t),compareIds);
+	return length;
+}
+
+// keeps the ids that are in both, returns the count
+static size_t intersect(uint64_t* ids, size_t length, const uint64_t* other, size_t otherlength){
+	size_t pos = 0;
+	size_t otherpos = 0;
+	size_t kept = 0;
+	while((pos<length)&&(otherpos<otherlength)){
+		if(ids[pos]<other[otherpos]){
+			pos++;
+		} else if(ids[pos]>other[otherpos]){
+			otherpos++;
+		} else {
+			ids[kept++]=ids[pos++];
+			otherpos++;
+		}
+	}
+	return kept;
+}
+
+static int hasPhrase(const struct message* m, const struct term* t){
+	char words[MAX_TERMS][MAX_WORD];
+	size_t pos = 0;
+	int count = 0;
+	int index;
+	int last = t->wordcount-1;
+	// the last words of the text, as many as the phrase has
+	while(nextWord(m->text,m->textlength,&pos,words[count%t->wordcount])){
+		count++;
+		if(count<t->wordcount)continue;
+		for(index=0;index<last;index++){
+			if(strcmp(words[(count-t->wordcount+index)%t->wordcount],t->words[index]))break;
+		}
+		if(index<last)continue;
+		if(t->prefix?!strncmp(words[(count-1)%t->wordcount],t->words[last],strlen(t->words[last])):
+			!strcmp(words[(count-1)%t->wordcount],t->words[last]))return 1;
+	}
+	return 0;
+}
+
+static void appendJson(struct client* c, const struct message* m){
+	static char out[6*65536+4096];
+	size_t length;
+	size_t pos;
+	uint16_t count;
+	uint8_t ch;
+	length=sprintf(out,"{\"id\":%llu,\"time\":%lld.%03lld,\"cycle\":%u,\"frame\":%u,\"priority\":%s,\"capcodes\":[",
+		(unsigned long long)m->id,(long long)(m->time/NS),(long long)(m->time%NS/1000000),m->cycle,m->frame,
+		(m->flags&SHM_PRIORITY)?"true":"false");
+	for(count=0;(count<m->addresscount)&&(count<ITEM_ADDRESSES);count++){
+		length+=sprintf(out+length,"%s%llu",count?",":"",(unsigned long long)m->capcode[count]);
+	}
+	length+=sprintf(out+length,"],\"text\":\"");
+	for(pos=0;pos<m->textlength;pos++){
+		ch=m->text[pos];
+		if((ch=='"')||(ch=='\\')){
+			out[length++]='\\';
+			out[length++]=ch;
+		} else if((ch<0x20)||(ch>=0x7F)){
+			length+=sprintf(out+length,"\\u%04x",ch);
+		} else {
+			out[length++]=ch;
+		}
+	}
+	length+=sprintf(out+length,"\"}\n");
+	clientAppend(c,out,length);
+}
+
+// the next term of a query line, a quoted phrase or up to a space. Returns NULL at the end
+static char* nextTerm(char** line, int* quoted){
+	char* token = *line;
+	char* end;
+	while(*token==' ')token++;
+	if(!*token)return NULL;
+	*quoted=(*token=='"');
+	if(*quoted){
+		token++;
+		end=strchr(token,'"');
+		if(!end)end=token+strlen(token);
+	} else {
+		end=token+strcspn(token," ");
+	}
+	*line=*end?end+1:end;
+	*end=0;
+	return token;
+}
+
+static int toRic(const struct message* m, const uint64_t* rics, int riccount){
+	uint16_t count;
+	int index;
+	for(count=0;count<m->addresscount;count++){
+		for(index=0;index<riccount;index++){
+			if(m->capcode[count]==rics[index])return 1;
+		}
+	}
+	return 0;
+}
+
+static int reply(struct client* c, const char* text){
+	clientAppend(c,text,strlen(text));
+	return clientWrite(c);
+}
+
+// runs a query, returns 0 if the client was closed
+static int search(struct client* c, char* line){
+	static uint64_t* ids = NULL;
+	static uint64_t* other = NULL;
+	static size_t idcapacity = 0;
+	struct term terms[MAX_TERMS];
+	int termcount = 0;
+	uint64_t rics[MAX_RICS];
+	int riccount = 0;
+	long limit = DEFAULT_LIMIT;
+	char* token;
+	char* number;
+	int quoted;
+	struct term* t;
+	char answer[128];
+	size_t length = 0;
+	size_t otherlength;
+	size_t pos;
+	size_t textpos;
+	size_t matches = 0;
+	int everything = 1;
+	int index;
+	int count;
+	struct postings* p;
+	struct message* m;
+
+	if(!strcmp(line,"stats")){
+		snprintf(answer,sizeof(answer),"ok %llu messages, %zu words, %zu posting bytes\n",
+			(unsigned long long)(nextid-oldest),wordcount,postingbytes);
+		return reply(c,answer);
+	}
+
+	// the terms
+	while((token=nextTerm(&line,&quoted))){
+		if(!quoted&&(!strcmp(token,"ric")||!strcmp(token,"limit"))){
+			number=nextTerm(&line,&quoted);
+			if(!number)return reply(c,"error: ric and limit need a number\n");
+			if(token[0]=='l'){
+				limit=strtol(number,NULL,10);
+				if((limit<1)||(limit>MAX_LIMIT))return reply(c,"error: limit is 1 to 10000\n");
+			} else if(riccount<MAX_RICS){
+				rics[riccount++]=strtoull(number,NULL,10);
+			}
+			continue;
+		}
+		if(termcount==MAX_TERMS)return reply(c,"error: too many terms\n");
+		t=&terms[termcount];
+		t->prefix=(!quoted&&(token[strlen(token)-1]=='*'));
+		t->type=t->prefix?TERM_PREFIX:TERM_WORD;
+		textpos=0;
+		count=0;
+		while((count<MAX_TERMS)&&nextWord(token,strlen(token),&textpos,t->words[count]))count++;
+		if(!count)continue;
+		t->wordcount=count;
+		// several words in one term (quoted, or like P-1) are a phrase, with a * its last word is a prefix
+		if(count>1)t->type=TERM_PHRASE;
+		termcount++;
+	}
+
+	if(idcapacity<retention){
+		idcapacity=retention;
+		ids=realloc(ids,idcapacity*sizeof(uint64_t));
+		other=realloc(other,idcapacity*sizeof(uint64_t));
+		if(!ids||!other){
+			idcapacity=0;
+			return reply(c,"error: out of memory\n");
+		}
+	}
+
+	// the posting lists of all words, intersected
+	for(index=0;index<termcount;index++){
+		for(count=0;count<terms[index].wordcount;count++){
+			if(terms[index].prefix&&(count==terms[index].wordcount-1)){
+				otherlength=prefixIds(terms[index].words[count],other);
+			} else {
+				p=findPostings(terms[index].words[count]);
+				otherlength=p?decodePostings(p,other):0;
+			}
+			if(everything){
+				memcpy(ids,other,otherlength*sizeof(uint64_t));
+				length=otherlength;
+				everything=0;
+			} else {
+				length=intersect(ids,length,other,otherlength);
+			}
+		}
+	}
+
+	// newest first, the capcodes and phrases are checked on the messages themselves
+	pos=everything?nextid-oldest:length;
+	while(pos--){
+		m=&messages[(everything?oldest+pos:ids[pos])%retention];
+		if(!m->id)continue;
+		if(riccount&&!toRic(m,rics,riccount))continue;
+		for(index=0;index<termcount;index++){
+			if((terms[index].type==TERM_PHRASE)&&!hasPhrase(m,&terms[index]))break;
+		}
+		if(index<termcount)continue;
+		if(matches<(size_t)limit)appendJson(c,m);
+		matches++;
+	}
+	snprintf(answer,sizeof(answer),"ok %zu\n",matches);
+	return reply(c,answer);
+}
+
+// reads what a client sent, returns 0 if it was closed
+static int clientRead(struct client* c){
+	ssize_t length;
+	char* end;
+	while(1){
+		length=read(c->fd,c->input+c->inputlength,sizeof(c->input)-1-c->inputlength);
+		if(length<0){
+			if((errno==EAGAIN)||(errno==EINTR))return 1;
+			clientClose(c);
+			return 0;
+		}
+		if(length==0){
+			clientClose(c);
+			return 0;
+		}
+		c->inputlength+=length;
+		while((end=memchr(c->input,'\n',c->inputlength))){
+			*end=0;
+			if((end>c->input)&&(end[-1]=='\r'))end[-1]=0;
+			if(!search(c,c->input))return 0;
+			c->inputlength-=end+1-c->input;
+			memmove(c->input,end+1,c->inputlength);
+		}
+		if(c->inputlength>=sizeof(c->input)-1){
+			c->inputlength=0;
+			if(!reply(c,"error: query too long\n"))return 0;
+		}
+	}
+}
+
+static void acceptClients(void){
+	struct client* c;
+	struct client** grown;
+	struct epoll_event event;
+	int fd;
+	int capacity;
+	while((fd=accept4(listenfd,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC))>=0){
+		if(fd>=clientcapacity){
+			capacity=(fd+64)&~63;
+			grown=realloc(clients,capacity*sizeof(struct client*));
+			if(!grown){
+				close(fd);
+				continue;
+			}
+			memset(grown+clientcapacity,0,(capacity-clientcapacity)*sizeof(struct client*));
+			clients=grown;
+			clientcapacity=capacity;
+		}
+		c=calloc(1,sizeof(struct client));
+		if(!c){
+			close(fd);
+			continue;
+		}
+		c->fd=fd;
+		clients[fd]=c;
+		event.events=EPOLLIN;
+		event.data.fd=fd;
+		epoll_ctl(epollfd,EPOLL_CTL_ADD,fd,&event);
+	}
+}
+
+static int listenSocket(const char* path){
+	struct sockaddr_un address;
+	struct epoll_event event;
+	memset(&address,0,sizeof(address));
+	address.sun_family=AF_UNIX;
+	if(strlen(path)>=sizeof(address.sun_path)){
+		fprintf(stderr,"flexsearch: %s: name too long\n",path);
+		return 0;
+	}
+	strcpy(address.sun_path,path);
+	unlink(path);
+	listenfd=socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+	if((listenfd<0)||bind(listenfd,(struct sockaddr*)&address,sizeof(address))||listen(listenfd,64)){
+		perror(path);
+		return 0;
+	}
+	event.events=EPOLLIN;
+	event.data.fd=listenfd;
+	epoll_ctl(epollfd,EPOLL_CTL_ADD,listenfd,&event);
+	return 1;
+}
+
+static int serve(const char* path, const char* ring, int fromoldest){
+	static uint64_t copy[SHM_RECORD_MAX/sizeof(uint64_t)+1];
+	struct epoll_event events[16];
+	struct flexshm shm;
+	struct flexshmreader reader;
+	const struct shmrecord* record;
+	uint64_t lost = 0;
+	int count;
+	int index;
+	int busy = 0;
+	int waiting = 0;
+
+	messages=calloc(retention,sizeof(struct message));
+	epollfd=epoll_create1(EPOLL_CLOEXEC);
+	if(!messages||(epollfd<0))return 1;
+	signal(SIGPIPE,SIG_IGN);
+	signal(SIGINT,onSignal);
+	signal(SIGTERM,onSignal);
+	while(!flexShmOpen(&shm,ring)){
+		if(stop)return 0;
+		if(!waiting)fprintf(stderr,"flexsearch: waiting for %s, is flexbridge running with -r?\n",ring);
+		waiting=1;
+		sleep(1);
+	}
+	flexShmReaderInit(&reader,&shm,fromoldest);
+	if(!listenSocket(path))return 1;
+
+	while(!stop){
+		count=epoll_wait(epollfd,events,16,busy?0:POLL_MS);
+		for(index=0;index<count;index++){
+			if(events[index].data.fd==listenfd){
+				acceptClients();
+			} else if((events[index].data.fd<clientcapacity)&&clients[events[index].data.fd]){
+				if((events[index].events&(EPOLLIN|EPOLLHUP|EPOLLERR))&&!clientRead(clients[events[index].data.fd]))continue;
+				if(events[index].events&EPOLLOUT)clientWrite(clients[events[index].data.fd]);
+			}
+		}
+		// a burst is indexed a few hundred messages at a time, so queries aren't held up by it
+		for(busy=0;(busy<256)&&(record=flexShmRead(&reader,copy,sizeof(copy)));busy++){
+			indexMessage(record);
+		}
+		if(reader.lost!=lost){
+			fprintf(stderr,"flexsearch: %s: lost %llu records\n",ring,(unsigned long long)(reader.lost-lost));
+			lost=reader.lost;
+		}
+		expireOld();
+	}
+	unlink(path);
+	return 0;
+}
+
+// sends a query to the server and shows the answer
+static int query(const char* path, int argc, char** argv){
+	struct sockaddr_un address;
+	char line[INPUT_MAX];
+	char* text = NULL;
+	size_t size = 0;
+	size_t length = 0;
+	FILE* stream;
+	int fd;
+	int arg;
+	for(arg=0;arg<argc;arg++){
+		// words with spaces in them were quoted on the command line
+		length+=snprintf(line+length,sizeof(line)-length,strchr(argv[arg],' ')?"%s\"%s\"":"%s%s",arg?" ":"",argv[arg]);
+		if(length>=sizeof(line)-1){
+			fprintf(stderr,"flexsearch: query too long\n");
+			return 1;
+		}
+	}
+	line[length++]='\n';
+	memset(&address,0,sizeof(address));
+	address.sun_family=AF_UNIX;
+	snprintf(address.sun_path,sizeof(address.sun_path),"%s",path);
+	fd=socket(AF_UNIX,SOCK_STREAM,0);
+	if((fd<0)||connect(fd,(struct sockaddr*)&address,sizeof(address))){
+		perror(path);
+		return 1;
+	}
+	if(write(fd,line,length)!=(ssize_t)length){
+		perror(path);
+		return 1;
+	}
+	// the answer ends with the ok or error line, the results are JSON
+	stream=fdopen(fd,"r");
+	while(getline(&text,&size,stream)>0){
+		fputs(text,stdout);
+		if(text[0]!='{')break;
+	}
+	free(text);
+	fclose(stream);
+	return 0;
+}
+
+static void usage(void){
+	fprintf(stderr,"usage: flexsearch serve [-u socket] [-n messages] [-a hours] [-o] [/flexring]\n");
+	fprintf(stderr,"       flexsearch query [-u socket] <terms>\n");
+}
+
+int main(int argc, char** argv){
+	const char* path = DEFAULT_SOCKET;
+	const char* ring = FLEXSHM_NAME;
+	int fromoldest = 0;
+	int arg;
+
+	if(argc<2){
+		usage();
+		return 1;
+	}
+
+	if(!strcmp(argv[1],"serve")){
+		for(arg=2;arg<argc;arg++){
+			if(!strcmp(argv[arg],"-u")&&(arg+1<argc)){
+				path=argv[++arg];
+			} else if(!strcmp(argv[arg],"-n")&&(arg+1<argc)){
+				retention=strtoull(argv[++arg],NULL,10);
+			} else if(!strcmp(argv[arg],"-a")&&(arg+1<argc)){
+				maxage=(int64_t)(strtod(argv[++arg],NULL)*3600)*NS;
+			} else if(!strcmp(argv[arg],"-o")){
+				fromoldest=1;
+			} else {
+				ring=argv[arg];
+			}
+		}
+		if(retention<16)retention=16;
+		return serve(path,ring,fromoldest);
+	}
+
+	if(!strcmp(argv[1],"query")){
+		arg=2;
+		if((argc>3)&&!strcmp(argv[2],"-u")){
+			path=argv[3];
+			arg=4;
+		}
+		if(arg>=argc){
+			usage();
+			return 1;
+		}
+		return query(path,argc-arg,argv+arg);
+	}
+
+	usage();
+	return 1;
+}
@@ -0,0 +1,281 @@
+/*
+ * flexshm.c
+ *
+ * Shared memory ring, see flexshm.h
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "flexshm.h"
+
+#define SHM_MAGIC 0x474E5246UL
+#define SHM_VERSION 1
+
+#define ALIGN(length) (((length)+15)&~(uint64_t)15)
+
+static int futex(uint32_t* address, int operation, uint32_t value, const struct timespec* timeout){
+	return syscall(SYS_futex,address,operation,value,timeout,NULL,0);
+}
+
+static int attach(struct flexshm* shm, int fd, int writable){
+	struct stat st;
+	void* map;
+	if(fstat(fd,&st)||(st.st_size<(off_t)sizeof(struct shmheader)))return 0;
+	map=mmap(NULL,st.st_size,writable?PROT_READ|PROT_WRITE:PROT_READ,MAP_SHARED,fd,0);
+	if(map==MAP_FAILED)return 0;
+	shm->header=map;
+	shm->ring=(uint8_t*)map+sizeof(struct shmheader);
+	shm->mapped=st.st_size;
+	shm->size=st.st_size-sizeof(struct shmheader);
+	shm->writable=writable;
+	return 1;
+}
+
+int flexShmCreate(struct flexshm* shm, const char* name, uint64_t size){
+	struct shmheader* header;
+	int fd;
+	size=ALIGN(size);
+	fd=shm_open(name,O_RDWR|O_CREAT,0644);
+	if(fd<0)return 0;
+	if(attach(shm,fd,1)){
+		header=shm->header;
+		if((header->magic==SHM_MAGIC)&&(header->version==SHM_VERSION)&&(header->size==size)&&(shm->size==size)){
+			// taken over from an earlier writer, readers carry on
+			close(fd);
+			return 1;
+		}
+		munmap(shm->header,shm->mapped);
+		// a new segment, readers of the old one don't see anything anymore
+		close(fd);
+		shm_unlink(name);
+		fd=shm_open(name,O_RDWR|O_CREAT|O_EXCL,0644);
+		if(fd<0)return 0;
+	}
+	if(ftruncate(fd,sizeof(struct shmheader)+size)||!attach(shm,fd,1)){
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	header=shm->header;
+	memset(header,0,sizeof(struct shmheader));
+	header->version=SHM_VERSION;
+	header->size=size;
+	__atomic_store_n(&header->magic,SHM_MAGIC,__ATOMIC_RELEASE);
+	return 1;
+}
+
+int flexShmOpen(struct flexshm* shm, const char* name){
+	int fd;
+	int writable = 1;
+	// readers only write the waiter count
+	fd=shm_open(name,O_RDWR,0);
+	if(fd<0){
+		writable=0;
+		fd=shm_open(name,O_RDONLY,0);
+		if(fd<0)return 0;
+	}
+	if(!attach(shm,fd,writable)){
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	if((__atomic_load_n(&shm->header->magic,__ATOMIC_ACQUIRE)!=SHM_MAGIC)||(shm->header->version!=SHM_VERSION)||
+			(shm->header->size!=shm->size)){
+		munmap(shm->header,shm->mapped);
+		return 0;
+	}
+	return 1;
+}
+
+// moves the tail past the records that the writer is about to overwrite, and announces that it will
+static void reserve(struct flexshm* shm, uint64_t end){
+	struct shmheader* header = shm->header;
+	uint64_t tail = header->tail;
+	while(end-tail>shm->size){
+		tail+=((struct shmrecord*)(shm->ring+tail%shm->size))->length;
+	}
+	__atomic_store_n(&header->tail,tail,__ATOMIC_RELEASE);
+	__atomic_store_n(&header->reserve,end,__ATOMIC_RELAXED);
+	// the reserve has to be visible before anything in the ring changes
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void flexShmPublish(struct flexshm* shm, const struct flexitem* item, uint8_t cycle, uint8_t frame){
+	struct shmheader* header = shm->header;
+	struct shmrecord* record;
+	struct timespec ts;
+	uint64_t position = header->head;
+	uint64_t pad;
+	uint64_t length;
+	uint16_t addresses = item->addresscount;
+	size_t textlength = (item->textlength<0xFFFF)?item->textlength:0xFFFF;
+	size_t payloadlength = (item->payloadlength<0xFFFF)?item->payloadlength:0xFFFF;
+	uint8_t* data;
+
+	length=ALIGN(sizeof(struct shmrecord)+addresses*sizeof(uint64_t)+textlength+payloadlength);
+	if(length>shm->size/2)return;
+	pad=(position%shm->size+length>shm->size)?shm->size-position%shm->size:0;
+	reserve(shm,position+pad+length);
+	if(pad){
+		record=(struct shmrecord*)(shm->ring+position%shm->size);
+		record->length=pad;
+		record->type=SHM_PAD;
+		position+=pad;
+	}
+	clock_gettime(CLOCK_REALTIME,&ts);
+	record=(struct shmrecord*)(shm->ring+position%shm->size);
+	record->length=length;
+	record->type=item->type;
+	record->cycle=cycle;
+	record->frame=frame;
+	record->flags=(item->priority?SHM_PRIORITY:0)|(item->truncated?SHM_TRUNCATED:0)|(item->payloadhex?SHM_PAYLOADHEX:0);
+	record->addresscount=addresses;
+	record->textlength=textlength;
+	record->payloadlength=payloadlength;
+	record->reserved=0;
+	record->sequence=header->sequence;
+	record->time=ts.tv_sec*1000000000ULL+ts.tv_nsec;
+	data=(uint8_t*)(record+1);
+	memcpy(data,item->capcode,addresses*sizeof(uint64_t));
+	data+=addresses*sizeof(uint64_t);
+	if(textlength)memcpy(data,item->text,textlength);
+	data+=textlength;
+	if(payloadlength)memcpy(data,item->payload,payloadlength);
+
+	__atomic_store_n(&header->sequence,header->sequence+1,__ATOMIC_RELAXED);
+	__atomic_store_n(&header->head,position+length,__ATOMIC_RELEASE);
+	__atomic_add_fetch(&header->event,1,__ATOMIC_SEQ_CST);
+	// only a reader that went to sleep costs a system call
+	if(__atomic_load_n(&header->waiters,__ATOMIC_SEQ_CST))futex(&header->event,FUTEX_WAKE,INT32_MAX,NULL);
+}
+
+void flexShmReaderInit(struct flexshmreader* reader, struct flexshm* shm, int oldest){
+	reader->shm=shm;
+	reader->position=__atomic_load_n(oldest?&shm->header->tail:&shm->header->head,__ATOMIC_ACQUIRE);
+	reader->current=reader->position;
+	reader->sequence=READER_UNKNOWN;
+	reader->lost=0;
+}
+
+// 1 if the writer got to position
+static int overrun(struct flexshmreader* reader, uint64_t position){
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&reader->shm->header->reserve,__ATOMIC_RELAXED)-position>reader->shm->size;
+}
+
+const struct shmrecord* flexShmNext(struct flexshmreader* reader){
+	struct flexshm* shm = reader->shm;
+	const struct shmrecord* record;
+	uint64_t head;
+	uint64_t offset;
+	uint32_t length;
+	uint8_t type;
+	uint64_t sequence;
+	while(1){
+		head=__atomic_load_n(&shm->header->head,__ATOMIC_ACQUIRE);
+		if(reader->position==head)return NULL;
+		offset=reader->position%shm->size;
+		record=(const struct shmrecord*)(shm->ring+offset);
+		length=record->length;
+		type=record->type;
+		// a pad at the end of the ring only has the length and the type
+		sequence=((type==SHM_PAD)||(offset+sizeof(struct shmrecord)>shm->size))?0:record->sequence;
+		// the record is only looked at after the check, it may have been half overwritten
+		if(overrun(reader,reader->position)||(length<16)||(offset+length>shm->size)){
+			// carry on from the oldest record, the sequence numbers tell how many were missed
+			reader->position=__atomic_load_n(&shm->header->tail,__ATOMIC_ACQUIRE);
+			continue;
+		}
+		if(type==SHM_PAD){
+			reader->position+=length;
+			continue;
+		}
+		if((reader->sequence!=READER_UNKNOWN)&&(sequence>reader->sequence))reader->lost+=sequence-reader->sequence;
+		reader->sequence=sequence+1;
+		reader->current=reader->position;
+		reader->position+=length;
+		return record;
+	}
+}
+
+int flexShmCheck(struct flexshmreader* reader){
+	if(!overrun(reader,reader->current))return 1;
+	reader->lost++;
+	return 0;
+}
+
+const struct shmrecord* flexShmRead(struct flexshmreader* reader, void* buffer, size_t max){
+	const struct shmrecord* record;
+	size_t length;
+	while((record=flexShmNext(reader))){
+		// the length as it was checked, the one in the record can change while it's copied
+		length=reader->position-reader->current;
+		if(length>max){
+			reader->lost++;
+			continue;
+		}
+		memcpy(buffer,record,length);
+		if(flexShmCheck(reader))return buffer;
+	}
+	return NULL;
+}
+
+int flexShmWait(struct flexshmreader* reader, int timeout){
+	struct shmheader* header = reader->shm->header;
+	struct timespec ts;
+	uint32_t event;
+	int spin;
+	// a short spin first, new records usually come in bursts
+	for(spin=0;spin<1000;spin++){
+		if(__atomic_load_n(&header->head,__ATOMIC_ACQUIRE)!=reader->position)return 1;
+	}
+	if(!timeout)return 0;
+	ts.tv_sec=timeout/1000;
+	ts.tv_nsec=(timeout%1000)*1000000L;
+	if(!reader->shm->writable){
+		// read only, polls instead of sleeping on the futex
+		if((timeout<0)||(timeout>10)){
+			ts.tv_sec=0;
+			ts.tv_nsec=10000000L;
+		}
+		nanosleep(&ts,NULL);
+		return __atomic_load_n(&header->head,__ATOMIC_ACQUIRE)!=reader->position;
+	}
+	event=__atomic_load_n(&header->event,__ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&header->waiters,1,__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&header->head,__ATOMIC_SEQ_CST)==reader->position){
+		futex(&header->event,FUTEX_WAIT,event,(timeout<0)?NULL:&ts);
+	}
+	__atomic_sub_fetch(&header->waiters,1,__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&header->head,__ATOMIC_ACQUIRE)!=reader->position;
+}
+
+void flexShmItem(const struct shmrecord* record, struct flexitem* item){
+	const uint8_t* data = (const uint8_t*)(record+1);
+	item->type=record->type;
+	item->raw=NULL;
+	item->rawlength=0;
+	item->cycle=record->cycle;
+	item->frame=record->frame;
+	item->priority=(record->flags&SHM_PRIORITY)!=0;
+	item->truncated=(record->flags&SHM_TRUNCATED)!=0;
+	item->payloadhex=(record->flags&SHM_PAYLOADHEX)!=0;
+	item->addresscount=(record->addresscount<ITEM_ADDRESSES)?record->addresscount:ITEM_ADDRESSES;
+	memcpy(item->capcode,data,item->addresscount*sizeof(uint64_t));
+	data+=record->addresscount*sizeof(uint64_t);
+	item->text=(const char*)data;
+	item->textlength=record->textlength;
+	item->payload=data+record->textlength;
+	item->payloadlength=record->payloadlength;
+}
@@ -0,0 +1,117 @@
+/*
+ * flexshm.h
+ *
+ * Ring in shared memory (/dev/shm) through which flexbridge hands the decoded frames and messages to other processes on
+ * the same machine. There is a single writer, which never waits for the readers, and any number of readers, which the
+ * writer doesn't know about. Publishing a record is a copy into the ring and a few stores, without locks or system
+ * calls (a reader sleeping in flexShmWait() is woken with a futex, only when there is one).
+ *
+ * The segment is a header followed by the ring. Records are 16 byte aligned and never wrap: when a record doesn't fit in
+ * front of the end of the ring, the rest of the ring is filled with a pad record. Positions count bytes since the ring
+ * was created, the offset in the ring is position%size.
+ *   head       position behind the last complete record, set after the record is written
+ *   reserve    position up to which the writer may be writing, set before it starts. Everything before reserve-size
+ *              has been overwritten
+ *   tail       position of the oldest record that is still complete
+ * A reader works like a seqlock reader: it reads a record where it is, then checks reserve to see whether the writer
+ * got to it in the meantime. Records are numbered (pads aren't), so a reader that was overrun knows how many records it
+ * missed, and carries on from the tail.
+ *
+ * Build along with the tool that uses it: gcc -O2 -Wall -I"../AVR - FlexDecoder" -o tool tool.c flexshm.c flexstream.c
+ * flexproto.c
+ */
+
+#ifndef FLEXSHM_H_
+#define FLEXSHM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "flexstream.h"
+
+#define FLEXSHM_NAME "/flexring"
+#define FLEXSHM_SIZE (4*1024*1024)
+
+// record types, besides the ITEM_ types
+#define SHM_PAD 0
+
+// record flags
+#define SHM_PRIORITY 0x01
+#define SHM_TRUNCATED 0x02
+#define SHM_PAYLOADHEX 0x04
+
+struct shmheader {
+	uint32_t magic;					// set when the segment is ready
+	uint32_t version;
+	uint64_t size;					// of the ring
+	uint64_t head;					// positions, see above
+	uint64_t reserve;
+	uint64_t tail;
+	uint64_t sequence;				// number of the next record
+	uint32_t event;					// futex, counts records
+	uint32_t waiters;				// readers sleeping on it
+};
+
+// a record, followed by the capcodes, the text and the payload. A pad record only has the first 16 bytes
+struct shmrecord {
+	uint32_t length;				// including this header and the padding behind the record
+	uint8_t type;					// ITEM_FRAME, ITEM_END, ITEM_MESSAGE, ITEM_TELEMETRY or SHM_PAD
+	uint8_t cycle;
+	uint8_t frame;
+	uint8_t flags;
+	uint16_t addresscount;
+	uint16_t textlength;
+	uint16_t payloadlength;
+	uint16_t reserved;
+	uint64_t sequence;
+	uint64_t time;					// when it was published, nanoseconds since the epoch
+};
+
+struct flexshm {
+	struct shmheader* header;
+	uint8_t* ring;
+	uint64_t size;
+	size_t mapped;
+	int writable;					// readers that can't write the waiter count poll instead
+};
+
+struct flexshmreader {
+	struct flexshm* shm;
+	uint64_t position;				// of the next record
+	uint64_t current;				// of the record returned by flexShmNext()
+	uint64_t sequence;				// number of the next record, READER_UNKNOWN before the first one
+	uint64_t lost;					// records missed by being overrun
+};
+
+#define READER_UNKNOWN UINT64_MAX
+
+/** Creates (or takes over) the segment, as the writer. Returns 0 on failure */
+int flexShmCreate(struct flexshm* shm, const char* name, uint64_t size);
+
+/** Attaches to the segment as a reader. Returns 0 on failure */
+int flexShmOpen(struct flexshm* shm, const char* name);
+
+/** Writes an item to the ring. cycle and frame are those of the frame the item is from */
+void flexShmPublish(struct flexshm* shm, const struct flexitem* item, uint8_t cycle, uint8_t frame);
+
+/** Starts reading at the oldest record in the ring (oldest set) or at the next one to be published */
+void flexShmReaderInit(struct flexshmreader* reader, struct flexshm* shm, int oldest);
+
+/** Returns the next record where it is in the ring, or NULL if there is none. The record has to be checked with
+ *  flexShmCheck() after it was used */
+const struct shmrecord* flexShmNext(struct flexshmreader* reader);
+
+/** Returns 1 if the record returned by flexShmNext() wasn't overwritten while it was used. If it was, it's counted as
+ *  lost */
+int flexShmCheck(struct flexshmreader* reader);
+
+/** Copies the next record into buffer (of max bytes). Returns the record, or NULL if there is none */
+const struct shmrecord* flexShmRead(struct flexshmreader* reader, void* buffer, size_t max);
+
+/** Waits up to timeout ms (-1 forever) for a record to be published. Returns 1 if there is one */
+int flexShmWait(struct flexshmreader* reader, int timeout);
+
+/** Fills in an item from a record, the item points into the record */
+void flexShmItem(const struct shmrecord* record, struct flexitem* item);
+
+#endif /* FLEXSHM_H_ */
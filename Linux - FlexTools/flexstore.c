@@ -0,0 +1,876 @@
+/*
+ * flexstore.c
+ *
+ * Keeps the decoded messages that flexbridge publishes in its shared memory ring (see flexshm.h) in an append-only log
+ * on disk, with an index by capcode and time, so "everything for capcode 1234567 last week" is answered by reading only
+ * the messages that match, also over months of messages.
+ *
+ * The log is a directory of segments, NNNNNNNN.log, of up to 16 MB (-S). A segment is a header followed by the message
+ * records: the time the message was published, the channel (which ring it came from), the cycle and frame number, the
+ * flags, the capcodes, the text and the payload, and a checksum. Records are only ever appended, after every burst of
+ * messages with a single write. A segment that is full is sealed: it's synced, and its index is written next to it in
+ * NNNNNNNN.idx, with
+ *   entries    capcode, time bucket (a minute) and offset of every address of every message, sorted by capcode and time
+ *   buckets    the offset of the first record of every time bucket
+ * Queries map the index files and binary search them. The segment that is being written doesn't have an index yet, and
+ * is scanned.
+ *
+ * New segments and index files are written under a .tmp name and renamed once they're complete, so a segment that has an
+ * index is always sealed. At startup the segment that was being written is checked record by record and cut off behind
+ * the last complete one, and a full segment that didn't get its index (a crash while it was sealed) gets it then. The
+ * segment that is being written is synced every 5 seconds.
+ *
+ * Build: gcc -O2 -Wall -I"../AVR - FlexDecoder" -o flexstore flexstore.c flexshm.c flexstream.c flexproto.c
+ * Usage: flexstore store <dir> [-S segmentbytes] [-a days] [-o] [/flexring ...]
+ *        flexstore query <dir> [-r capcode] [-s from] [-e to] [-c channel]   (times in seconds since the epoch)
+ * store reads one ring per channel (one flexbridge per receiver), the channel is the position of the ring on the command
+ * line, from 0. -a removes sealed segments older than that many days, -o starts at the oldest record in the rings
+ * instead of the next one. Query output uses the [[frame]]/[[msg]] format of the decoder, the frame line has the time
+ * the message was received.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flexshm.h"
+
+#define SEGMENT_MAGIC 0x474F4C46UL
+#define INDEX_MAGIC 0x58444946UL
+#define STORE_VERSION 1
+
+#define DEFAULT_SEGMENT (16*1024*1024)
+// offsets in the index are 32 bits
+#define MAX_SEGMENT (1024*1024*1024)
+#define BUCKET_SECONDS 60
+#define SYNC_SECONDS 5
+#define WRITE_BUFFER (256*1024)
+#define MAX_RINGS 16
+
+// largest record that comes out of the ring
+#define SHM_RECORD_MAX (sizeof(struct shmrecord)+ITEM_ADDRESSES*sizeof(uint64_t)+2*0xFFFF+16)
+
+#define ALIGN8(length) (((length)+7)&~(size_t)7)
+
+#define NS 1000000000LL
+
+struct segmentheader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t number;
+	uint32_t bucket;				// seconds per time bucket
+	int64_t created;				// nanoseconds since the epoch
+	uint64_t reserved;
+};
+
+// a message, followed by the capcodes, the text and the payload, padded to 8 bytes
+struct logrecord {
+	uint32_t length;				// including this header and the padding
+	uint32_t checksum;				// of the whole record, except itself
+	int64_t time;					// when flexbridge published the message, nanoseconds since the epoch
+	uint8_t channel;
+	uint8_t cycle;
+	uint8_t frame;
+	uint8_t flags;					// SHM_PRIORITY, SHM_TRUNCATED, SHM_PAYLOADHEX
+	uint16_t addresscount;
+	uint16_t textlength;
+	uint16_t payloadlength;
+	uint16_t reserved;
+	uint32_t reserved2;
+};
+
+struct indexheader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t length;				// of the sealed segment
+	int64_t first;					// earliest and latest time of a record in it
+	int64_t last;
+	uint64_t entries;
+	uint64_t buckets;
+};
+
+struct indexentry {
+	uint64_t capcode;
+	uint32_t bucket;
+	uint32_t offset;
+};
+
+struct bucketentry {
+	uint32_t bucket;
+	uint32_t offset;
+};
+
+struct store {
+	const char* dir;
+	uint64_t segmentsize;
+	int days;
+	int fd;
+	uint32_t number;				// of the segment that is written
+	uint64_t length;				// of that segment, including what's still in the buffer
+	uint64_t written;				// of which is in the file
+	int dirty;						// written since the last sync
+	int64_t synced;
+	uint8_t* buffer;
+	// the index of the segment that is written, it's written out when the segment is sealed
+	uint64_t records;
+	int64_t first;
+	int64_t last;
+	struct indexentry* entries;
+	size_t entrycount;
+	size_t entrymax;
+	struct bucketentry* buckets;
+	size_t bucketcount;
+	size_t bucketmax;
+};
+
+struct query {
+	uint64_t capcode;
+	int filtered;
+	int channel;					// -1 for all
+	int64_t from;					// nanoseconds
+	int64_t to;
+	uint32_t frombucket;			// a bucket wider, records of several channels aren't exactly in order
+	uint32_t tobucket;
+	int framestarted;
+	uint8_t framechannel;
+	uint8_t cycle;
+	uint8_t frame;
+	int64_t frametime;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static int64_t now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+	return ts.tv_sec*NS+ts.tv_nsec;
+}
+
+static void onSignal(int sig){
+	(void)sig;
+	stop=1;
+}
+
+static uint32_t bucketOf(int64_t time){
+	if(time<=0)return 0;
+	if(time/NS/BUCKET_SECONDS>=UINT32_MAX)return UINT32_MAX;
+	return time/NS/BUCKET_SECONDS;
+}
+
+// FNV-1a over the record, without the checksum field
+static uint32_t checksum(const struct logrecord* record){
+	const uint8_t* bytes = (const uint8_t*)record;
+	uint32_t hash = 2166136261UL;
+	uint32_t pos;
+	for(pos=0;pos<record->length;pos++){
+		if((pos>=4)&&(pos<8))continue;
+		hash=(hash^bytes[pos])*16777619UL;
+	}
+	return hash;
+}
+
+// returns the length of the record at offset, 0 if it isn't complete
+static uint32_t validRecord(const uint8_t* segment, uint64_t length, uint64_t offset){
+	const struct logrecord* record = (const struct logrecord*)(segment+offset);
+	if(offset+sizeof(struct logrecord)>length)return 0;
+	if((record->length<sizeof(struct logrecord))||(record->length%8)||(offset+record->length>length))return 0;
+	if(sizeof(struct logrecord)+record->addresscount*sizeof(uint64_t)+record->textlength+record->payloadlength>
+		record->length)return 0;
+	if(checksum(record)!=record->checksum)return 0;
+	return record->length;
+}
+
+static void segmentPath(char* path, size_t max, const char* dir, uint32_t number, const char* suffix){
+	snprintf(path,max,"%s/%08x.%s",dir,number,suffix);
+}
+
+static int hasIndex(const char* dir, uint32_t number){
+	char path[4096];
+	struct stat st;
+	segmentPath(path,sizeof(path),dir,number,"idx");
+	return !stat(path,&st);
+}
+
+static void syncDir(const char* dir){
+	int fd = open(dir,O_RDONLY|O_DIRECTORY);
+	if(fd<0)return;
+	fsync(fd);
+	close(fd);
+}
+
+static int writeAll(int fd, const void* data, size_t length){
+	const uint8_t* bytes = data;
+	ssize_t result;
+	while(length){
+		result=write(fd,bytes,length);
+		if(result<=0)return 0;
+		bytes+=result;
+		length-=result;
+	}
+	return 1;
+}
+
+static int compareNumbers(const void* a, const void* b){
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x>y)-(x<y);
+}
+
+// the numbers of the segments in dir, in order. Leftover .tmp files are removed when clean is set
+static uint32_t* listSegments(const char* dir, size_t* count, int clean){
+	DIR* d;
+	struct dirent* entry;
+	char path[4096];
+	uint32_t* numbers = NULL;
+	size_t max = 0;
+	unsigned int number;
+	char suffix[8];
+	*count=0;
+	d=opendir(dir);
+	if(!d){
+		perror(dir);
+		return NULL;
+	}
+	while((entry=readdir(d))){
+		if(clean&&strstr(entry->d_name,".tmp")){
+			snprintf(path,sizeof(path),"%s/%s",dir,entry->d_name);
+			unlink(path);
+			continue;
+		}
+		if((strlen(entry->d_name)!=12)||(sscanf(entry->d_name,"%8x.%3s",&number,suffix)!=2)||strcmp(suffix,"log"))continue;
+		if(*count==max){
+			max=max*2+64;
+			numbers=realloc(numbers,max*sizeof(uint32_t));
+		}
+		numbers[(*count)++]=number;
+	}
+	closedir(d);
+	if(!numbers)numbers=malloc(sizeof(uint32_t));
+	qsort(numbers,*count,sizeof(uint32_t),compareNumbers);
+	return numbers;
+}
+
+static void resetIndex(struct store* store){
+	store->records=0;
+	store->first=0;
+	store->last=0;
+	store->entrycount=0;
+	store->bucketcount=0;
+}
+
+static int indexRecord(struct store* store, const struct logrecord* record, uint32_t offset){
+	const uint64_t* capcode = (const uint64_t*)(record+1);
+	uint32_t bucket = bucketOf(record->time);
+	uint16_t count;
+	if(store->entrycount+record->addresscount>store->entrymax){
+		store->entrymax=store->entrymax*2+record->addresscount+1024;
+		store->entries=realloc(store->entries,store->entrymax*sizeof(struct indexentry));
+		if(!store->entries)return 0;
+	}
+	for(count=0;count<record->addresscount;count++){
+		store->entries[store->entrycount].capcode=capcode[count];
+		store->entries[store->entrycount].bucket=bucket;
+		store->entries[store->entrycount].offset=offset;
+		store->entrycount++;
+	}
+	// records of several channels can be a little out of order, a bucket starts at the first record that is in it
+	if(!store->bucketcount||(bucket>store->buckets[store->bucketcount-1].bucket)){
+		if(store->bucketcount==store->bucketmax){
+			store->bucketmax=store->bucketmax*2+256;
+			store->buckets=realloc(store->buckets,store->bucketmax*sizeof(struct bucketentry));
+			if(!store->buckets)return 0;
+		}
+		store->buckets[store->bucketcount].bucket=bucket;
+		store->buckets[store->bucketcount].offset=offset;
+		store->bucketcount++;
+	}
+	if(!store->records||(record->time<store->first))store->first=record->time;
+	if(!store->records||(record->time>store->last))store->last=record->time;
+	store->records++;
+	return 1;
+}
+
+// indexes the complete records of a segment, returns the offset behind the last one, 0 if it isn't a segment
+static uint64_t scanSegment(struct store* store, int fd){
+	struct stat st;
+	uint8_t* map;
+	const struct segmentheader* header;
+	uint64_t offset;
+	uint32_t length;
+	if(fstat(fd,&st)||(st.st_size<(off_t)sizeof(struct segmentheader)))return 0;
+	map=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	if(map==MAP_FAILED)return 0;
+	header=(const struct segmentheader*)map;
+	if((header->magic!=SEGMENT_MAGIC)||(header->version!=STORE_VERSION)){
+		munmap(map,st.st_size);
+		return 0;
+	}
+	offset=sizeof(struct segmentheader);
+	while((length=validRecord(map,st.st_size,offset))){
+		if(!indexRecord(store,(const struct logrecord*)(map+offset),offset))break;
+		offset+=length;
+	}
+	munmap(map,st.st_size);
+	return offset;
+}
+
+static int compareEntries(const void* a, const void* b){
+	const struct indexentry* x = a;
+	const struct indexentry* y = b;
+	if(x->capcode!=y->capcode)return (x->capcode>y->capcode)?1:-1;
+	if(x->bucket!=y->bucket)return (x->bucket>y->bucket)?1:-1;
+	return (x->offset>y->offset)-(x->offset<y->offset);
+}
+
+static int writeIndex(struct store* store, uint32_t number, uint64_t length){
+	char path[4096];
+	char temp[4096];
+	struct indexheader header;
+	int fd;
+	segmentPath(path,sizeof(path),store->dir,number,"idx");
+	segmentPath(temp,sizeof(temp),store->dir,number,"idx.tmp");
+	qsort(store->entries,store->entrycount,sizeof(struct indexentry),compareEntries);
+	memset(&header,0,sizeof(header));
+	header.magic=INDEX_MAGIC;
+	header.version=STORE_VERSION;
+	header.length=length;
+	header.first=store->first;
+	header.last=store->last;
+	header.entries=store->entrycount;
+	header.buckets=store->bucketcount;
+	fd=open(temp,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if(fd<0){
+		perror(temp);
+		return 0;
+	}
+	if(!writeAll(fd,&header,sizeof(header))||!writeAll(fd,store->entries,store->entrycount*sizeof(struct indexentry))||
+		!writeAll(fd,store->buckets,store->bucketcount*sizeof(struct bucketentry))||fsync(fd)||close(fd)||
+		rename(temp,path)){
+		perror(temp);
+		unlink(temp);
+		return 0;
+	}
+	syncDir(store->dir);
+	return 1;
+}
+
+static int createSegment(struct store* store, uint32_t number){
+	char path[4096];
+	char temp[4096];
+	struct segmentheader header;
+	int fd;
+	segmentPath(path,sizeof(path),store->dir,number,"log");
+	segmentPath(temp,sizeof(temp),store->dir,number,"log.tmp");
+	memset(&header,0,sizeof(header));
+	header.magic=SEGMENT_MAGIC;
+	header.version=STORE_VERSION;
+	header.number=number;
+	header.bucket=BUCKET_SECONDS;
+	header.created=now();
+	fd=open(temp,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if(fd<0){
+		perror(temp);
+		return 0;
+	}
+	if(!writeAll(fd,&header,sizeof(header))||fsync(fd)||close(fd)||rename(temp,path)){
+		perror(temp);
+		unlink(temp);
+		return 0;
+	}
+	syncDir(store->dir);
+	store->fd=open(path,O_RDWR);
+	if(store->fd<0){
+		perror(path);
+		return 0;
+	}
+	store->number=number;
+	store->length=sizeof(header);
+	store->written=sizeof(header);
+	store->dirty=0;
+	store->synced=now();
+	resetIndex(store);
+	return 1;
+}
+
+// removes the sealed segments of which the latest record is older than the retention
+static void removeOld(struct store* store){
+	char path[4096];
+	struct indexheader header;
+	uint32_t* numbers;
+	size_t count;
+	size_t pos;
+	int64_t limit;
+	int fd;
+	if(!store->days)return;
+	limit=now()-(int64_t)store->days*86400*NS;
+	numbers=listSegments(store->dir,&count,0);
+	if(!numbers)return;
+	for(pos=0;pos<count;pos++){
+		if(numbers[pos]==store->number)continue;
+		segmentPath(path,sizeof(path),store->dir,numbers[pos],"idx");
+		fd=open(path,O_RDONLY);
+		if(fd<0)continue;
+		if((pread(fd,&header,sizeof(header),0)==sizeof(header))&&(header.magic==INDEX_MAGIC)&&(header.last<limit)){
+			// the segment first, an index without a segment is ignored
+			segmentPath(path,sizeof(path),store->dir,numbers[pos],"log");
+			unlink(path);
+			segmentPath(path,sizeof(path),store->dir,numbers[pos],"idx");
+			unlink(path);
+		}
+		close(fd);
+	}
+	free(numbers);
+}
+
+static int flushStore(struct store* store){
+	size_t length = store->length-store->written;
+	if(!length)return 1;
+	if(pwrite(store->fd,store->buffer,length,store->written)!=(ssize_t)length){
+		perror(store->dir);
+		return 0;
+	}
+	store->written+=length;
+	store->dirty=1;
+	return 1;
+}
+
+static int syncStore(struct store* store){
+	if(!store->dirty)return 1;
+	if(fdatasync(store->fd)){
+		perror(store->dir);
+		return 0;
+	}
+	store->dirty=0;
+	store->synced=now();
+	return 1;
+}
+
+static int sealSegment(struct store* store){
+	if(!flushStore(store)||!syncStore(store))return 0;
+	close(store->fd);
+	if(!writeIndex(store,store->number,store->length))return 0;
+	removeOld(store);
+	return createSegment(store,store->number+1);
+}
+
+// carries on with the last segment, or starts the first one
+static int openStore(struct store* store){
+	char path[4096];
+	uint32_t* numbers;
+	size_t count;
+	size_t pos;
+	uint64_t length;
+	int fd;
+	mkdir(store->dir,0755);
+	numbers=listSegments(store->dir,&count,1);
+	if(!numbers)return 0;
+	for(pos=0;pos<count;pos++){
+		if(hasIndex(store->dir,numbers[pos]))continue;
+		segmentPath(path,sizeof(path),store->dir,numbers[pos],"log");
+		fd=open(path,O_RDWR);
+		if(fd<0){
+			perror(path);
+			continue;
+		}
+		resetIndex(store);
+		length=scanSegment(store,fd);
+		if(!length){
+			fprintf(stderr,"flexstore: %s: not a segment, skipped\n",path);
+			close(fd);
+			continue;
+		}
+		if(pos<count-1){
+			// full, it was being sealed when flexstore stopped
+			fprintf(stderr,"flexstore: %s: indexed\n",path);
+			close(fd);
+			if(!writeIndex(store,numbers[pos],length))break;
+			continue;
+		}
+		// the segment that was being written, anything behind the last complete record goes
+		if(ftruncate(fd,length)){
+			perror(path);
+			close(fd);
+			break;
+		}
+		store->fd=fd;
+		store->number=numbers[pos];
+		store->length=length;
+		store->written=length;
+		store->dirty=1;
+		store->synced=now();
+		fprintf(stderr,"flexstore: carrying on with %s, %llu messages\n",path,(unsigned long long)store->records);
+		free(numbers);
+		removeOld(store);
+		return 1;
+	}
+	length=count?numbers[count-1]+1:1;
+	free(numbers);
+	if(!createSegment(store,length))return 0;
+	removeOld(store);
+	return 1;
+}
+
+static int append(struct store* store, uint8_t channel, const struct shmrecord* shmrecord){
+	struct flexitem item;
+	struct logrecord* record;
+	size_t length;
+	uint8_t* data;
+	flexShmItem(shmrecord,&item);
+	if(item.type!=ITEM_MESSAGE)return 1;
+	length=ALIGN8(sizeof(struct logrecord)+item.addresscount*sizeof(uint64_t)+item.textlength+item.payloadlength);
+	if(store->records&&(store->length+length>store->segmentsize)&&!sealSegment(store))return 0;
+	if((store->length-store->written+length>WRITE_BUFFER)&&!flushStore(store))return 0;
+
+	record=(struct logrecord*)(store->buffer+(store->length-store->written));
+	memset(record,0,length);
+	record->length=length;
+	record->time=shmrecord->time;
+	record->channel=channel;
+	record->cycle=item.cycle;
+	record->frame=item.frame;
+	record->flags=shmrecord->flags;
+	record->addresscount=item.addresscount;
+	record->textlength=item.textlength;
+	record->payloadlength=item.payloadlength;
+	data=(uint8_t*)(record+1);
+	memcpy(data,item.capcode,item.addresscount*sizeof(uint64_t));
+	data+=item.addresscount*sizeof(uint64_t);
+	if(item.textlength)memcpy(data,item.text,item.textlength);
+	data+=item.textlength;
+	if(item.payloadlength)memcpy(data,item.payload,item.payloadlength);
+	record->checksum=checksum(record);
+
+	if(!indexRecord(store,record,store->length))return 0;
+	store->length+=length;
+	return 1;
+}
+
+static int store(struct store* store, const char** rings, int ringcount, int oldest){
+	static struct flexshm shm[MAX_RINGS];
+	static struct flexshmreader readers[MAX_RINGS];
+	static uint64_t copy[SHM_RECORD_MAX/sizeof(uint64_t)+1];
+	uint64_t lost[MAX_RINGS];
+	const struct shmrecord* record;
+	int ring;
+	int waiting = 0;
+
+	store->buffer=malloc(WRITE_BUFFER);
+	if(!store->buffer||!openStore(store))return 1;
+	signal(SIGINT,onSignal);
+	signal(SIGTERM,onSignal);
+	for(ring=0;ring<ringcount;ring++){
+		// flexbridge may not be running yet
+		while(!flexShmOpen(&shm[ring],rings[ring])){
+			if(stop)return 0;
+			if(!waiting)fprintf(stderr,"flexstore: waiting for %s, is flexbridge running with -r?\n",rings[ring]);
+			waiting=1;
+			sleep(1);
+		}
+		flexShmReaderInit(&readers[ring],&shm[ring],oldest);
+		lost[ring]=0;
+	}
+
+	while(!stop){
+		for(ring=0;ring<ringcount;ring++){
+			while((record=flexShmRead(&readers[ring],copy,sizeof(copy)))){
+				if(!append(store,ring,record))return 1;
+			}
+			if(readers[ring].lost!=lost[ring]){
+				fprintf(stderr,"flexstore: %s: lost %llu records\n",rings[ring],
+					(unsigned long long)(readers[ring].lost-lost[ring]));
+				lost[ring]=readers[ring].lost;
+			}
+		}
+		// a write per burst, a sync every few seconds
+		if(!flushStore(store))return 1;
+		if((now()-store->synced>SYNC_SECONDS*NS)&&!syncStore(store))return 1;
+		// with several rings, the others are looked at every 10 ms
+		flexShmWait(&readers[0],(ringcount>1)?10:1000);
+	}
+	if(!flushStore(store)||!syncStore(store))return 1;
+	close(store->fd);
+	free(store->buffer);
+	free(store->entries);
+	free(store->buckets);
+	return 0;
+}
+
+static void itemFromRecord(const struct logrecord* record, struct flexitem* item){
+	const uint8_t* data = (const uint8_t*)(record+1);
+	memset(item,0,sizeof(*item));
+	item->type=ITEM_MESSAGE;
+	item->cycle=record->cycle;
+	item->frame=record->frame;
+	item->priority=(record->flags&SHM_PRIORITY)!=0;
+	item->truncated=(record->flags&SHM_TRUNCATED)!=0;
+	item->payloadhex=(record->flags&SHM_PAYLOADHEX)!=0;
+	item->addresscount=(record->addresscount<ITEM_ADDRESSES)?record->addresscount:ITEM_ADDRESSES;
+	memcpy(item->capcode,data,item->addresscount*sizeof(uint64_t));
+	data+=record->addresscount*sizeof(uint64_t);
+	item->text=(const char*)data;
+	item->textlength=record->textlength;
+	item->payload=data+record->textlength;
+	item->payloadlength=record->payloadlength;
+}
+
+static void endFrame(struct query* query){
+	if(query->framestarted)printf("[[/frame]]\n\r");
+	query->framestarted=0;
+}
+
+static void outputRecord(struct query* query, const struct logrecord* record){
+	static char text[4*65536];
+	const uint64_t* capcode = (const uint64_t*)(record+1);
+	struct flexitem item;
+	uint16_t count;
+	size_t length;
+	if((record->time<query->from)||(record->time>query->to))return;
+	if((query->channel>=0)&&(record->channel!=query->channel))return;
+	if(query->filtered){
+		for(count=0;count<record->addresscount;count++){
+			if(capcode[count]==query->capcode)break;
+		}
+		if(count==record->addresscount)return;
+	}
+	// messages of the same frame go together, a frame lasts 1.875 seconds
+	if(!query->framestarted||(record->channel!=query->framechannel)||(record->cycle!=query->cycle)||
+		(record->frame!=query->frame)||(record->time-query->frametime>2*NS)||(query->frametime-record->time>2*NS)){
+		endFrame(query);
+		printf("[[frame]]%u|%u|%lld\n\r",record->cycle,record->frame,(long long)(record->time/NS));
+		query->framestarted=1;
+		query->framechannel=record->channel;
+		query->cycle=record->cycle;
+		query->frame=record->frame;
+		query->frametime=record->time;
+	}
+	itemFromRecord(record,&item);
+	length=flexFormatItem(&item,text,sizeof(text));
+	fwrite(text,1,length,stdout);
+}
+
+static const uint8_t* mapFile(const char* path, size_t* length){
+	struct stat st;
+	uint8_t* map;
+	int fd = open(path,O_RDONLY);
+	if(fd<0){
+		perror(path);
+		return NULL;
+	}
+	if(fstat(fd,&st)||(st.st_size<(off_t)sizeof(struct segmentheader))){
+		close(fd);
+		return NULL;
+	}
+	map=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(map==MAP_FAILED)return NULL;
+	*length=st.st_size;
+	return map;
+}
+
+// the records from offset on, until the end of the segment or the end of the query
+static void scanRecords(struct query* query, const uint8_t* segment, uint64_t length, uint64_t offset){
+	const struct logrecord* record;
+	uint32_t recordlength;
+	while((recordlength=validRecord(segment,length,offset))){
+		record=(const struct logrecord*)(segment+offset);
+		if(bucketOf(record->time)>query->tobucket)break;
+		outputRecord(query,record);
+		offset+=recordlength;
+	}
+}
+
+static void querySealed(struct query* query, const char* dir, uint32_t number){
+	char path[4096];
+	const uint8_t* index;
+	const uint8_t* segment;
+	const struct indexheader* header;
+	const struct indexentry* entries;
+	const struct bucketentry* buckets;
+	size_t indexlength;
+	size_t segmentlength;
+	size_t low;
+	size_t high;
+	size_t middle;
+	uint32_t previous = 0;
+
+	segmentPath(path,sizeof(path),dir,number,"idx");
+	index=mapFile(path,&indexlength);
+	if(!index)return;
+	header=(const struct indexheader*)index;
+	if((header->magic!=INDEX_MAGIC)||(header->version!=STORE_VERSION)||
+		(sizeof(*header)+header->entries*sizeof(struct indexentry)+header->buckets*sizeof(struct bucketentry)>indexlength)){
+		fprintf(stderr,"flexstore: %s: not an index\n",path);
+		munmap((void*)index,indexlength);
+		return;
+	}
+	// the index decides whether the segment is looked at at all
+	if((header->last<query->from)||(header->first>query->to)){
+		munmap((void*)index,indexlength);
+		return;
+	}
+	segmentPath(path,sizeof(path),dir,number,"log");
+	segment=mapFile(path,&segmentlength);
+	if(!segment){
+		munmap((void*)index,indexlength);
+		return;
+	}
+	if(segmentlength>header->length)segmentlength=header->length;
+	entries=(const struct indexentry*)(header+1);
+	buckets=(const struct bucketentry*)(entries+header->entries);
+
+	if(query->filtered){
+		// the first entry of the capcode in the first bucket of the query
+		low=0;
+		high=header->entries;
+		while(low<high){
+			middle=(low+high)/2;
+			if((entries[middle].capcode<query->capcode)||
+				((entries[middle].capcode==query->capcode)&&(entries[middle].bucket<query->frombucket))){
+				low=middle+1;
+			} else {
+				high=middle;
+			}
+		}
+		for(;(low<header->entries)&&(entries[low].capcode==query->capcode)&&(entries[low].bucket<=query->tobucket);low++){
+			// a capcode can be in the address field twice
+			if(entries[low].offset==previous)continue;
+			previous=entries[low].offset;
+			if(validRecord(segment,segmentlength,previous))outputRecord(query,(const struct logrecord*)(segment+previous));
+		}
+	} else {
+		// the last bucket that starts before the query
+		low=0;
+		high=header->buckets;
+		while(low<high){
+			middle=(low+high)/2;
+			if(buckets[middle].bucket<query->frombucket){
+				low=middle+1;
+			} else {
+				high=middle;
+			}
+		}
+		scanRecords(query,segment,segmentlength,low?buckets[low-1].offset:sizeof(struct segmentheader));
+	}
+	munmap((void*)segment,segmentlength);
+	munmap((void*)index,indexlength);
+}
+
+// the segment that is being written has no index yet
+static void queryOpen(struct query* query, const char* dir, uint32_t number){
+	char path[4096];
+	const uint8_t* segment;
+	size_t length;
+	const struct logrecord* record;
+	uint32_t recordlength;
+	uint64_t offset = sizeof(struct segmentheader);
+	segmentPath(path,sizeof(path),dir,number,"log");
+	segment=mapFile(path,&length);
+	if(!segment)return;
+	while((recordlength=validRecord(segment,length,offset))){
+		record=(const struct logrecord*)(segment+offset);
+		outputRecord(query,record);
+		offset+=recordlength;
+	}
+	munmap((void*)segment,length);
+}
+
+static int query(const char* dir, struct query* query){
+	uint32_t* numbers;
+	size_t count;
+	size_t pos;
+	numbers=listSegments(dir,&count,0);
+	if(!numbers)return 1;
+	query->frombucket=bucketOf(query->from);
+	if(query->frombucket)query->frombucket--;
+	query->tobucket=bucketOf(query->to);
+	if(query->tobucket<UINT32_MAX)query->tobucket++;
+	for(pos=0;pos<count;pos++){
+		if(hasIndex(dir,numbers[pos])){
+			querySealed(query,dir,numbers[pos]);
+		} else {
+			queryOpen(query,dir,numbers[pos]);
+		}
+	}
+	endFrame(query);
+	free(numbers);
+	return 0;
+}
+
+static void usage(void){
+	fprintf(stderr,"usage: flexstore store <dir> [-S segmentbytes] [-a days] [-o] [/flexring ...]\n");
+	fprintf(stderr,"       flexstore query <dir> [-r capcode] [-s from] [-e to] [-c channel]\n");
+}
+
+int main(int argc, char** argv){
+	struct store state;
+	struct query request;
+	const char* rings[MAX_RINGS];
+	int ringcount = 0;
+	int oldest = 0;
+	int arg;
+
+	if(argc<3){
+		usage();
+		return 1;
+	}
+
+	if(!strcmp(argv[1],"store")){
+		memset(&state,0,sizeof(state));
+		state.dir=argv[2];
+		state.segmentsize=DEFAULT_SEGMENT;
+		for(arg=3;arg<argc;arg++){
+			if(!strcmp(argv[arg],"-S")&&(arg+1<argc)){
+				state.segmentsize=strtoull(argv[++arg],NULL,10);
+			} else if(!strcmp(argv[arg],"-a")&&(arg+1<argc)){
+				state.days=atoi(argv[++arg]);
+			} else if(!strcmp(argv[arg],"-o")){
+				oldest=1;
+			} else if(ringcount<MAX_RINGS){
+				rings[ringcount++]=argv[arg];
+			}
+		}
+		if(!ringcount)rings[ringcount++]=FLEXSHM_NAME;
+		if(state.segmentsize<65536)state.segmentsize=65536;
+		if(state.segmentsize>MAX_SEGMENT)state.segmentsize=MAX_SEGMENT;
+		return store(&state,rings,ringcount,oldest);
+	}
+
+	if(!strcmp(argv[1],"query")){
+		memset(&request,0,sizeof(request));
+		request.channel=-1;
+		request.from=INT64_MIN;
+		request.to=INT64_MAX;
+		for(arg=3;arg+1<argc;arg+=2){
+			if(!strcmp(argv[arg],"-r")){
+				request.capcode=strtoull(argv[arg+1],NULL,10);
+				request.filtered=1;
+			} else if(!strcmp(argv[arg],"-s")){
+				request.from=strtoll(argv[arg+1],NULL,10)*NS;
+			} else if(!strcmp(argv[arg],"-e")){
+				request.to=strtoll(argv[arg+1],NULL,10)*NS+NS-1;
+			} else if(!strcmp(argv[arg],"-c")){
+				request.channel=atoi(argv[arg+1]);
+			} else {
+				usage();
+				return 1;
+			}
+		}
+		if(arg<argc){
+			usage();
+			return 1;
+		}
+		return query(argv[2],&request);
+	}
+
+	usage();
+	return 1;
+}
@@ -0,0 +1,336 @@
+/*
+ * flexstream.c
+ *
+ * Parser for the serial output of the AVR decoder, see flexstream.h
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "flexstream.h"
+#include "flexproto.h"
+
+struct message;
+#include "binproto.h"
+
+#define TAG_FRAME "[[frame]]"
+#define TAG_END "[[/frame]]"
+#define TAG_MSG "[[msg]]"
+#define TAG_MSGEND "[[/msg]]"
+#define TAG_TELEMETRY "[[telemetry]]"
+#define TAG_TRUNCATED "[MSG TRUNCATED]"
+
+// longest record that is waited for, longer ones can't be complete (a message has at most 1024 characters)
+#define RECORD_MAX 8192
+// same for a binary record, which is waited for after every 0 (trace records can hold 0 bytes as well)
+#define BINARY_MAX 2048
+
+static int startsWith(const uint8_t* pos, const uint8_t* end, const char* tag){
+	size_t length = strlen(tag);
+	return ((size_t)(end-pos)>=length)&&!memcmp(pos,tag,length);
+}
+
+// 1 if the bytes up to end are the start of tag, so it can't be decided yet
+static int partialTag(const uint8_t* pos, const uint8_t* end, const char* tag){
+	size_t length = strlen(tag);
+	return ((size_t)(end-pos)<length)&&!memcmp(pos,tag,end-pos);
+}
+
+static const uint8_t* findTag(const uint8_t* pos, const uint8_t* end, const char* tag){
+	return memmem(pos,end-pos,tag,strlen(tag));
+}
+
+// end of the line at pos (after the \n\r), or NULL if it isn't complete
+static const uint8_t* lineEnd(const uint8_t* pos, const uint8_t* end){
+	pos=memchr(pos,'\n',end-pos);
+	if(!pos)return NULL;
+	pos++;
+	if(pos==end)return NULL;
+	if(*pos=='\r')pos++;
+	return pos;
+}
+
+static unsigned long parseNumber(const uint8_t** pos, const uint8_t* end){
+	unsigned long value = 0;
+	while((*pos<end)&&(**pos>='0')&&(**pos<='9')){
+		value=value*10+(*(*pos)++-'0');
+	}
+	return value;
+}
+
+// fills in a message item from the text between [[msg]] and [[/msg]]
+static void parseMessage(struct flexitem* item, const uint8_t* pos, const uint8_t* end){
+	const uint8_t* close;
+	while(pos<end){
+		if(startsWith(pos,end,"[[priority]]")){
+			item->priority=1;
+		} else if(startsWith(pos,end,"[[addr]]")){
+			pos+=8;
+			if(item->addresscount<ITEM_ADDRESSES)item->capcode[item->addresscount++]=parseNumber(&pos,end);
+		} else if(startsWith(pos,end,"[[data]]")){
+			pos+=8;
+			close=findTag(pos,end,"[[/data]]");
+			if(!close)return;
+			item->text=(const char*)pos;
+			item->textlength=close-pos;
+			pos=close+9;
+		} else if(startsWith(pos,end,"[[bin]]")){
+			pos+=7;
+			close=findTag(pos,end,"[[/bin]]");
+			if(!close)return;
+			item->payload=pos;
+			item->payloadlength=close-pos;
+			item->payloadhex=1;
+			pos=close+8;
+		}
+		pos=memchr(pos,'\n',end-pos);
+		if(!pos)return;
+		pos++;
+		if((pos<end)&&(*pos=='\r'))pos++;
+	}
+}
+
+static void parseRecord(struct flexitem* item, struct flexrecord* record){
+	const uint8_t* pos = record->addresses;
+	uint64_t capcode;
+	uint16_t count;
+	switch(record->type){
+		case BINPROTO_FRAME:
+		case BINPROTO_END:
+			item->type=(record->type==BINPROTO_FRAME)?ITEM_FRAME:ITEM_END;
+			item->cycle=record->cycle;
+			item->frame=record->frame;
+			break;
+		default:
+			item->type=ITEM_MESSAGE;
+			item->priority=(record->type==BINPROTO_PRIORITY);
+			item->truncated=(record->type==BINPROTO_TRUNCATED);
+			for(count=0;count<record->addresscount;count++){
+				pos=flexNextAddress(pos,&capcode);
+				if(item->addresscount<ITEM_ADDRESSES)item->capcode[item->addresscount++]=capcode;
+			}
+			item->text=record->text;
+			item->textlength=record->textlength;
+			item->payload=record->payload;
+			item->payloadlength=record->payloadlength;
+			break;
+	}
+}
+
+size_t flexStreamParse(const uint8_t* data, size_t length, int final, flexitemcallback callback, void* context){
+	const uint8_t* pos = data;
+	const uint8_t* end = data+length;
+	const uint8_t* close;
+	const uint8_t* next;
+	struct flexitem item;
+	struct flexrecord record;
+	uint8_t decoded[BINARY_MAX];
+	const uint8_t* zero;
+	int valid;
+
+	while(pos<end){
+		memset(&item,0,offsetof(struct flexitem,capcode));
+		item.text=NULL;
+		item.textlength=0;
+		item.payload=NULL;
+		item.payloadlength=0;
+		item.payloadhex=0;
+		if(*pos==0){
+			// binary record, up to the next 0. If it doesn't parse, only the first 0 is skipped, the rest may be text
+			zero=memchr(pos+1,0,end-pos-1);
+			if(!zero){
+				if(!final&&(end-pos<BINARY_MAX))break;
+				pos++;
+				continue;
+			}
+			// decoding changes the bytes, so it's done on a copy in case they turn out to be text
+			if((zero>pos+1)&&(zero-pos-1<=BINARY_MAX)){
+				memcpy(decoded,pos+1,zero-pos-1);
+				valid=flexRecordParse(decoded,zero-pos-1,&record);
+			} else {
+				valid=0;
+			}
+			if(valid){
+				parseRecord(&item,&record);
+				callback(&item,context);
+				pos=zero+1;
+			} else {
+				pos++;
+			}
+			continue;
+		}
+		if(*pos!='['){
+			pos++;
+			continue;
+		}
+		if(startsWith(pos,end,TAG_MSG)){
+			close=findTag(pos,end,TAG_MSGEND);
+			// a record that was cut off by lost bytes is dropped when the next one starts
+			next=findTag(pos+1,close?close:end,"[[msg]]");
+			if(!next)next=findTag(pos+1,close?close:end,TAG_FRAME);
+			if(next){
+				pos=next;
+				continue;
+			}
+			if(!close||!(next=lineEnd(close,end))){
+				if(!final&&(end-pos<RECORD_MAX))break;
+				pos++;
+				continue;
+			}
+			if(startsWith(next,end,TAG_TRUNCATED)){
+				item.truncated=1;
+				if(!(next=lineEnd(next,end))){
+					if(!final)break;
+					next=end;
+				}
+			} else if(!final&&partialTag(next,end,TAG_TRUNCATED)){
+				break;
+			}
+			item.type=ITEM_MESSAGE;
+			item.raw=(const char*)pos;
+			item.rawlength=next-pos;
+			parseMessage(&item,pos+strlen(TAG_MSG),close);
+			callback(&item,context);
+			pos=next;
+			continue;
+		}
+		if(startsWith(pos,end,TAG_FRAME)||startsWith(pos,end,TAG_END)||startsWith(pos,end,TAG_TELEMETRY)){
+			next=lineEnd(pos,end);
+			if(!next){
+				if(!final&&(end-pos<RECORD_MAX))break;
+				pos++;
+				continue;
+			}
+			item.raw=(const char*)pos;
+			item.rawlength=next-pos;
+			if(pos[2]=='f'){
+				item.type=ITEM_FRAME;
+				close=pos+strlen(TAG_FRAME);
+				item.cycle=parseNumber(&close,next);
+				if((close<next)&&(*close=='|'))close++;
+				item.frame=parseNumber(&close,next);
+			} else if(pos[2]=='/'){
+				item.type=ITEM_END;
+			} else {
+				item.type=ITEM_TELEMETRY;
+				item.text=(const char*)pos+strlen(TAG_TELEMETRY);
+				item.textlength=next-(const uint8_t*)item.text;
+				while(item.textlength&&((item.text[item.textlength-1]=='\n')||(item.text[item.textlength-1]=='\r'))){
+					item.textlength--;
+				}
+			}
+			callback(&item,context);
+			pos=next;
+			continue;
+		}
+		// wait for the rest of a tag that was cut in half
+		if(!final&&(partialTag(pos,end,TAG_MSG)||partialTag(pos,end,TAG_FRAME)||partialTag(pos,end,TAG_END)||
+				partialTag(pos,end,TAG_TELEMETRY))){
+			break;
+		}
+		pos++;
+	}
+	return pos-data;
+}
+
+int flexInputInit(struct flexinput* input, size_t size){
+	int fd;
+	uint8_t* map;
+	long page = sysconf(_SC_PAGESIZE);
+
+	size=(size+page-1)/page*page;
+	fd=memfd_create("flexinput",0);
+	if(fd<0)return 0;
+	if(ftruncate(fd,size)){
+		close(fd);
+		return 0;
+	}
+	// reserve twice the size, and map the same memory into both halves
+	map=mmap(NULL,size*2,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	if(map==MAP_FAILED){
+		close(fd);
+		return 0;
+	}
+	if((mmap(map,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0)==MAP_FAILED)||
+			(mmap(map+size,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0)==MAP_FAILED)){
+		munmap(map,size*2);
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	input->data=map;
+	input->size=size;
+	input->head=0;
+	input->tail=0;
+	return 1;
+}
+
+ssize_t flexInputRead(struct flexinput* input, int fd){
+	ssize_t length;
+	if(input->head-input->tail>=input->size){
+		// nothing parsed in a full ring, drop the oldest half
+		input->tail+=input->size/2;
+	}
+	length=read(fd,input->data+(input->head%input->size),input->size-(input->head-input->tail));
+	if(length>0)input->head+=length;
+	return length;
+}
+
+void flexInputParse(struct flexinput* input, int final, flexitemcallback callback, void* context){
+	input->tail+=flexStreamParse(input->data+(input->tail%input->size),input->head-input->tail,final,callback,context);
+}
+
+// printf at the end of the output, cut short at max
+static size_t append(char* out, size_t max, size_t length, const char* format, ...){
+	va_list args;
+	int count;
+	if(length>=max)return length;
+	va_start(args,format);
+	count=vsnprintf(out+length,max-length,format,args);
+	va_end(args);
+	if(count<0)return length;
+	length+=count;
+	return (length<max)?length:max-1;
+}
+
+size_t flexFormatItem(const struct flexitem* item, char* out, size_t max){
+	size_t length = 0;
+	size_t count;
+	if(!max)return 0;
+	if(item->raw){
+		length=(item->rawlength<max)?item->rawlength:max;
+		memcpy(out,item->raw,length);
+		return length;
+	}
+	// binary records, in the text format as flexlog shows them
+	switch(item->type){
+		case ITEM_FRAME:
+			return append(out,max,0,"[[frame]]%u|%u\n\r",item->cycle,item->frame);
+		case ITEM_END:
+			return append(out,max,0,"[[/frame]]\n\r");
+		case ITEM_TELEMETRY:
+			return append(out,max,0,"[[telemetry]]%.*s\n\r",(int)item->textlength,item->text);
+	}
+	length=append(out,max,length,"[[msg]]\n\r");
+	if(item->priority)length=append(out,max,length,"[[priority]]\n\r");
+	for(count=0;count<item->addresscount;count++){
+		length=append(out,max,length,"[[addr]]%llu\n\r",(unsigned long long)item->capcode[count]);
+	}
+	length=append(out,max,length,"[[data]]%.*s[[/data]]\n\r",(int)item->textlength,item->text);
+	if(item->payloadlength){
+		length=append(out,max,length,"[[bin]]");
+		for(count=0;count<item->payloadlength;count++){
+			length=append(out,max,length,item->payloadhex?"%c":"%02X",item->payload[count]);
+		}
+		length=append(out,max,length,"[[/bin]]\n\r");
+	}
+	length=append(out,max,length,"[[/msg]]\n\r");
+	if(item->truncated)length=append(out,max,length,"[MSG TRUNCATED]\n\r");
+	return length;
+}
@@ -0,0 +1,74 @@
+/*
+ * flexstream.h
+ *
+ * Parser for the output of the AVR decoder as it comes in over the serial port: the [[frame]]/[[msg]] text records,
+ * the binary records of protocol v2 (see binproto.h), and the [[telemetry]] lines. Text records are parsed where they
+ * are in the receive buffer, items point into it (binary records are decoded in a copy). Everything else (trace records, chunk markers) is skipped.
+ *
+ * The receive buffer is a ring that is mapped twice, back to back, so the unread part is always contiguous and a
+ * record that wraps around the end of the ring can still be parsed in place.
+ *
+ * Build along with the tool that uses it: gcc -O2 -Wall -I"../AVR - FlexDecoder" -o tool tool.c flexstream.c flexproto.c
+ */
+
+#ifndef FLEXSTREAM_H_
+#define FLEXSTREAM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// item types
+#define ITEM_FRAME 1
+#define ITEM_END 2
+#define ITEM_MESSAGE 3
+#define ITEM_TELEMETRY 4
+
+// most addresses kept for a single message
+#define ITEM_ADDRESSES 128
+
+// a record, valid during the callback only
+struct flexitem {
+	int type;
+	const char* raw;				// the record as received, NULL for binary records
+	size_t rawlength;
+	uint8_t cycle;					// frame and end items
+	uint8_t frame;
+	uint8_t priority;				// message items
+	uint8_t truncated;
+	uint16_t addresscount;
+	uint64_t capcode[ITEM_ADDRESSES];
+	const char* text;				// message text, or the telemetry figures
+	size_t textlength;
+	const uint8_t* payload;			// hex and secure payload
+	size_t payloadlength;
+	uint8_t payloadhex;				// 1 if the payload is in hex digits (text records), 0 for bytes (binary records)
+};
+
+typedef void (*flexitemcallback)(const struct flexitem* item, void* context);
+
+// receive buffer, a ring that is mapped twice
+struct flexinput {
+	uint8_t* data;
+	size_t size;
+	size_t head;					// total bytes written
+	size_t tail;					// total bytes parsed
+};
+
+/** Allocates a receive ring of (at least) size bytes. Returns 0 on failure */
+int flexInputInit(struct flexinput* input, size_t size);
+
+/** Reads from fd into the ring. Returns the result of read(), 0 at the end of the input */
+ssize_t flexInputRead(struct flexinput* input, int fd);
+
+/** Parses all complete records in the ring, and calls the callback for each one. Set final at the end of the input */
+void flexInputParse(struct flexinput* input, int final, flexitemcallback callback, void* context);
+
+/** Parses complete records from a contiguous buffer. Returns the number of bytes used, the rest is an incomplete
+ *  record that has to be passed again with more data behind it. With final set, incomplete records are skipped */
+size_t flexStreamParse(const uint8_t* data, size_t length, int final, flexitemcallback callback, void* context);
+
+/** Writes an item in the text format of the decoder (as it was received, for text records). Returns the length, the
+ *  output is cut short at max bytes */
+size_t flexFormatItem(const struct flexitem* item, char* out, size_t max);
+
+#endif /* FLEXSTREAM_H_ */
@@ -0,0 +1,76 @@
+/*
+ * flexwatch.c
+ *
+ * Shows the frames and messages that flexbridge publishes in the shared memory ring (see flexshm.h), in the
+ * [[frame]]/[[msg]] text format of the decoder. Records that were missed because the ring overran the reader are
+ * reported, and with -l the time from publishing to reading is shown for every message.
+ *
+ * Build: gcc -O2 -Wall -I"../AVR - FlexDecoder" -o flexwatch flexwatch.c flexshm.c flexstream.c flexproto.c
+ * Usage: flexwatch [-o] [-l] [name]   (-o starts at the oldest record in the ring, name defaults to /flexring)
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "flexshm.h"
+
+static uint64_t now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+	return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+int main(int argc, char** argv){
+	const char* name = FLEXSHM_NAME;
+	int oldest = 0;
+	int latency = 0;
+	int arg;
+	uint64_t lost = 0;
+	uint64_t received;
+	uint64_t published;
+	static char text[32768];
+	size_t length;
+	const struct shmrecord* record;
+	struct flexitem item;
+	struct flexshm shm;
+	struct flexshmreader reader;
+
+	for(arg=1;arg<argc;arg++){
+		if(!strcmp(argv[arg],"-o")){
+			oldest=1;
+		} else if(!strcmp(argv[arg],"-l")){
+			latency=1;
+		} else {
+			name=argv[arg];
+		}
+	}
+	if(!flexShmOpen(&shm,name)){
+		fprintf(stderr,"flexwatch: %s: no ring, is flexbridge running with -r?\n",name);
+		return 1;
+	}
+	flexShmReaderInit(&reader,&shm,oldest);
+
+	while(1){
+		while((record=flexShmNext(&reader))){
+			received=now();
+			published=record->time;
+			flexShmItem(record,&item);
+			length=flexFormatItem(&item,text,sizeof(text));
+			// the record may have been overwritten while it was formatted
+			if(!flexShmCheck(&reader))continue;
+			if(reader.lost!=lost){
+				printf("[lost %llu records]\n",(unsigned long long)(reader.lost-lost));
+				lost=reader.lost;
+			}
+			fwrite(text,1,length,stdout);
+			if(latency&&(item.type==ITEM_MESSAGE)){
+				printf("[latency %.1f us]\n",(double)(received-published)/1000.0);
+			}
+		}
+		fflush(stdout);
+		flexShmWait(&reader,-1);
+	}
+	return 0;
+}
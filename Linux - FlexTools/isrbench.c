@@ -0,0 +1,472 @@
+/*
+ * isrbench.c
+ *
+ * Cycle-accurate ISR budget benchmark for the AVR decoder. Runs the firmware under simavr, feeds a synthetic (or
+ * recorded) FLEX edge stream into ICP1, and collects the profiling markers the firmware writes to GPIOR0/GPIOR1 when it
+ * is built with ISRPROFILE (see flex.h). Reports worst case and percentile cycle counts per ISR, per state-machine state
+ * and per processFrame() call, and exits with 1 when any path exceeds its budget.
+ *
+ * ISR budgets apply to the exclusive cycle count (nested probes subtracted), block validation and frame processing
+ * budgets apply to the inclusive count, as those run with interrupts enabled and only have to finish in time.
+ *
+ * Build the firmware (from the AVR - FlexDecoder directory):
+ *   avr-gcc -mmcu=atmega328p -Os -funsigned-char -fcommon -DISRPROFILE -o flex-profile.elf *.c
+ * Build the benchmark:
+ *   gcc -O2 -Wall -o isrbench isrbench.c -lsimavr -lelf
+ * Usage:
+ *   isrbench [-f frames] [-s seed] [-e bit-error-rate] [-r edgefile] [-b probe=cycles] flex-profile.elf
+ *
+ * A recorded edge file holds one edge per line, as the absolute time in microseconds since the start of the capture.
+ * The signal is low before the first edge.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_timer.h>
+
+// these have to match flex.h
+#define STDBIT 10000
+#define PROBE_CAPT 1
+#define PROBE_COMPA 2
+#define PROBE_COMPB 3
+#define PROBE_ADC 4
+#define PROBE_TIMER0 5
+#define PROBE_BLOCK 6
+#define PROBE_FRAME 7
+#define PROFILE_END_FLAG 0x80
+#define PROBES 8
+#define STATES 16
+
+// ATmega328P data-space addresses of the general purpose I/O registers
+#define GPIOR0_ADDR 0x3E
+#define GPIOR1_ADDR 0x4A
+
+static const char* probename[PROBES] = { "", "TIMER1_CAPT", "TIMER1_COMPA", "TIMER1_COMPB", "ADC", "TIMER0_COMPA", "validateBlock", "processFrame" };
+static const char* statename[STATES] = { "WAIT_SYNC", "SYNCED", "2", "SYNC_B", "SYNC_NOT_A1", "FRAME_INFO", "SYNC_BS2", "SYNC_C",
+	"SYNC_NOT_BS2", "SYNC_NOT_C", "BLOCK", "IDLE", "IDLE_PROC_STARTED", "13", "14", "15" };
+
+// budget in cycles per probe, and whether it applies to the inclusive count
+static uint64_t budget[PROBES] = { 0, STDBIT, STDBIT, STDBIT, 1664, 128000, 256UL*STDBIT, 11UL*256*STDBIT };
+static const uint8_t inclusive[PROBES] = { 0, 0, 0, 0, 0, 0, 1, 1 };
+
+struct samples {
+	uint64_t* value;
+	size_t count;
+	size_t size;
+};
+
+// samples per probe and state (the state is only tracked for COMPB)
+static struct samples stats[PROBES][STATES];
+
+// stack of running probes, interrupts nest
+struct running {
+	uint8_t probe;
+	uint8_t state;
+	uint64_t start;
+	uint64_t children;
+};
+static struct running stack[32];
+static int depth = 0;
+static uint8_t laststate = 0;
+static int markererrors = 0;
+
+// the edge stream, as absolute cycle counts
+static uint64_t* edges;
+static size_t edgecount = 0;
+static size_t edgesize = 0;
+static size_t nextedge = 0;
+static uint8_t level = 0;
+static avr_irq_t* pinirq;
+static avr_irq_t* icpirq;
+
+static void addSample(struct samples* s, uint64_t value){
+	if(s->count==s->size){
+		s->size = s->size ? s->size*2 : 1024;
+		s->value = realloc(s->value,s->size*sizeof(uint64_t));
+		if(!s->value){
+			perror("realloc");
+			exit(2);
+		}
+	}
+	s->value[s->count++]=value;
+}
+
+static void addEdge(uint64_t cycle){
+	if(edgecount==edgesize){
+		edgesize = edgesize ? edgesize*2 : 65536;
+		edges = realloc(edges,edgesize*sizeof(uint64_t));
+		if(!edges){
+			perror("realloc");
+			exit(2);
+		}
+	}
+	edges[edgecount++]=cycle;
+}
+
+/*
+ * Synthetic FLEX stream
+ */
+
+static uint64_t bitcount = 0;
+// the pin idles low, which reads as a 1 bit
+static uint8_t lastbit = 1;
+static double errorrate = 0;
+
+static void sendBit(uint8_t bit){
+	// the decoder reads an inverted pin, so a change of bit is an edge
+	if(bit!=lastbit)addEdge(bitcount*STDBIT);
+	lastbit = bit;
+	bitcount++;
+}
+
+static void sendLSB(uint32_t value, uint8_t bits){
+	uint8_t count;
+	for(count=0;count<bits;count++)sendBit((value>>count)&1);
+}
+
+// same BCH(31,21) and parity as createCRC() in flex.c
+static uint32_t createCRC(uint32_t in){
+	uint32_t cw = in;
+	uint32_t local = in;
+	uint32_t parity = 0;
+	int bit;
+	for(bit=1;bit<=21;bit++,cw<<=1){
+		if(cw&0x80000000)cw^=0xED200000;
+	}
+	local|=(cw>>21);
+	for(cw=local;cw;cw>>=1)parity+=cw&1;
+	if(parity%2)local++;
+	return local;
+}
+
+// builds a word from a 21 bit value as it's defined in the FLEX spec (first transmitted bit is bit 0)
+static uint32_t makeWord(uint32_t value){
+	uint32_t reversed = 0;
+	uint8_t count;
+	for(count=0;count<21;count++){
+		if(value&(1UL<<count))reversed|=1UL<<(20-count);
+	}
+	return createCRC(reversed<<11);
+}
+
+// same as validateChecksum() in flex.c: the four checksum bits make the nibble sum of the word 0xF
+static uint32_t makeCheckedWord(uint32_t value){
+	uint32_t sum = 0;
+	uint32_t copy = value>>4;
+	while(copy){
+		sum+=copy&0x0F;
+		copy>>=4;
+	}
+	return makeWord((value&~0x0FUL)|((~sum)&0x0F));
+}
+
+// adds up a 21 bit value in groups of 8, 8 and 5 bits, for the fragment check of alpha messages
+static uint16_t infoSum(uint32_t value){
+	return (value&0xFF)+((value>>8)&0xFF)+((value>>16)&0x1F);
+}
+
+// flips bits at the configured bit error rate
+static uint32_t addErrors(uint32_t word){
+	uint8_t count;
+	for(count=0;count<32;count++){
+		if((double)rand()/RAND_MAX<errorrate)word^=1UL<<count;
+	}
+	return word;
+}
+
+static void sendFrame(uint8_t cycle, uint8_t frame){
+	uint32_t words[88];
+	uint8_t messages = rand()%8;
+	uint8_t vectorstart = 1+messages;
+	uint8_t word = vectorstart+messages;
+	uint8_t count;
+	uint8_t length;
+	uint8_t block;
+	uint32_t header;
+	uint32_t content;
+	uint16_t check;
+	uint8_t signature;
+	int bit;
+
+	// address and vector fields, followed by alpha messages of random length
+	memset(words,0,sizeof(words));
+	words[0]=makeCheckedWord((vectorstart<<10));
+	for(count=0;count<messages;count++){
+		length = 2+rand()%12;
+		if(word+length>88)length = 0;
+		words[1+count]=makeWord(0x8001+rand()%0x1F0000);
+		words[vectorstart+count]=makeCheckedWord((5<<4)|(word<<7)|(length<<14));
+		if(length){
+			header=(3<<11)|((rand()%64)<<13);
+			check=infoSum(header);
+			signature=0;
+			for(bit=1;bit<length;bit++){
+				content=0x20+rand()%0x5F+((0x20+rand()%0x5F)<<7)+((0x20+rand()%0x5F)<<14);
+				// the first character is the signature, the sum of all other characters
+				if(bit==1){
+					content&=~0x7FUL;
+				} else {
+					signature+=content&0x7F;
+				}
+				signature+=((content>>7)&0x7F)+(content>>14);
+				words[word+bit]=content;
+			}
+			words[word+1]|=(~signature)&0x7F;
+			for(bit=1;bit<length;bit++){
+				check+=infoSum(words[word+bit]);
+				words[word+bit]=makeWord(words[word+bit]);
+			}
+			words[word]=makeWord(header|((~check)&0x3FF));
+			word+=length;
+		}
+	}
+	// the rest of the frame is idle
+	for(;word<88;word++){
+		words[word]=(word&1) ? 0xFFFFFFFF : 0x00000000;
+	}
+
+	// sync 1, FIW, sync 2
+	sendLSB(0x9c9acf1e,32);
+	sendLSB(0xAAAA,16);
+	sendLSB(~(uint32_t)0x9c9acf1e,32);
+	{
+		uint32_t fiw = makeCheckedWord((cycle<<4)|(frame<<8));
+		for(bit=31;bit>=0;bit--)sendBit((fiw>>bit)&1);
+	}
+	sendLSB(0x05,4);
+	sendLSB(0x1234,16);
+	sendLSB(0x0A,4);
+	sendLSB(0xDE48,16);
+
+	// interleaved blocks
+	for(count=0;count<88;count++){
+		if((words[count]!=0)&&(words[count]!=0xFFFFFFFF))words[count]=addErrors(words[count]);
+	}
+	for(block=0;block<11;block++){
+		for(bit=31;bit>=0;bit--){
+			for(count=0;count<8;count++)sendBit((words[block*8+count]>>bit)&1);
+		}
+	}
+}
+
+static void buildSynthetic(uint32_t frames){
+	uint32_t count;
+	// bit sync preamble
+	for(count=0;count<64;count++)sendBit(count&1);
+	for(count=0;count<frames;count++)sendFrame((count/128)%15,count%128);
+	// some trailing bits so the last frame completes
+	for(count=0;count<512;count++)sendBit(count&1);
+}
+
+static int loadRecording(const char* file){
+	FILE* f = fopen(file,"r");
+	double us;
+	if(!f){
+		perror(file);
+		return -1;
+	}
+	while(fscanf(f,"%lf",&us)==1)addEdge((uint64_t)(us*16));
+	fclose(f);
+	return 0;
+}
+
+/*
+ * simavr hooks
+ */
+
+static avr_cycle_count_t edgeTimer(avr_t* avr, avr_cycle_count_t when, void* param){
+	(void)avr;(void)when;(void)param;
+	level = !level;
+	avr_raise_irq(pinirq,level);
+	avr_raise_irq(icpirq,level);
+	nextedge++;
+	if(nextedge>=edgecount)return 0;
+	return edges[nextedge];
+}
+
+static void stateWrite(avr_t* avr, avr_io_addr_t addr, uint8_t value, void* param){
+	(void)avr;(void)addr;(void)param;
+	laststate = value&(STATES-1);
+}
+
+static void markerWrite(avr_t* avr, avr_io_addr_t addr, uint8_t value, void* param){
+	uint8_t probe = value&~PROFILE_END_FLAG;
+	uint64_t elapsed;
+	(void)addr;(void)param;
+	if(probe==0||probe>=PROBES){
+		markererrors++;
+		return;
+	}
+	if(!(value&PROFILE_END_FLAG)){
+		if(depth==32){
+			markererrors++;
+			return;
+		}
+		stack[depth].probe = probe;
+		stack[depth].state = probe==PROBE_COMPB ? laststate : 0;
+		stack[depth].start = avr->cycle;
+		stack[depth].children = 0;
+		depth++;
+		return;
+	}
+	if((depth==0)||(stack[depth-1].probe!=probe)){
+		markererrors++;
+		return;
+	}
+	depth--;
+	elapsed = avr->cycle-stack[depth].start;
+	if(depth)stack[depth-1].children+=elapsed;
+	addSample(&stats[probe][stack[depth].state], inclusive[probe] ? elapsed : elapsed-stack[depth].children);
+}
+
+/*
+ * reporting
+ */
+
+static int compareCycles(const void* a, const void* b){
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x>y)-(x<y);
+}
+
+static uint64_t percentile(struct samples* s, double p){
+	size_t index = (size_t)(p*(s->count-1)+0.5);
+	return s->value[index];
+}
+
+// prints a line for a set of samples, returns 1 if it's over budget
+static int report(const char* name, struct samples* s, uint64_t limit){
+	uint64_t worst;
+	if(!s->count)return 0;
+	qsort(s->value,s->count,sizeof(uint64_t),compareCycles);
+	worst = s->value[s->count-1];
+	printf("%-32s %9zu %10llu %10llu %10llu %10llu %10llu%s\n", name, s->count,
+		(unsigned long long)percentile(s,0.5), (unsigned long long)percentile(s,0.99), (unsigned long long)percentile(s,0.999),
+		(unsigned long long)worst, (unsigned long long)limit, worst>limit ? "  OVER BUDGET" : "");
+	return worst>limit;
+}
+
+int main(int argc, char** argv){
+	elf_firmware_t firmware;
+	avr_t* avr;
+	uint32_t frames = 64;
+	unsigned int seed = 1;
+	const char* recording = NULL;
+	int opt;
+	int probe;
+	int state;
+	int over = 0;
+	char name[64];
+	uint64_t end;
+
+	while((opt=getopt(argc,argv,"f:s:e:r:b:"))!=-1){
+		switch(opt){
+			case 'f':
+				frames = strtoul(optarg,NULL,0);
+				break;
+			case 's':
+				seed = strtoul(optarg,NULL,0);
+				break;
+			case 'e':
+				errorrate = strtod(optarg,NULL);
+				break;
+			case 'r':
+				recording = optarg;
+				break;
+			case 'b':
+				for(probe=1;probe<PROBES;probe++){
+					size_t length = strlen(probename[probe]);
+					if(!strncmp(optarg,probename[probe],length)&&(optarg[length]=='=')){
+						budget[probe]=strtoull(optarg+length+1,NULL,0);
+						break;
+					}
+				}
+				if(probe==PROBES){
+					fprintf(stderr,"unknown probe in budget '%s'\n",optarg);
+					return 2;
+				}
+				break;
+			default:
+				fprintf(stderr,"usage: %s [-f frames] [-s seed] [-e bit-error-rate] [-r edgefile] [-b probe=cycles] firmware.elf\n",argv[0]);
+				return 2;
+		}
+	}
+	if(optind>=argc){
+		fprintf(stderr,"no firmware given\n");
+		return 2;
+	}
+
+	srand(seed);
+	if(recording){
+		if(loadRecording(recording))return 2;
+	} else {
+		buildSynthetic(frames);
+	}
+	if(!edgecount){
+		fprintf(stderr,"no edges to feed\n");
+		return 2;
+	}
+
+	memset(&firmware,0,sizeof(firmware));
+	if(elf_read_firmware(argv[optind],&firmware)){
+		fprintf(stderr,"unable to load %s\n",argv[optind]);
+		return 2;
+	}
+	avr = avr_make_mcu_by_name("atmega328p");
+	if(!avr){
+		fprintf(stderr,"simavr has no atmega328p core\n");
+		return 2;
+	}
+	avr_init(avr);
+	avr->frequency = 16000000;
+	avr_load_firmware(avr,&firmware);
+
+	pinirq = avr_io_getirq(avr,AVR_IOCTL_IOPORT_GETIRQ('B'),0);
+	icpirq = avr_io_getirq(avr,AVR_IOCTL_TIMER_GETIRQ('1'),TIMER_IRQ_IN_ICP);
+	avr_register_io_write(avr,GPIOR0_ADDR,stateWrite,NULL);
+	avr_register_io_write(avr,GPIOR1_ADDR,markerWrite,NULL);
+
+	// the pin idles low (a 1 bit), give the firmware some time to start before the first edge
+	avr_raise_irq(pinirq,0);
+	for(opt=0;opt<(int)edgecount;opt++)edges[opt]+=160000;
+	avr_cycle_timer_register(avr,edges[0],edgeTimer,NULL);
+	end = edges[edgecount-1]+16UL*STDBIT*256;
+
+	state = cpu_Running;
+	while((state!=cpu_Done)&&(state!=cpu_Crashed)&&(avr->cycle<end)){
+		state = avr_run(avr);
+	}
+	if(state==cpu_Crashed){
+		fprintf(stderr,"firmware crashed at cycle %llu\n",(unsigned long long)avr->cycle);
+		return 2;
+	}
+	if(!stats[PROBE_COMPB][0].count&&!stats[PROBE_COMPB][1].count){
+		fprintf(stderr,"no profiling markers seen, was the firmware built with -DISRPROFILE?\n");
+		return 2;
+	}
+
+	printf("%-32s %9s %10s %10s %10s %10s %10s\n","path (cycles)","count","p50","p99","p99.9","worst","budget");
+	for(probe=1;probe<PROBES;probe++){
+		if(probe==PROBE_COMPB){
+			for(state=0;state<STATES;state++){
+				snprintf(name,sizeof(name),"%s/%s",probename[probe],statename[state]);
+				over|=report(name,&stats[probe][state],budget[probe]);
+			}
+		} else {
+			over|=report(probename[probe],&stats[probe][0],budget[probe]);
+		}
+	}
+	if(markererrors){
+		printf("%d unmatched profiling markers\n",markererrors);
+	}
+	return over ? 1 : 0;
+}